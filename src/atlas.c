@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include "atlas.h"
+#include "texture_cache.h"
+
+static texture_t* atlas_pages[MAX_TEXTURE_ATLAS_PAGES];
+static int num_atlas_pages = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Only square power of two textures are packed, so that every image sits at
+// a position aligned to its size and the box filtered mip levels of the page
+// are exactly the mip levels of the images
+///////////////////////////////////////////////////////////////////////////////
+bool can_pack_texture(texture_t* texture) {
+	if (texture == NULL || texture->atlas_page != NULL) {
+		return false;
+	}
+	texture_level_t* level = &texture->levels[0];
+	return level->is_power_of_two && level->width == level->height && level->width <= TEXTURE_ATLAS_MAX_TEXTURE_SIZE && level->texels != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Position of the n-th texel along the Z-order (Morton) curve
+///////////////////////////////////////////////////////////////////////////////
+static int morton_decode(uint32_t code) {
+	code &= 0x55555555;
+	code = (code | (code >> 1)) & 0x33333333;
+	code = (code | (code >> 2)) & 0x0F0F0F0F;
+	code = (code | (code >> 4)) & 0x00FF00FF;
+	code = (code | (code >> 8)) & 0x0000FFFF;
+	return (int)code;
+}
+
+static int compare_texture_size(const void* a, const void* b) {
+	const texture_t* texture_a = *(const texture_t**)a;
+	const texture_t* texture_b = *(const texture_t**)b;
+	return texture_b->levels[0].width - texture_a->levels[0].width;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copy the images into a new page, build its mip chain and turn the packed
+// textures into views of the page
+///////////////////////////////////////////////////////////////////////////////
+static void create_atlas_page(texture_t** textures, int* positions, int num_textures, int page_size) {
+	texture_t* page = (texture_t*)calloc(1, sizeof(texture_t));
+	page->num_levels = 1;
+	page->levels[0].width = page_size;
+	page->levels[0].height = page_size;
+	page->levels[0].texels = (uint32_t*)calloc(page_size * page_size, sizeof(uint32_t));
+
+	for (int i = 0; i < num_textures; i++) {
+		texture_t* texture = textures[i];
+		texture_descriptor_t source = get_level_descriptor(&texture->levels[0]);
+		int x0 = positions[i * 2 + 0];
+		int y0 = positions[i * 2 + 1];
+		for (int y = 0; y < source.height; y++) {
+			for (int x = 0; x < source.width; x++) {
+				page->levels[0].texels[(page_size * (y0 + y)) + x0 + x] = get_texel(&source, x, y);
+			}
+		}
+	}
+
+	generate_texture_mipmaps(page);
+	for (int i = 0; i < page->num_levels; i++) {
+		tile_texture_level(&page->levels[i]);
+	}
+	write_texture_cache(page);
+	register_texture(page);
+	atlas_pages[num_atlas_pages++] = page;
+
+	// The packed textures keep their level sizes for the LOD selection but no texels
+	for (int i = 0; i < num_textures; i++) {
+		texture_t* texture = textures[i];
+		unregister_texture(texture);
+		for (int l = 0; l < texture->num_levels; l++) {
+			free(texture->levels[l].texels);
+			texture->levels[l].texels = NULL;
+		}
+		texture->is_cached = false;
+		texture->atlas_page = page;
+		texture->atlas_x = positions[i * 2 + 0];
+		texture->atlas_y = positions[i * 2 + 1];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pack textures into as few atlas pages as possible
+///////////////////////////////////////////////////////////////////////////////
+// Sorted from the largest to the smallest, power of two squares laid out one
+// after the other along a Z-order curve always start at a multiple of their
+// own area, which puts them at a position aligned to their size without any
+// gaps. Returns the number of textures that were packed.
+///////////////////////////////////////////////////////////////////////////////
+int pack_texture_atlas(texture_t** textures, int num_textures) {
+	texture_t** candidates = (texture_t**)malloc(sizeof(texture_t*) * num_textures);
+	int* positions = (int*)malloc(sizeof(int) * num_textures * 2);
+	int num_candidates = 0;
+	for (int i = 0; i < num_textures; i++) {
+		if (can_pack_texture(textures[i])) {
+			candidates[num_candidates++] = textures[i];
+		}
+	}
+	qsort(candidates, num_candidates, sizeof(texture_t*), compare_texture_size);
+
+	int num_packed = 0;
+	int first = 0;
+	while (num_candidates - first >= 2 && num_atlas_pages < MAX_TEXTURE_ATLAS_PAGES) {
+		// Fill one page and size it to the smallest power of two square that holds its images
+		uint32_t max_area = TEXTURE_ATLAS_MAX_SIZE * TEXTURE_ATLAS_MAX_SIZE;
+		uint32_t area = 0;
+		int count = 0;
+		while (first + count < num_candidates) {
+			int size = candidates[first + count]->levels[0].width;
+			if (area + size * size > max_area) {
+				break;
+			}
+			positions[count * 2 + 0] = morton_decode(area);
+			positions[count * 2 + 1] = morton_decode(area >> 1);
+			area += size * size;
+			count++;
+		}
+		if (count < 2) {
+			break;
+		}
+
+		int page_size = candidates[first]->levels[0].width;
+		while ((uint32_t)page_size * page_size < area) {
+			page_size *= 2;
+		}
+
+		create_atlas_page(&candidates[first], positions, count, page_size);
+		first += count;
+		num_packed += count;
+	}
+
+	free(candidates);
+	free(positions);
+	return num_packed;
+}
+
+void free_texture_atlases(void) {
+	for (int i = 0; i < num_atlas_pages; i++) {
+		unregister_texture(atlas_pages[i]);
+		free_texture(atlas_pages[i]);
+	}
+	num_atlas_pages = 0;
+}
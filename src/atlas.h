@@ -0,0 +1,15 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include "texture.h"
+
+// Largest atlas page and largest texture that is packed into a page
+#define TEXTURE_ATLAS_MAX_SIZE 1024
+#define TEXTURE_ATLAS_MAX_TEXTURE_SIZE 256
+#define MAX_TEXTURE_ATLAS_PAGES 16
+
+bool can_pack_texture(texture_t* texture);
+int pack_texture_atlas(texture_t** textures, int num_textures);
+void free_texture_atlases(void);
+
+#endif
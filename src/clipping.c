@@ -63,10 +63,12 @@ void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
 }
 
-polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
+polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2, float l0, float l1, float l2, float s0, float s1, float s2) {
 	polygon_t result = {
 		.vertices = { v0, v1, v2 },
 		.texcoords = { t0, t1, t2 },
+		.lights = { l0, l1, l2 },
+		.shadowed_lights = { s0, s1, s2 },
 		.num_vertices = 3
 	};
 	return result;
@@ -85,6 +87,14 @@ void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num
 		triangles[i].texcoords[0] = polygon->texcoords[index0];
 		triangles[i].texcoords[1] = polygon->texcoords[index1];
 		triangles[i].texcoords[2] = polygon->texcoords[index2];
+
+		triangles[i].light[0] = polygon->lights[index0];
+		triangles[i].light[1] = polygon->lights[index1];
+		triangles[i].light[2] = polygon->lights[index2];
+
+		triangles[i].shadow.light[0] = polygon->shadowed_lights[index0];
+		triangles[i].shadow.light[1] = polygon->shadowed_lights[index1];
+		triangles[i].shadow.light[2] = polygon->shadowed_lights[index2];
 	}
 	*num_triangles = polygon->num_vertices - 2;
 }
@@ -100,15 +110,21 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
     // Declare a static array of inside vertices that will be part of the final polygon returned via parameter
     vec3_t inside_vertices[MAX_NUM_POLY_VERTICES];
     tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
+    float inside_lights[MAX_NUM_POLY_VERTICES];
+    float inside_shadowed_lights[MAX_NUM_POLY_VERTICES];
     int num_inside_vertices = 0;
 
-    // Start the current vertex with the first polygon vertex and texture coordinate
+    // Start the current vertex with the first polygon vertex, texture coordinate and light
     vec3_t* current_vertex = &polygon->vertices[0];
     tex2_t* current_texcoord = &polygon->texcoords[0];
+    float* current_light = &polygon->lights[0];
+    float* current_shadowed_light = &polygon->shadowed_lights[0];
 
-    // Start the previous vertex with the last polygon vertex and texture coordinate
+    // Start the previous vertex with the last polygon vertex, texture coordinate and light
     vec3_t* previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
     tex2_t* previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
+    float* previous_light = &polygon->lights[polygon->num_vertices - 1];
+    float* previous_shadowed_light = &polygon->shadowed_lights[polygon->num_vertices - 1];
 
     // Calculate the dot product of the current and previous vertex
     float current_dot = 0; 
@@ -139,6 +155,8 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
             // Insert the intersection point to the list of "inside vertices"
             inside_vertices[num_inside_vertices] = vec3_clone(&intersection_point);
             inside_texcoords[num_inside_vertices] = tex2_clone(&interpolated_texcoord);
+            inside_lights[num_inside_vertices] = float_lerp(*previous_light, *current_light, t);
+            inside_shadowed_lights[num_inside_vertices] = float_lerp(*previous_shadowed_light, *current_shadowed_light, t);
             num_inside_vertices++;
         }
 
@@ -147,6 +165,8 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
             // Insert the current vertex to the list of "inside vertices"
             inside_vertices[num_inside_vertices] = vec3_clone(current_vertex);
             inside_texcoords[num_inside_vertices] = tex2_clone(current_texcoord);
+            inside_lights[num_inside_vertices] = *current_light;
+            inside_shadowed_lights[num_inside_vertices] = *current_shadowed_light;
             num_inside_vertices++;
         }
 
@@ -154,14 +174,20 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
         previous_dot = current_dot;
         previous_vertex = current_vertex;
         previous_texcoord = current_texcoord;
+        previous_light = current_light;
+        previous_shadowed_light = current_shadowed_light;
         current_vertex++;
         current_texcoord++;
+        current_light++;
+        current_shadowed_light++;
     }
     
     // At the end, copy the list of inside vertices into the destination polygon (out parameter)
     for (int i = 0; i < num_inside_vertices; i++) {
         polygon->vertices[i] = vec3_clone(&inside_vertices[i]);
         polygon->texcoords[i] = tex2_clone(&inside_texcoords[i]);
+        polygon->lights[i] = inside_lights[i];
+        polygon->shadowed_lights[i] = inside_shadowed_lights[i];
     }
     polygon->num_vertices = num_inside_vertices;
 }
@@ -173,4 +199,22 @@ void clip_polygon(polygon_t* polygon) {
     clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
     clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
     clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Classify a sphere in camera space as outside, inside or crossing the frustum
+///////////////////////////////////////////////////////////////////////////////
+int classify_sphere_against_frustum(vec3_t center, float radius) {
+    int result = FRUSTUM_INSIDE;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        // Signed distance from the center to the plane (positive is inside)
+        float distance = vec3_dot(vec3_sub(center, frustum_planes[plane].point), frustum_planes[plane].normal);
+        if (distance < -radius) {
+            return FRUSTUM_OUTSIDE;
+        }
+        if (distance < radius) {
+            result = FRUSTUM_INTERSECT;
+        }
+    }
+    return result;
 }
\ No newline at end of file
@@ -16,6 +16,12 @@ enum {
 	FAR_FRUSTUM_PLANE
 };
 
+enum {
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECT,
+	FRUSTUM_INSIDE
+};
+
 typedef struct {
 	vec3_t point;
 	vec3_t normal;
@@ -24,12 +30,15 @@ typedef struct {
 typedef struct {
 	vec3_t vertices[MAX_NUM_POLY_VERTICES];
 	tex2_t texcoords[MAX_NUM_POLY_VERTICES];
+	float lights[MAX_NUM_POLY_VERTICES];
+	float shadowed_lights[MAX_NUM_POLY_VERTICES];
 	int num_vertices;
 } polygon_t;
 
 void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
-polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
+polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2, float l0, float l1, float l2, float s0, float s1, float s2);
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num_triangles);
 void clip_polygon(polygon_t* polygon);
+int classify_sphere_against_frustum(vec3_t center, float radius);
 
 #endif
\ No newline at end of file
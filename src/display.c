@@ -1,17 +1,39 @@
 #include "display.h"
+#include "texture.h"
 
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
 
-static uint32_t* color_buffer = NULL;
+///////////////////////////////////////////////////////////////////////////////
+// Frame buffers
+///////////////////////////////////////////////////////////////////////////////
+// The buffers are allocated once for the output resolution and reused for any
+// smaller render resolution, so changing the resolution never allocates. A
+// frame rendered at the output resolution is drawn straight to the output
+// pixels, a smaller one is drawn to its own buffer and upscaled at the end.
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t* color_buffer = NULL;         // Where the frame is drawn
+static int color_buffer_pitch = 0;            // Pixels from the start of one row to the next
+static uint32_t* color_buffer_memory = NULL;  // Own color buffer for reduced render resolutions
+static uint32_t* output_buffer_memory = NULL; // Output pixels copied to the texture with PRESENT_COPY
+static uint32_t* output_pixels = NULL;        // Output pixels of the frame (the locked texture memory with PRESENT_LOCK)
+static int output_pitch = 0;
+static bool is_color_buffer_locked = false;
 static float* z_buffer = NULL;
+static uint32_t* visibility_buffer = NULL;    // Triangle drawn at every pixel (TEXTURING_DEFERRED)
+
+static int present_mode = PRESENT_LOCK;
+static int upscale_filter = UPSCALE_BILINEAR;
 
 static SDL_Texture* color_buffer_texture = NULL;
-static int window_width = 640;  //320
+static int output_width = 640;  // Size of the texture shown in the window
+static int output_height = 480;
+static int window_width = 640;  //320  Render resolution, at most the output size
 static int window_height = 480; //200
 
 static int render_method = 0;
 static int cull_method = 0;
+static int texturing_mode = TEXTURING_FORWARD;
 
 int get_window_width(void) {
 	return window_width;
@@ -21,6 +43,14 @@ int get_window_height(void) {
 	return window_height;
 }
 
+int get_output_width(void) {
+	return output_width;
+}
+
+int get_output_height(void) {
+	return output_height;
+}
+
 bool init_window(void) {
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		fprintf(stderr, "Error initializing SDL.\n");
@@ -35,6 +65,8 @@ bool init_window(void) {
 
 	float aspect_ratio = (float)fullscreen_width / (float)fullscreen_height;
 	window_height = window_width / aspect_ratio;
+	output_width = window_width;
+	output_height = window_height;
 
 	// Create a SDL Window
 	window = SDL_CreateWindow(
@@ -59,14 +91,18 @@ bool init_window(void) {
 
 	//SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
 
-	// Allocate the required bytes in memory to hold the color buffer and the z-buffer
-	color_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
-	z_buffer = (float*)malloc(sizeof(float) * window_width * window_height);
+	// Allocate the required bytes in memory to hold the color buffers and the z-buffer at the largest resolution
+	color_buffer_memory = (uint32_t*)malloc(sizeof(uint32_t) * output_width * output_height);
+	output_buffer_memory = (uint32_t*)malloc(sizeof(uint32_t) * output_width * output_height);
+	color_buffer = output_buffer_memory;
+	color_buffer_pitch = output_width;
+	z_buffer = (float*)malloc(sizeof(float) * output_width * output_height);
+	visibility_buffer = (uint32_t*)malloc(sizeof(uint32_t) * output_width * output_height);
 
 	// Creating a SDL texture that is used to display the color buffer
 	color_buffer_texture = SDL_CreateTexture(
 		renderer,
-		SDL_PIXELFORMAT_RGBA32,
+		COLOR_BUFFER_PIXEL_FORMAT,
 		SDL_TEXTUREACCESS_STREAMING,
 		window_width,
 		window_height
@@ -79,6 +115,45 @@ void set_render_method(int method) {
 	render_method = method;
 }
 
+void set_texturing_mode(int mode) {
+	texturing_mode = mode;
+}
+
+int get_texturing_mode(void) {
+	return texturing_mode;
+}
+
+void set_present_mode(int mode) {
+	present_mode = mode;
+}
+
+void set_upscale_filter(int filter) {
+	upscale_filter = filter;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Change the render resolution to a fraction of the output resolution
+///////////////////////////////////////////////////////////////////////////////
+// Takes effect with the next lock_color_buffer(), so it must be called
+// between frames. Returns true if the resolution changed.
+///////////////////////////////////////////////////////////////////////////////
+bool set_render_scale(float scale) {
+	if (scale > 1.0) scale = 1.0;
+	if (scale < MIN_RENDER_SCALE) scale = MIN_RENDER_SCALE;
+	int width = (int)(output_width * scale + 0.5);
+	int height = (int)(output_height * scale + 0.5);
+	if (width == window_width && height == window_height) {
+		return false;
+	}
+	window_width = width;
+	window_height = height;
+	return true;
+}
+
+bool is_render_scaled(void) {
+	return window_width != output_width || window_height != output_height;
+}
+
 void set_cull_method(int method) {
 	cull_method = method;
 }
@@ -116,10 +191,21 @@ bool should_render_textured_triangle(void) {
 	);
 }
 
-void draw_grid(uint32_t color) {
-	for (int y = 0; y < window_height; y += 10) {
+bool should_defer_texturing(void) {
+	return should_render_textured_triangle() && texturing_mode == TEXTURING_DEFERRED;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Drawing functions only write the rows y_min to y_max (inclusive), so every
+// raster tile of the screen can be drawn by a different job
+///////////////////////////////////////////////////////////////////////////////
+void draw_grid(uint32_t color, int y_min, int y_max) {
+	if (y_max >= window_height) {
+		y_max = window_height - 1;
+	}
+	for (int y = (y_min + 9) / 10 * 10; y <= y_max; y += 10) {
 		for (int x = 0; x < window_width; x += 10) {
-			color_buffer[(window_width * y) + x] = color;
+			color_buffer[(color_buffer_pitch * y) + x] = color;
 		}
 	}
 }
@@ -128,11 +214,15 @@ void draw_pixel(int x, int y, uint32_t color) {
 	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
 		return;
 	}
-	color_buffer[(window_width * y) + x] = color;
+	color_buffer[(color_buffer_pitch * y) + x] = color;
 }
 
 // DDA line drawing algorithm
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, int y_min, int y_max) {
+	if ((y0 < y_min && y1 < y_min) || (y0 > y_max && y1 > y_max)) {
+		return;
+	}
+
 	int delta_x = (x1 - x0);
 	int delta_y = (y1 - y0);
 
@@ -144,38 +234,129 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
 	float current_x = x0;
 	float current_y = y0;
 	for (int i = 0; i <= longest_side_length; i++) {
-		draw_pixel(round(current_x), round(current_y), color);
+		int y = round(current_y);
+		if (y >= y_min && y <= y_max) {
+			draw_pixel(round(current_x), y, color);
+		}
 		current_x += x_inc;
 		current_y += y_inc;
 	}
 }
 
-void draw_rect(int start_x, int start_y, int width, int height, uint32_t color) {
-	for (int y = start_y; y < (start_y + height); y++) {
+void draw_rect(int start_x, int start_y, int width, int height, uint32_t color, int y_min, int y_max) {
+	int end_y = start_y + height - 1;
+	for (int y = (start_y > y_min ? start_y : y_min); y <= (end_y < y_max ? end_y : y_max); y++) {
 		for (int x = start_x; x < (start_x + width); x++) {
 			draw_pixel(x, y, color);
 		}
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Choose the memory the next frame is drawn to, called before any drawing
+///////////////////////////////////////////////////////////////////////////////
+// With PRESENT_LOCK the output goes straight into the streaming texture,
+// which saves copying the whole frame in render_color_buffer(). The locked
+// memory can have padding at the end of the rows and its old content is
+// undefined, which is fine as every pixel is written each frame. If locking
+// fails the display falls back to PRESENT_COPY.
+///////////////////////////////////////////////////////////////////////////////
+void lock_color_buffer(void) {
+	output_pixels = output_buffer_memory;
+	output_pitch = output_width;
+	if (present_mode == PRESENT_LOCK) {
+		void* pixels;
+		int pitch;
+		if (SDL_LockTexture(color_buffer_texture, NULL, &pixels, &pitch) == 0) {
+			output_pixels = (uint32_t*)pixels;
+			output_pitch = pitch / sizeof(uint32_t);
+			is_color_buffer_locked = true;
+		} else {
+			fprintf(stderr, "Error locking the color buffer texture, copying frames instead.\n");
+			present_mode = PRESENT_COPY;
+		}
+	}
+
+	if (is_render_scaled()) {
+		color_buffer = color_buffer_memory;
+		color_buffer_pitch = window_width;
+	} else {
+		color_buffer = output_pixels;
+		color_buffer_pitch = output_pitch;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Upscale the rows y_min to y_max (inclusive) of the output from the color
+// buffer, only needed when the render resolution is scaled
+///////////////////////////////////////////////////////////////////////////////
+// Source positions are stepped in 16.16 fixed point. Nearest picks one texel,
+// bilinear blends the 2x2 texels around the output pixel center with the same
+// kernel as the texture sampling and clamps at the buffer edges.
+///////////////////////////////////////////////////////////////////////////////
+void upscale_color_buffer(int y_min, int y_max) {
+	int32_t step_x = (int32_t)(((int64_t)window_width << 16) / output_width);
+	int32_t step_y = (int32_t)(((int64_t)window_height << 16) / output_height);
+
+	for (int y = y_min; y <= y_max; y++) {
+		uint32_t* out = &output_pixels[output_pitch * y];
+
+		if (upscale_filter == UPSCALE_NEAREST) {
+			uint32_t* row = &color_buffer[color_buffer_pitch * ((y * step_y) >> 16)];
+			int32_t source_x = 0;
+			for (int x = 0; x < output_width; x++) {
+				out[x] = row[source_x >> 16];
+				source_x += step_x;
+			}
+			continue;
+		}
+
+		// Texel centers are at +0.5, so the source position is (x + 0.5) * step - 0.5
+		int32_t source_y = y * step_y + step_y / 2 - 0x8000;
+		if (source_y < 0) source_y = 0;
+		int y0 = source_y >> 16;
+		int y1 = y0 + 1 < window_height ? y0 + 1 : y0;
+		uint32_t fy = (source_y >> 8) & 0xFF;
+		uint32_t* row0 = &color_buffer[color_buffer_pitch * y0];
+		uint32_t* row1 = &color_buffer[color_buffer_pitch * y1];
+
+		int32_t source_x = step_x / 2 - 0x8000;
+		for (int x = 0; x < output_width; x++) {
+			int32_t sx = source_x > 0 ? source_x : 0;
+			int x0 = sx >> 16;
+			int x1 = x0 + 1 < window_width ? x0 + 1 : x0;
+			out[x] = bilinear_filter(row0[x0], row0[x1], row1[x0], row1[x1], (sx >> 8) & 0xFF, fy);
+			source_x += step_x;
+		}
+	}
+}
+
 void render_color_buffer(void) {
-	SDL_UpdateTexture(
-		color_buffer_texture,
-		NULL,
-		color_buffer,
-		(int) (window_width * sizeof(uint32_t))
-		);
+	if (is_color_buffer_locked) {
+		SDL_UnlockTexture(color_buffer_texture);
+		is_color_buffer_locked = false;
+	} else {
+		SDL_UpdateTexture(
+			color_buffer_texture,
+			NULL,
+			output_buffer_memory,
+			(int) (output_width * sizeof(uint32_t))
+			);
+	}
 	SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);
 	SDL_RenderPresent(renderer);
 }
 
-void clear_color_buffer(uint32_t color) {
-	for (int i = 0; i < window_height * window_width; i++)
-		color_buffer[i] = color;
+void clear_color_buffer(uint32_t color, int y_min, int y_max) {
+	for (int y = y_min; y <= y_max; y++) {
+		uint32_t* row = &color_buffer[color_buffer_pitch * y];
+		for (int x = 0; x < window_width; x++)
+			row[x] = color;
+	}
 }
 
-void clear_z_buffer(void) {
-	for (int i = 0; i < window_height * window_width; i++)
+void clear_z_buffer(int y_min, int y_max) {
+	for (int i = window_width * y_min; i < window_width * (y_max + 1); i++)
 		z_buffer[i] = 1.0;
 }
 
@@ -193,9 +374,34 @@ void update_zbuffer_at(int x, int y, float value) {
 	z_buffer[(window_width * y) + x] = value;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Visibility buffer: the triangle drawn at every pixel, VISIBILITY_EMPTY where
+// no triangle was drawn. Uses the same layout as the z-buffer.
+///////////////////////////////////////////////////////////////////////////////
+void clear_visibility_buffer(int y_min, int y_max) {
+	for (int i = window_width * y_min; i < window_width * (y_max + 1); i++)
+		visibility_buffer[i] = VISIBILITY_EMPTY;
+}
+
+uint32_t get_visibility_at(int x, int y) {
+	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+		return VISIBILITY_EMPTY;
+	}
+	return visibility_buffer[(window_width * y) + x];
+}
+
+void update_visibility_at(int x, int y, uint32_t triangle_id) {
+	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+		return;
+	}
+	visibility_buffer[(window_width * y) + x] = triangle_id;
+}
+
 void destroy_window(void) {
-	free(color_buffer);
+	free(color_buffer_memory);
+	free(output_buffer_memory);
 	free(z_buffer);
+	free(visibility_buffer);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
@@ -7,14 +7,36 @@
 #include <math.h>
 #include <SDL2/SDL.h>
 
-#define FPS 60
-#define FRAME_TARGET_TIME (1000 / FPS)
+// The color buffer and all textures share one 32-bit pixel format: 0xAARRGGBB
+#define COLOR_BUFFER_PIXEL_FORMAT SDL_PIXELFORMAT_ARGB8888
+#define MAKE_ARGB(a, r, g, b) (((uint32_t)(a) << 24) | ((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
 
 enum cull_method {
 	CULL_NONE,
 	CULL_BACKFACE
 };
 
+// Smallest render resolution as a fraction of the output resolution
+#define MIN_RENDER_SCALE 0.5
+
+enum upscale_filter {
+	UPSCALE_NEAREST,
+	UPSCALE_BILINEAR
+};
+
+enum present_mode {
+	PRESENT_COPY,  // Draw to an own buffer and copy it to the texture when presenting
+	PRESENT_LOCK   // Draw straight into the locked streaming texture
+};
+
+enum texturing_mode {
+	TEXTURING_FORWARD,  // Depth test and texture every pixel of a triangle as it is drawn
+	TEXTURING_DEFERRED  // Draw depth and triangle ids first, then texture every visible pixel once
+};
+
+// Visibility buffer value of pixels without a triangle (triangle ids start at 1)
+#define VISIBILITY_EMPTY 0
+
 enum render_method {
 	RENDER_WIRE,
 	RENDER_WIRE_VERTEX,
@@ -27,27 +49,42 @@ enum render_method {
 bool init_window(void);
 int get_window_width(void);
 int get_window_height(void);
+int get_output_width(void);
+int get_output_height(void);
+bool set_render_scale(float scale);
+bool is_render_scaled(void);
 
 void set_render_method(int method);
+void set_texturing_mode(int mode);
+int get_texturing_mode(void);
+void set_present_mode(int mode);
+void set_upscale_filter(int filter);
 void set_cull_method(int method);
 bool should_render_wire(void);
 bool should_render_wire_vertex(void);
 bool should_render_filled_triangle(void);
 bool should_render_textured_triangle(void);
+bool should_defer_texturing(void);
 bool should_cull_backface(void);
 
-void draw_grid(uint32_t color);
+void draw_grid(uint32_t color, int y_min, int y_max);
 void draw_pixel(int x, int y, uint32_t color);
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
-void draw_rect(int start_x, int start_y, int width, int height, uint32_t color);
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, int y_min, int y_max);
+void draw_rect(int start_x, int start_y, int width, int height, uint32_t color, int y_min, int y_max);
 
-void clear_color_buffer(uint32_t color);
-void clear_z_buffer(void);
+void clear_color_buffer(uint32_t color, int y_min, int y_max);
+void clear_z_buffer(int y_min, int y_max);
+void lock_color_buffer(void);
+void upscale_color_buffer(int y_min, int y_max);
 void render_color_buffer(void);
 
 float get_zbuffer_at(int x, int y);
 void update_zbuffer_at(int x, int y, float value);
 
+void clear_visibility_buffer(int y_min, int y_max);
+uint32_t get_visibility_at(int x, int y);
+void update_visibility_at(int x, int y, uint32_t triangle_id);
+
 void destroy_window(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "jobs.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define JOB_DEQUE_MASK (JOB_DEQUE_SIZE - 1)
+
+// Empty polls of wait_for_counter() before it starts yielding the core
+#define WAIT_SPINS_BEFORE_YIELD 256
+
+///////////////////////////////////////////////////////////////////////////////
+// Job deque of one worker
+///////////////////////////////////////////////////////////////////////////////
+// The owner pushes and pops at the bottom (newest job first, its data is
+// still in the cache), other workers steal from the top (oldest job first).
+// Every deque has its own spin lock, so there is no lock shared by all the
+// workers.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	job_t jobs[JOB_DEQUE_SIZE];
+	int top;              // Index of the oldest job
+	int bottom;           // Index of the next free slot
+	SDL_SpinLock lock;
+} job_deque_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch of jobs held back until the counter it depends on drops to zero
+///////////////////////////////////////////////////////////////////////////////
+typedef struct deferred_jobs {
+	job_t* jobs;
+	int count;
+	SDL_atomic_t* counter;
+	SDL_atomic_t* dependency;
+	struct deferred_jobs* next;
+} deferred_jobs_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Index range of a parallel_for() call run as one job
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	parallel_for_function_t function;
+	void* data;
+	int first;
+	int last;
+} parallel_for_range_t;
+
+// Deque 0 belongs to the main thread, deques 1..n to the worker threads
+static job_deque_t deques[MAX_JOB_THREADS + 1];
+static SDL_Thread* threads[MAX_JOB_THREADS];
+static int num_threads = 0;
+static SDL_atomic_t next_deque;
+
+///////////////////////////////////////////////////////////////////////////////
+// Low priority queue for background work like asset loading
+///////////////////////////////////////////////////////////////////////////////
+// Only worker threads that found no frame job take jobs from it (oldest job
+// first), wait_for_counter() never does. So a long background job never runs
+// on a thread that waits for the jobs of a frame.
+///////////////////////////////////////////////////////////////////////////////
+static job_deque_t background_deque;
+static SDL_atomic_t num_background_jobs;
+
+// Every worker thread stores its index in thread local storage (the main thread reads 0)
+static SDL_TLSID worker_index_id = 0;
+
+static deferred_jobs_t* deferred_jobs = NULL;
+static SDL_SpinLock deferred_lock = 0;
+
+// Idle workers sleep on the condition until jobs are queued
+static SDL_atomic_t num_queued_jobs;
+static SDL_mutex* sleep_mutex = NULL;
+static SDL_cond* job_available = NULL;
+static bool is_stopping = false;
+
+static bool push_job(job_deque_t* deque, job_t* job) {
+	bool pushed = false;
+	SDL_AtomicLock(&deque->lock);
+	if (deque->bottom - deque->top < JOB_DEQUE_SIZE) {
+		deque->jobs[deque->bottom & JOB_DEQUE_MASK] = *job;
+		deque->bottom++;
+		pushed = true;
+	}
+	SDL_AtomicUnlock(&deque->lock);
+	return pushed;
+}
+
+static bool pop_job(job_deque_t* deque, job_t* job) {
+	bool popped = false;
+	SDL_AtomicLock(&deque->lock);
+	if (deque->bottom > deque->top) {
+		deque->bottom--;
+		*job = deque->jobs[deque->bottom & JOB_DEQUE_MASK];
+		popped = true;
+	}
+	SDL_AtomicUnlock(&deque->lock);
+	return popped;
+}
+
+static bool steal_job(job_deque_t* deque, job_t* job) {
+	bool stolen = false;
+	SDL_AtomicLock(&deque->lock);
+	if (deque->bottom > deque->top) {
+		*job = deque->jobs[deque->top & JOB_DEQUE_MASK];
+		deque->top++;
+		stolen = true;
+	}
+	SDL_AtomicUnlock(&deque->lock);
+	return stolen;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Take a job from the own deque, or steal one from the other workers
+///////////////////////////////////////////////////////////////////////////////
+static bool find_job(int worker_index, job_t* job) {
+	if (SDL_AtomicGet(&num_queued_jobs) == 0) {
+		return false;
+	}
+	bool found = pop_job(&deques[worker_index], job);
+	for (int i = 1; i <= num_threads && !found; i++) {
+		found = steal_job(&deques[(worker_index + i) % (num_threads + 1)], job);
+	}
+	if (found) {
+		SDL_AtomicAdd(&num_queued_jobs, -1);
+	}
+	return found;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Take the oldest job from the background queue
+///////////////////////////////////////////////////////////////////////////////
+static bool find_background_job(job_t* job) {
+	if (SDL_AtomicGet(&num_background_jobs) == 0) {
+		return false;
+	}
+	bool found = steal_job(&background_deque, job);
+	if (found) {
+		SDL_AtomicAdd(&num_background_jobs, -1);
+	}
+	return found;
+}
+
+static void release_deferred_jobs(void);
+
+static void run_job(job_t* job, int worker_index) {
+	job->function(job->data, worker_index);
+	if (job->counter && SDL_AtomicAdd(job->counter, -1) == 1) {
+		// Last job counted by the counter, start the batches that waited for it
+		release_deferred_jobs();
+	}
+}
+
+static int job_thread(void* data) {
+	int worker_index = (int)(intptr_t)data;
+	SDL_TLSSet(worker_index_id, data, NULL);
+	while (true) {
+		job_t job;
+		if (find_job(worker_index, &job) || find_background_job(&job)) {
+			run_job(&job, worker_index);
+			continue;
+		}
+
+		SDL_LockMutex(sleep_mutex);
+		while (SDL_AtomicGet(&num_queued_jobs) == 0 && SDL_AtomicGet(&num_background_jobs) == 0 && !is_stopping) {
+			SDL_CondWait(job_available, sleep_mutex);
+		}
+		bool should_stop = is_stopping;
+		SDL_UnlockMutex(sleep_mutex);
+		if (should_stop) {
+			break;
+		}
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start the worker threads (0 threads runs every job on the main thread)
+///////////////////////////////////////////////////////////////////////////////
+// These are the only threads the renderer creates: geometry, rasterization,
+// clears and asset loading all run as jobs on them, so this is the one place
+// to change the thread count or to pin the threads to cores (SDL has no
+// affinity call, it would go right after SDL_CreateThread).
+///////////////////////////////////////////////////////////////////////////////
+bool init_job_system(int thread_count) {
+	sleep_mutex = SDL_CreateMutex();
+	job_available = SDL_CreateCond();
+	worker_index_id = SDL_TLSCreate();
+	if (!sleep_mutex || !job_available || !worker_index_id) {
+		fprintf(stderr, "Error creating job system mutex.\n");
+		return false;
+	}
+
+	memset(deques, 0, sizeof(deques));
+	memset(&background_deque, 0, sizeof(background_deque));
+	SDL_AtomicSet(&num_queued_jobs, 0);
+	SDL_AtomicSet(&num_background_jobs, 0);
+	SDL_AtomicSet(&next_deque, 0);
+	is_stopping = false;
+	if (thread_count > MAX_JOB_THREADS) {
+		thread_count = MAX_JOB_THREADS;
+	}
+	for (num_threads = 0; num_threads < thread_count; num_threads++) {
+		threads[num_threads] = SDL_CreateThread(job_thread, "job", (void*)(intptr_t)(num_threads + 1));
+		if (!threads[num_threads]) {
+			fprintf(stderr, "Error creating job thread, running with %d threads.\n", num_threads);
+			break;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Number of workers that can run jobs, the main thread included
+///////////////////////////////////////////////////////////////////////////////
+int get_num_job_workers(void) {
+	return num_threads + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Index of the worker running the calling thread (0 for the main thread)
+///////////////////////////////////////////////////////////////////////////////
+int get_job_worker_index(void) {
+	return (int)(intptr_t)SDL_TLSGet(worker_index_id);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Deal jobs round-robin over all the deques and wake up the sleeping workers
+///////////////////////////////////////////////////////////////////////////////
+// Every worker starts on its own share and only steals once it runs out. If
+// all the deques are full a job runs right away on the calling thread.
+///////////////////////////////////////////////////////////////////////////////
+static void queue_jobs(job_t* jobs, int count, SDL_atomic_t* counter) {
+	for (int i = 0; i < count; i++) {
+		job_t job = jobs[i];
+		job.counter = counter;
+
+		bool pushed = false;
+		for (int tries = 0; tries <= num_threads && !pushed; tries++) {
+			int deque_index = (unsigned)SDL_AtomicAdd(&next_deque, 1) % (num_threads + 1);
+			pushed = push_job(&deques[deque_index], &job);
+		}
+		if (pushed) {
+			SDL_AtomicAdd(&num_queued_jobs, 1);
+		} else {
+			run_job(&job, get_job_worker_index());
+		}
+	}
+
+	SDL_LockMutex(sleep_mutex);
+	SDL_CondBroadcast(job_available);
+	SDL_UnlockMutex(sleep_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue jobs for the workers, the counter is raised by the number of jobs
+///////////////////////////////////////////////////////////////////////////////
+// Can be called from the main thread and from inside jobs.
+///////////////////////////////////////////////////////////////////////////////
+void submit_jobs(job_t* jobs, int count, SDL_atomic_t* counter) {
+	if (counter) {
+		SDL_AtomicAdd(counter, count);
+	}
+	queue_jobs(jobs, count, counter);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue low priority jobs, the counter is raised by the number of jobs
+///////////////////////////////////////////////////////////////////////////////
+// The jobs only run on idle worker threads. Without worker threads, or when
+// the background queue is full, a job runs right away on the calling thread.
+///////////////////////////////////////////////////////////////////////////////
+void submit_background_jobs(job_t* jobs, int count, SDL_atomic_t* counter) {
+	if (counter) {
+		SDL_AtomicAdd(counter, count);
+	}
+	for (int i = 0; i < count; i++) {
+		job_t job = jobs[i];
+		job.counter = counter;
+		if (num_threads > 0 && push_job(&background_deque, &job)) {
+			SDL_AtomicAdd(&num_background_jobs, 1);
+		} else {
+			run_job(&job, get_job_worker_index());
+		}
+	}
+
+	SDL_LockMutex(sleep_mutex);
+	SDL_CondBroadcast(job_available);
+	SDL_UnlockMutex(sleep_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue jobs that may only start once the dependency counter is zero
+///////////////////////////////////////////////////////////////////////////////
+// The counter is raised right away, so waiting on it also waits for the
+// dependency. The batch is kept in a list and queued by the job that brings
+// the dependency to zero. The dependency is tested under the list lock, and
+// the releasing job takes the same lock after its decrement, so a batch can
+// not be added after the release already looked at the list.
+///////////////////////////////////////////////////////////////////////////////
+void submit_jobs_after(job_t* jobs, int count, SDL_atomic_t* counter, SDL_atomic_t* dependency) {
+	if (counter) {
+		SDL_AtomicAdd(counter, count);
+	}
+
+	SDL_AtomicLock(&deferred_lock);
+	if (SDL_AtomicGet(dependency) > 0) {
+		deferred_jobs_t* batch = (deferred_jobs_t*)malloc(sizeof(deferred_jobs_t));
+		batch->jobs = (job_t*)malloc(sizeof(job_t) * (count > 0 ? count : 1));
+		memcpy(batch->jobs, jobs, sizeof(job_t) * count);
+		batch->count = count;
+		batch->counter = counter;
+		batch->dependency = dependency;
+		batch->next = deferred_jobs;
+		deferred_jobs = batch;
+		SDL_AtomicUnlock(&deferred_lock);
+		return;
+	}
+	SDL_AtomicUnlock(&deferred_lock);
+
+	queue_jobs(jobs, count, counter);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue the deferred batches whose dependency dropped to zero
+///////////////////////////////////////////////////////////////////////////////
+static void release_deferred_jobs(void) {
+	deferred_jobs_t* ready = NULL;
+	SDL_AtomicLock(&deferred_lock);
+	deferred_jobs_t** link = &deferred_jobs;
+	while (*link) {
+		deferred_jobs_t* batch = *link;
+		if (SDL_AtomicGet(batch->dependency) == 0) {
+			*link = batch->next;
+			batch->next = ready;
+			ready = batch;
+		} else {
+			link = &batch->next;
+		}
+	}
+	SDL_AtomicUnlock(&deferred_lock);
+
+	while (ready) {
+		deferred_jobs_t* next = ready->next;
+		queue_jobs(ready->jobs, ready->count, ready->counter);
+		free(ready->jobs);
+		free(ready);
+		ready = next;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run queued jobs until the counter drops to zero
+///////////////////////////////////////////////////////////////////////////////
+// The calling thread helps with any queued frame job while it waits, so a
+// job can wait for the jobs it submitted without blocking a worker. Background
+// jobs are left to the idle workers. When there is nothing to help with, the
+// thread backs off with a pause and yields after a while.
+///////////////////////////////////////////////////////////////////////////////
+void wait_for_counter(SDL_atomic_t* counter) {
+	int worker_index = get_job_worker_index();
+	int num_idle_spins = 0;
+	while (SDL_AtomicGet(counter) > 0) {
+		job_t job;
+		if (find_job(worker_index, &job)) {
+			run_job(&job, worker_index);
+			num_idle_spins = 0;
+			continue;
+		}
+		if (++num_idle_spins < WAIT_SPINS_BEFORE_YIELD) {
+#if defined(__SSE2__)
+			_mm_pause();
+#endif
+		} else {
+			SDL_Delay(0);
+		}
+	}
+}
+
+static void parallel_for_job(void* data, int worker_index) {
+	parallel_for_range_t* range = (parallel_for_range_t*)data;
+	range->function(range->data, range->first, range->last, worker_index);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Call the function over the index range [0, count) split into jobs
+///////////////////////////////////////////////////////////////////////////////
+// The range is cut into at most MAX_PARALLEL_FOR_JOBS pieces of at least
+// min_batch_size indices, so idle workers have something left to steal. Returns
+// once every index has been processed.
+///////////////////////////////////////////////////////////////////////////////
+void parallel_for(int count, int min_batch_size, parallel_for_function_t function, void* data) {
+	if (count <= 0) {
+		return;
+	}
+	if (min_batch_size < 1) {
+		min_batch_size = 1;
+	}
+	int num_ranges = (count + min_batch_size - 1) / min_batch_size;
+	if (num_ranges > MAX_PARALLEL_FOR_JOBS) {
+		num_ranges = MAX_PARALLEL_FOR_JOBS;
+	}
+	if (num_ranges == 1 || num_threads == 0) {
+		function(data, 0, count, get_job_worker_index());
+		return;
+	}
+
+	parallel_for_range_t ranges[MAX_PARALLEL_FOR_JOBS];
+	job_t jobs[MAX_PARALLEL_FOR_JOBS];
+	for (int i = 0; i < num_ranges; i++) {
+		ranges[i].function = function;
+		ranges[i].data = data;
+		ranges[i].first = (int)((long long)count * i / num_ranges);
+		ranges[i].last = (int)((long long)count * (i + 1) / num_ranges);
+		jobs[i].function = parallel_for_job;
+		jobs[i].data = &ranges[i];
+	}
+
+	SDL_atomic_t counter;
+	SDL_AtomicSet(&counter, 0);
+	submit_jobs(jobs, num_ranges, &counter);
+	wait_for_counter(&counter);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stop the worker threads, jobs still queued are dropped
+///////////////////////////////////////////////////////////////////////////////
+void free_job_system(void) {
+	if (!sleep_mutex) {
+		return;
+	}
+
+	SDL_LockMutex(sleep_mutex);
+	is_stopping = true;
+	SDL_CondBroadcast(job_available);
+	SDL_UnlockMutex(sleep_mutex);
+	for (int i = 0; i < num_threads; i++) {
+		SDL_WaitThread(threads[i], NULL);
+	}
+	num_threads = 0;
+
+	while (deferred_jobs) {
+		deferred_jobs_t* next = deferred_jobs->next;
+		free(deferred_jobs->jobs);
+		free(deferred_jobs);
+		deferred_jobs = next;
+	}
+
+	SDL_DestroyCond(job_available);
+	SDL_DestroyMutex(sleep_mutex);
+	sleep_mutex = NULL;
+	job_available = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+#define MAX_JOB_THREADS 15
+
+// Capacity of the job deque of every worker (power of two)
+#define JOB_DEQUE_SIZE 1024
+
+// Most ranges a parallel_for() call is split into
+#define MAX_PARALLEL_FOR_JOBS 256
+
+///////////////////////////////////////////////////////////////////////////////
+// Unit of work run by one of the job workers
+///////////////////////////////////////////////////////////////////////////////
+// worker_index is 0 for the main thread and 1..n for the worker threads, so
+// jobs can use it to pick per-worker scratch memory.
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*job_function_t)(void* data, int worker_index);
+
+typedef struct {
+	job_function_t function;  // Function to run
+	void* data;               // Argument passed to the function
+	SDL_atomic_t* counter;    // Decremented once the job has run (can be NULL)
+} job_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Body of a parallel loop, called with the index range [first, last)
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*parallel_for_function_t)(void* data, int first, int last, int worker_index);
+
+bool init_job_system(int thread_count);
+int get_num_job_workers(void);
+int get_job_worker_index(void);
+void submit_jobs(job_t* jobs, int count, SDL_atomic_t* counter);
+void submit_background_jobs(job_t* jobs, int count, SDL_atomic_t* counter);
+void submit_jobs_after(job_t* jobs, int count, SDL_atomic_t* counter, SDL_atomic_t* dependency);
+void wait_for_counter(SDL_atomic_t* counter);
+void parallel_for(int count, int min_batch_size, parallel_for_function_t function, void* data);
+void free_job_system(void);
+
+#endif
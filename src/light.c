@@ -1,3 +1,6 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include "light.h"
 
 static light_t light;
@@ -17,18 +20,284 @@ vec3_t get_light_direction(void) {
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
-// Change color based on a percentage factor ro represent light intensity
+// Convert a light factor to 8.8 fixed point, clamped to 0.0 (0) - 1.0 (256)
 /////////////////////////////////////////////////////////////////////////////////////
-uint32_t apply_light_intensity(uint32_t original_color, float factor) {
+uint32_t get_light_factor_fixed(float factor) {
 	if (factor < 0) factor = 0;
 	if (factor > 1) factor = 1;
+	return (uint32_t)(factor * 256.0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Change color based on a percentage factor ro represent light intensity
+/////////////////////////////////////////////////////////////////////////////////////
+uint32_t apply_light_intensity(uint32_t original_color, float factor) {
+	return apply_light_intensity_fixed(original_color, get_light_factor_fixed(factor));
+}
 
+/////////////////////////////////////////////////////////////////////////////////////
+// Scale the RGB channels of an ARGB color by an 8.8 fixed point factor
+// Red and blue are multiplied together in one integer multiply, green in another
+/////////////////////////////////////////////////////////////////////////////////////
+uint32_t apply_light_intensity_fixed(uint32_t original_color, uint32_t fixed_factor) {
 	uint32_t a = (original_color & 0xFF000000);
-	uint32_t r = (original_color & 0x00FF0000) * factor;
-	uint32_t g = (original_color & 0x0000FF00) * factor;
-	uint32_t b = (original_color & 0x000000FF) * factor;
+	uint32_t rb = (((original_color & 0x00FF00FF) * fixed_factor) >> 8) & 0x00FF00FF;
+	uint32_t g = (((original_color & 0x0000FF00) * fixed_factor) >> 8) & 0x0000FF00;
+
+	return a | rb | g;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Local lights and the clustered light grid
+///////////////////////////////////////////////////////////////////////////////
+static local_light_t local_lights[MAX_LOCAL_LIGHTS];
+static int num_local_lights = 0;
+static bool is_local_lighting_enabled = true;
+
+// Camera space values of the local lights, updated by assign_local_lights()
+typedef struct {
+	vec3_t position;
+	vec3_t axis;            // Spot direction (zero for point lights)
+	vec3_t bounds_center;   // Bounding sphere of the lit volume
+	float bounds_radius;
+} view_light_t;
+
+static view_light_t view_lights[MAX_LOCAL_LIGHTS];
+
+// Mask of the local lights that reach every cluster
+static uint64_t light_grid[LIGHT_GRID_SLICES][LIGHT_GRID_TILES_Y][LIGHT_GRID_TILES_X];
+
+static float grid_tan_half_fov_x;
+static float grid_tan_half_fov_y;
+static float grid_z_near;
+static float grid_z_far;
+static float grid_slice_scale;  // Depth slices per log unit of z / z_near
+
+static int add_local_light(local_light_t* light) {
+	if (num_local_lights == MAX_LOCAL_LIGHTS) {
+		fprintf(stderr, "Too many local lights (max %d).\n", MAX_LOCAL_LIGHTS);
+		return -1;
+	}
+	vec3_normalize(&light->direction);
+	local_lights[num_local_lights] = *light;
+	return num_local_lights++;
+}
+
+int add_point_light(vec3_t position, float intensity, float range) {
+	local_light_t light = {
+		.type = LIGHT_POINT,
+		.position = position,
+		.direction = vec3_new(0, 0, 1),
+		.intensity = intensity,
+		.range = range,
+		.cos_inner = -1,
+		.cos_outer = -1
+	};
+	return add_local_light(&light);
+}
+
+int add_spot_light(vec3_t position, vec3_t direction, float intensity, float range, float inner_angle, float outer_angle) {
+	local_light_t light = {
+		.type = LIGHT_SPOT,
+		.position = position,
+		.direction = direction,
+		.intensity = intensity,
+		.range = range,
+		.cos_inner = cos(inner_angle),
+		.cos_outer = cos(outer_angle)
+	};
+	return add_local_light(&light);
+}
+
+void set_local_light_position(int index, vec3_t position) {
+	local_lights[index].position = position;
+}
+
+void set_local_light_direction(int index, vec3_t direction) {
+	vec3_normalize(&direction);
+	local_lights[index].direction = direction;
+}
 
-	uint32_t new_color = a | (r & 0x00FF0000) | (g & 0x0000FF00) | (b & 0x000000FF);
+int get_num_local_lights(void) {
+	return num_local_lights;
+}
+
+void set_local_lights_enabled(bool enabled) {
+	is_local_lighting_enabled = enabled;
+}
+
+bool are_local_lights_enabled(void) {
+	return is_local_lighting_enabled;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up the cluster bounds for the projection (same angles and planes as the
+// view frustum)
+///////////////////////////////////////////////////////////////////////////////
+void init_light_grid(float fov_x, float fov_y, float z_near, float z_far) {
+	grid_tan_half_fov_x = tan(fov_x / 2);
+	grid_tan_half_fov_y = tan(fov_y / 2);
+	grid_z_near = z_near;
+	grid_z_far = z_far;
+	grid_slice_scale = LIGHT_GRID_SLICES / log(z_far / z_near);
+}
+
+static int get_grid_tile(float slope, float tan_half_fov, int num_tiles) {
+	int tile = (int)floorf((slope / tan_half_fov * 0.5 + 0.5) * num_tiles);
+	return tile < 0 ? 0 : (tile >= num_tiles ? num_tiles - 1 : tile);
+}
+
+static int get_grid_slice(float z) {
+	int slice = (int)floorf(logf(z / grid_z_near) * grid_slice_scale);
+	return slice < 0 ? 0 : (slice >= LIGHT_GRID_SLICES ? LIGHT_GRID_SLICES - 1 : slice);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Find the clusters overlapped by a camera space sphere, returns false if the
+// sphere is outside the grid
+///////////////////////////////////////////////////////////////////////////////
+// The screen bounds are the extreme slopes (x/z and y/z) of the box around the
+// sphere: a little larger than the projected sphere, but never smaller.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	int x_min, x_max;
+	int y_min, y_max;
+	int slice_min, slice_max;
+} cluster_range_t;
+
+static bool get_cluster_range(cluster_range_t* range, vec3_t center, float radius) {
+	float z_min = center.z - radius;
+	float z_max = center.z + radius;
+	if (z_max < grid_z_near || z_min > grid_z_far) {
+		return false;
+	}
+	if (z_min < grid_z_near) {
+		z_min = grid_z_near;
+	}
+
+	float x_lo = center.x - radius;
+	float x_hi = center.x + radius;
+	float y_lo = center.y - radius;
+	float y_hi = center.y + radius;
+	float slope_x_min = x_lo / (x_lo < 0 ? z_min : z_max);
+	float slope_x_max = x_hi / (x_hi > 0 ? z_min : z_max);
+	float slope_y_min = y_lo / (y_lo < 0 ? z_min : z_max);
+	float slope_y_max = y_hi / (y_hi > 0 ? z_min : z_max);
+	if (slope_x_max < -grid_tan_half_fov_x || slope_x_min > grid_tan_half_fov_x ||
+		slope_y_max < -grid_tan_half_fov_y || slope_y_min > grid_tan_half_fov_y) {
+		return false;
+	}
 
-	return new_color;
-}
\ No newline at end of file
+	range->x_min = get_grid_tile(slope_x_min, grid_tan_half_fov_x, LIGHT_GRID_TILES_X);
+	range->x_max = get_grid_tile(slope_x_max, grid_tan_half_fov_x, LIGHT_GRID_TILES_X);
+	range->y_min = get_grid_tile(slope_y_min, grid_tan_half_fov_y, LIGHT_GRID_TILES_Y);
+	range->y_max = get_grid_tile(slope_y_max, grid_tan_half_fov_y, LIGHT_GRID_TILES_Y);
+	range->slice_min = get_grid_slice(z_min);
+	range->slice_max = get_grid_slice(z_max);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move the local lights to camera space and mark the clusters they reach
+///////////////////////////////////////////////////////////////////////////////
+// Runs once per frame before the geometry jobs, which only read the grid.
+// A spot light is bounded by the sphere around its cone instead of its range.
+///////////////////////////////////////////////////////////////////////////////
+void assign_local_lights(mat4_t* view_matrix) {
+	memset(light_grid, 0, sizeof(light_grid));
+	if (!is_local_lighting_enabled) {
+		return;
+	}
+
+	for (int i = 0; i < num_local_lights; i++) {
+		local_light_t* light = &local_lights[i];
+		view_light_t* view_light = &view_lights[i];
+
+		vec4_t position = vec4_from_vec3(light->position);
+		mat4_mul_vec4_ptr(&position, view_matrix, &position);
+		view_light->position = vec3_from_vec4(position);
+		view_light->axis = vec3_new(0, 0, 0);
+		view_light->bounds_center = view_light->position;
+		view_light->bounds_radius = light->range;
+
+		if (light->type == LIGHT_SPOT) {
+			vec4_t axis = { light->direction.x, light->direction.y, light->direction.z, 0 };
+			mat4_mul_vec4_ptr(&axis, view_matrix, &axis);
+			view_light->axis = vec3_from_vec4(axis);
+
+			// Smallest sphere around the cone: centered on the cap for wide cones, else the circumsphere
+			float sin_outer = sqrtf(fmaxf(0, 1 - light->cos_outer * light->cos_outer));
+			float center_distance = light->range * light->cos_outer;
+			float radius = light->range * sin_outer;
+			if (light->cos_outer > 0.70710678) {
+				center_distance = light->range / (2 * light->cos_outer);
+				radius = center_distance;
+			}
+			if (light->cos_outer > 0) {
+				view_light->bounds_center = vec3_add(view_light->position, vec3_mul(view_light->axis, center_distance));
+				view_light->bounds_radius = radius;
+			}
+		}
+
+		cluster_range_t range;
+		if (!get_cluster_range(&range, view_light->bounds_center, view_light->bounds_radius)) {
+			continue;
+		}
+		uint64_t bit = (uint64_t)1 << i;
+		for (int s = range.slice_min; s <= range.slice_max; s++) {
+			for (int y = range.y_min; y <= range.y_max; y++) {
+				for (int x = range.x_min; x <= range.x_max; x++) {
+					light_grid[s][y][x] |= bit;
+				}
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Gather the local lights that reach a camera space sphere, returns the count
+///////////////////////////////////////////////////////////////////////////////
+// The masks of the overlapped clusters are combined, then every candidate is
+// tested against the sphere, since a cluster covers more than the sphere.
+///////////////////////////////////////////////////////////////////////////////
+int get_lights_in_sphere(light_list_t* list, vec3_t center, float radius) {
+	list->count = 0;
+
+	cluster_range_t range;
+	if (!get_cluster_range(&range, center, radius)) {
+		return 0;
+	}
+	uint64_t mask = 0;
+	for (int s = range.slice_min; s <= range.slice_max; s++) {
+		for (int y = range.y_min; y <= range.y_max; y++) {
+			for (int x = range.x_min; x <= range.x_max; x++) {
+				mask |= light_grid[s][y][x];
+			}
+		}
+	}
+
+	for (int i = 0; mask != 0; i++, mask >>= 1) {
+		if (!(mask & 1)) {
+			continue;
+		}
+		local_light_t* light = &local_lights[i];
+		view_light_t* view_light = &view_lights[i];
+		vec3_t offset = vec3_sub(view_light->bounds_center, center);
+		float reach = view_light->bounds_radius + radius;
+		if (vec3_dot(offset, offset) > reach * reach) {
+			continue;
+		}
+
+		int n = list->count++;
+		list->x[n] = view_light->position.x;
+		list->y[n] = view_light->position.y;
+		list->z[n] = view_light->position.z;
+		list->axis_x[n] = view_light->axis.x;
+		list->axis_y[n] = view_light->axis.y;
+		list->axis_z[n] = view_light->axis.z;
+		list->intensity[n] = light->intensity;
+		list->inv_range_squared[n] = 1.0 / (light->range * light->range);
+		list->cos_outer[n] = light->cos_outer;
+		list->inv_cone[n] = light->cos_inner > light->cos_outer ? 1.0 / (light->cos_inner - light->cos_outer) : 1.0;
+	}
+	return list->count;
+}
@@ -1,8 +1,10 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "vector.h"
+#include "matrix.h"
 
 typedef struct {
 	float intensity;
@@ -12,6 +14,69 @@ typedef struct {
 void init_light(float intensity, vec3_t direction);
 float get_light_intensity(void);
 vec3_t get_light_direction(void);
+uint32_t get_light_factor_fixed(float factor);
 uint32_t apply_light_intensity(uint32_t original_color, float percentage_factor);
+uint32_t apply_light_intensity_fixed(uint32_t original_color, uint32_t fixed_factor);
 
-#endif
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////////
+// Local lights: point and spot lights with a limited range
+///////////////////////////////////////////////////////////////////////////////
+// The light mask of every cluster has one bit per local light
+#define MAX_LOCAL_LIGHTS 64
+
+enum local_light_type {
+	LIGHT_POINT,
+	LIGHT_SPOT
+};
+
+typedef struct {
+	int type;
+	vec3_t position;   // World space position
+	vec3_t direction;  // World space direction of the spot cone
+	float intensity;
+	float range;       // Distance where the light has faded out
+	float cos_inner;   // Cosine of the angle where the spot cone starts to fade
+	float cos_outer;   // Cosine of the angle where the spot cone has faded out
+} local_light_t;
+
+int add_point_light(vec3_t position, float intensity, float range);
+int add_spot_light(vec3_t position, vec3_t direction, float intensity, float range, float inner_angle, float outer_angle);
+void set_local_light_position(int index, vec3_t position);
+void set_local_light_direction(int index, vec3_t direction);
+int get_num_local_lights(void);
+
+void set_local_lights_enabled(bool enabled);
+bool are_local_lights_enabled(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Clustered light grid: the view frustum split into screen tiles and depth
+// slices, every cluster keeps a mask of the local lights that reach it
+///////////////////////////////////////////////////////////////////////////////
+// The lights are assigned once per frame. Geometry then only evaluates the
+// lights of the clusters it overlaps, so the cost per vertex depends on the
+// nearby lights and not on all the lights of the scene.
+///////////////////////////////////////////////////////////////////////////////
+#define LIGHT_GRID_TILES_X 16
+#define LIGHT_GRID_TILES_Y 8
+#define LIGHT_GRID_SLICES 16  // Exponential depth slices between the near and far planes
+
+// Camera space lights gathered for a batch of vertices, one array per value
+typedef struct {
+	int count;
+	float x[MAX_LOCAL_LIGHTS];                  // Camera space position
+	float y[MAX_LOCAL_LIGHTS];
+	float z[MAX_LOCAL_LIGHTS];
+	float axis_x[MAX_LOCAL_LIGHTS];             // Camera space spot direction (zero for point lights)
+	float axis_y[MAX_LOCAL_LIGHTS];
+	float axis_z[MAX_LOCAL_LIGHTS];
+	float intensity[MAX_LOCAL_LIGHTS];
+	float inv_range_squared[MAX_LOCAL_LIGHTS];
+	float cos_outer[MAX_LOCAL_LIGHTS];          // -1 for point lights, so they are never faded by the cone
+	float inv_cone[MAX_LOCAL_LIGHTS];           // 1 / (cos_inner - cos_outer)
+} light_list_t;
+
+void init_light_grid(float fov_x, float fov_y, float z_near, float z_far);
+void assign_local_lights(mat4_t* view_matrix);
+int get_lights_in_sphere(light_list_t* list, vec3_t center, float radius);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include "array.h"
+#include "loader.h"
+#include "jobs.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Request list shared by the load jobs and the main thread
+///////////////////////////////////////////////////////////////////////////////
+static SDL_mutex* loader_mutex = NULL;
+static SDL_atomic_t load_jobs_counter;       // Load jobs queued or running
+static bool is_stopping = false;
+
+static load_request_t* completed = NULL;      // Loaded requests waiting for the next frame boundary
+static int num_pending_loads = 0;             // Requests queued, in progress or not applied yet
+
+static void process_load_request(load_request_t* request) {
+	if (request->type == LOAD_MESH_OBJ) {
+		load_mesh_geometry(&request->mesh, request->filename);
+	} else {
+		load_mesh_png_data(&request->mesh, request->filename);
+	}
+}
+
+static void free_load_request(load_request_t* request) {
+	free_texture(request->mesh.texture);
+	free_mesh_geometry(&request->mesh);
+	free(request);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parse and decode one request on a job worker and hand it to the main thread
+///////////////////////////////////////////////////////////////////////////////
+static void load_job(void* data, int worker_index) {
+	load_request_t* request = (load_request_t*)data;
+
+	SDL_LockMutex(loader_mutex);
+	bool should_load = !is_stopping;
+	SDL_UnlockMutex(loader_mutex);
+
+	// Parse and decode without holding the lock
+	if (should_load) {
+		process_load_request(request);
+	}
+
+	SDL_LockMutex(loader_mutex);
+	request->next = completed;
+	completed = request;
+	SDL_UnlockMutex(loader_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Prepare the request lists, the loads run on the job system workers
+///////////////////////////////////////////////////////////////////////////////
+bool init_loader(void) {
+	loader_mutex = SDL_CreateMutex();
+	if (!loader_mutex) {
+		fprintf(stderr, "Error creating loader mutex.\n");
+		return false;
+	}
+	SDL_AtomicSet(&load_jobs_counter, 0);
+	is_stopping = false;
+	return true;
+}
+
+static void queue_load_request(int type, int mesh_index, char* filename) {
+	load_request_t* request = (load_request_t*)calloc(1, sizeof(load_request_t));
+	request->type = type;
+	request->mesh_index = mesh_index;
+	strncpy(request->filename, filename, MAX_LOADER_FILENAME - 1);
+
+	SDL_LockMutex(loader_mutex);
+	num_pending_loads++;
+	SDL_UnlockMutex(loader_mutex);
+
+	// Without worker threads the request is loaded right away, but still applied at the frame boundary
+	job_t job = { .function = load_job, .data = request };
+	if (get_num_job_workers() == 1) {
+		load_job(request, 0);
+	} else {
+		submit_background_jobs(&job, 1, &load_jobs_counter);
+	}
+}
+
+void request_mesh_obj_load(int mesh_index, char* obj_filename) {
+	queue_load_request(LOAD_MESH_OBJ, mesh_index, obj_filename);
+}
+
+void request_mesh_png_load(int mesh_index, char* png_filename) {
+	queue_load_request(LOAD_MESH_PNG, mesh_index, png_filename);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Swap the finished loads into the scene meshes, called between two frames
+///////////////////////////////////////////////////////////////////////////////
+// Returns the number of requests that were applied. A request that failed
+// leaves the placeholder of the mesh in place.
+///////////////////////////////////////////////////////////////////////////////
+int apply_loaded_assets(void) {
+	SDL_LockMutex(loader_mutex);
+	load_request_t* request = completed;
+	completed = NULL;
+	SDL_UnlockMutex(loader_mutex);
+
+	int num_applied = 0;
+	while (request) {
+		load_request_t* next = request->next;
+		if (request->type == LOAD_MESH_OBJ && get_mesh_num_faces(&request->mesh) > 0) {
+			replace_mesh_geometry(request->mesh_index, &request->mesh);
+			memset(&request->mesh.vertices, 0, sizeof(vertex_buffer_t));
+			request->mesh.indices = NULL;
+			request->mesh.meshlets = NULL;
+		} else if (request->type == LOAD_MESH_PNG && request->mesh.texture) {
+			replace_mesh_texture(request->mesh_index, request->mesh.texture);
+			request->mesh.texture = NULL;
+		} else {
+			fprintf(stderr, "Error loading %s, keeping the placeholder.\n", request->filename);
+		}
+		free_load_request(request);
+		request = next;
+		num_applied++;
+	}
+
+	SDL_LockMutex(loader_mutex);
+	num_pending_loads -= num_applied;
+	SDL_UnlockMutex(loader_mutex);
+	return num_applied;
+}
+
+int get_num_pending_loads(void) {
+	SDL_LockMutex(loader_mutex);
+	int count = num_pending_loads;
+	SDL_UnlockMutex(loader_mutex);
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for the load jobs and drop the requests that were not applied
+///////////////////////////////////////////////////////////////////////////////
+// Must be called before free_job_system(). Jobs that did not start yet skip
+// the loading, the ones in progress finish their request.
+///////////////////////////////////////////////////////////////////////////////
+void free_loader(void) {
+	if (!loader_mutex) {
+		return;
+	}
+
+	SDL_LockMutex(loader_mutex);
+	is_stopping = true;
+	SDL_UnlockMutex(loader_mutex);
+	wait_for_counter(&load_jobs_counter);
+
+	while (completed) {
+		load_request_t* next = completed->next;
+		free_load_request(completed);
+		completed = next;
+	}
+	num_pending_loads = 0;
+
+	SDL_DestroyMutex(loader_mutex);
+	loader_mutex = NULL;
+}
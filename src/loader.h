@@ -0,0 +1,33 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include "mesh.h"
+#include "texture.h"
+
+#define MAX_LOADER_FILENAME 256
+
+enum load_request_type {
+	LOAD_MESH_OBJ,
+	LOAD_MESH_PNG
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Asset load request, run as a job and handed back once done
+///////////////////////////////////////////////////////////////////////////////
+typedef struct load_request {
+	int type;                              // LOAD_MESH_OBJ or LOAD_MESH_PNG
+	int mesh_index;                        // Mesh that receives the loaded data
+	char filename[MAX_LOADER_FILENAME];    // Asset file to load
+	mesh_t mesh;                           // Loaded geometry or texture, empty if loading failed
+	struct load_request* next;             // Next request in the completed list
+} load_request_t;
+
+bool init_loader(void);
+void request_mesh_obj_load(int mesh_index, char* obj_filename);
+void request_mesh_png_load(int mesh_index, char* png_filename);
+int apply_loaded_assets(void);
+int get_num_pending_loads(void);
+void free_loader(void);
+
+#endif
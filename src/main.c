@@ -1,6 +1,9 @@
+#include <float.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "upng.h"
 #include "array.h"
@@ -8,11 +11,18 @@
 #include "vector.h"
 #include "matrix.h"
 #include "light.h"
+#include "shadow.h"
 #include "camera.h"
 #include "triangle.h"
 #include "texture.h"
 #include "mesh.h"
 #include "clipping.h"
+#include "vertex_cache.h"
+#include "loader.h"
+#include "texture_cache.h"
+#include "atlas.h"
+#include "jobs.h"
+#include "pacing.h"
 
 static uint32_t color_bg = 0xFF111111;
 static uint32_t color_grid = 0xFF444444;
@@ -24,15 +34,126 @@ static uint32_t color_filled_triangle = 0xFFFFFFFF;
 // Global variables for execution status and game loop
 ///////////////////////////////////////////////////////////////////////////////
 bool is_running = false;
-int previous_frame_time = 0;
 float delta_time = 0;
 
 ///////////////////////////////////////////////////////////////////////////////
-// Array of triangles that should be rendered frame by frame
+// Arrays of triangles that should be rendered frame by frame
 ///////////////////////////////////////////////////////////////////////////////
-#define MAX_TRIANGLES_PER_MESH 10000
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
-int num_triangles_to_render = 0;
+// Double buffered: render() draws one list while the geometry jobs fill the
+// other one, the lists are swapped once the geometry is done.
+///////////////////////////////////////////////////////////////////////////////
+// Triangles of the whole scene after culling and clipping (room for a few thousand faces per mesh)
+#define MAX_SCENE_TRIANGLES 32768
+triangle_t triangles_to_render[2][MAX_SCENE_TRIANGLES];
+int num_triangles_to_render[2] = { 0, 0 };
+int render_list = 0;
+static bool has_reported_triangle_overflow = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame pipeline: the geometry of a frame is either drawn in the same frame
+// (lowest latency) or overlapped with the rasterization of the previous frame
+// (highest throughput, one frame of extra latency)
+///////////////////////////////////////////////////////////////////////////////
+enum frame_pipeline_mode {
+	PIPELINE_LATENCY,
+	PIPELINE_THROUGHPUT
+};
+
+static int frame_pipeline_mode = PIPELINE_LATENCY;
+static SDL_atomic_t geometry_counter;     // Geometry of the next frame still in progress
+static bool is_geometry_pending = false;  // Geometry jobs were submitted and not waited for
+static bool is_render_list_valid = false; // The render list can be drawn (its textures are still alive)
+
+///////////////////////////////////////////////////////////////////////////////
+// Geometry jobs: runs of consecutive meshlets of one mesh, each job produces
+// its own list of triangles
+///////////////////////////////////////////////////////////////////////////////
+#define GEOMETRY_JOB_FACES 512
+#define MAX_GEOMETRY_JOBS 1024
+
+typedef struct {
+	mesh_t* mesh;
+	mat4_t world_view_matrix;  // Model space to camera space
+	float max_scale;           // Largest scale factor, applied to the meshlet radius
+	bool is_uniform_scale;     // Meshlet cone culling is only valid with uniform scale
+	vec3_t light_vector;       // Inverse light direction in model space times the light intensity
+	mat4_t world_shadow_matrix; // Model space to shadow map space
+} mesh_instance_t;
+
+// Triangle drawn into the shadow map
+typedef struct {
+	vec3_t points[3];          // Shadow map position of the vertices (texel x, texel y, depth)
+} shadow_triangle_t;
+
+// Shadow triangles of a geometry job that overlap one band of the shadow map
+typedef struct {
+	int* indices;              // Indices in the shadow triangle list of the job
+	int count;
+	int capacity;
+} shadow_bin_t;
+
+typedef struct {
+	mesh_instance_t* instance; // Mesh and matrices of the job
+	int first_meshlet;         // First meshlet processed by the job
+	int num_meshlets;          // Number of consecutive meshlets processed by the job
+	triangle_t* triangles;     // Private output list, kept allocated between frames
+	int num_triangles;
+	int capacity;
+	shadow_triangle_t* shadow_triangles; // Private shadow map list, kept allocated between frames
+	int num_shadow_triangles;
+	int shadow_capacity;
+	shadow_bin_t shadow_bins[NUM_SHADOW_TILES]; // Shadow triangles sorted into the bands they overlap
+} geometry_job_t;
+
+static mesh_instance_t mesh_instances[MAX_NUM_MESHES];
+static geometry_job_t geometry_jobs[MAX_GEOMETRY_JOBS];
+static int num_geometry_jobs = 0;
+
+// One post-transform vertex cache per job worker
+static vertex_cache_t vertex_caches[MAX_JOB_THREADS + 1];
+
+///////////////////////////////////////////////////////////////////////////////
+// Raster tiles: horizontal bands of the screen that are cleared and drawn by
+// separate jobs, every pixel belongs to exactly one tile
+///////////////////////////////////////////////////////////////////////////////
+#define RASTER_TILE_HEIGHT 32
+#define MAX_RASTER_TILES 64
+
+typedef struct {
+	int y_min;  // First row of the tile
+	int y_max;  // Last row of the tile (inclusive)
+} raster_tile_t;
+
+static raster_tile_t raster_tiles[MAX_RASTER_TILES];
+
+// Output rows upscaled by one job when the render resolution is reduced
+#define UPSCALE_JOB_ROWS 16
+
+// Texture levels of every triangle to render, resolved before the tiles are drawn
+static texture_sampler_t triangle_samplers[MAX_SCENE_TRIANGLES];
+
+///////////////////////////////////////////////////////////////////////////////
+// Shadow maps of the directional light, double buffered like the triangle
+// lists: the geometry of a frame draws the shadow map its triangles are
+// textured with, while the other one may still be in use by the raster tiles
+///////////////////////////////////////////////////////////////////////////////
+static shadow_map_t shadow_maps[2];
+static bool has_shadow_map[2] = { false, false }; // The triangle list was made with its shadow map
+static shadow_map_t* geometry_shadow_map = NULL;  // Shadow map of the geometry in progress (NULL without shadows)
+
+// Index of the mesh that is the floor of the scene (it receives the shadows of the cubes and does not spin)
+static int floor_mesh_index = 2;
+
+///////////////////////////////////////////////////////////////////////////////
+// Local lights of the scene: a ring of point lights orbiting between the
+// meshes and a spot light that follows the camera
+///////////////////////////////////////////////////////////////////////////////
+#define NUM_ORBIT_LIGHTS 12
+
+static int orbit_lights[NUM_ORBIT_LIGHTS];
+static int camera_spot_light;
+static float orbit_angle = 0;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Declaration of global transformation matrices
@@ -41,6 +162,39 @@ mat4_t world_matrix;
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
+///////////////////////////////////////////////////////////////////////////////
+// Build the projection matrix and the frustum planes for the render resolution
+///////////////////////////////////////////////////////////////////////////////
+void update_projection(void) {
+	// Initialize the perspective projection matrix
+	float aspect_y = (float)get_window_height() / (float)get_window_width();
+	float aspect_x = (float)get_window_width() / (float)get_window_height();
+	float fov_y = 3.141592 / 3.0;  // the same as 180 / 3 or 60deg
+	float fov_x = atan(tan(fov_y / 2) * aspect_x) * 2.0;
+	float z_near = 0.5;
+	float z_far = 20.0;
+	proj_matrix = mat4_make_perspective(fov_y, aspect_y, z_near, z_far);
+	
+	// Initialize frustum planes with a point and a normal
+	init_frustum_planes(fov_x, fov_y, z_near, z_far);
+
+	// Split the same frustum into the clusters of the light grid
+	init_light_grid(fov_x, fov_y, z_near, z_far);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move the local lights of the scene to their place for the current frame
+///////////////////////////////////////////////////////////////////////////////
+void place_scene_lights(void) {
+	for (int i = 0; i < NUM_ORBIT_LIGHTS; i++) {
+		float angle = orbit_angle + i * (2 * 3.141592 / NUM_ORBIT_LIGHTS);
+		float height = (i % 2 == 0) ? 1.8 : -1.8;
+		set_local_light_position(orbit_lights[i], vec3_new(3.5 * cos(angle), height, 7 + 3.5 * sin(angle)));
+	}
+	set_local_light_position(camera_spot_light, get_camera_position());
+	set_local_light_direction(camera_spot_light, get_camera_direction());
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Setup function to initalize variables and game objects
 ///////////////////////////////////////////////////////////////////////////////
@@ -49,27 +203,61 @@ void setup(void) {
 	set_render_method(RENDER_WIRE);
 	set_cull_method(CULL_BACKFACE);
 
+	// Draw the frames straight into the streaming texture instead of copying them
+	set_present_mode(PRESENT_LOCK);
+
+	// Filter used to upscale the frames rendered below the output resolution
+	set_upscale_filter(UPSCALE_BILINEAR);
+
+	// Texture the triangles as they are drawn (the scenes have little overdraw once back faces are culled)
+	set_texturing_mode(TEXTURING_FORWARD);
+
+	// Shadow the directional light with soft edges
+	set_shadows_enabled(true);
+	set_shadow_filter(SHADOW_FILTER_PCF);
+	init_shadow_map(&shadow_maps[0]);
+	init_shadow_map(&shadow_maps[1]);
+
+	// Run at a fixed frame rate
+	init_frame_pacing(PACING_FIXED, DEFAULT_TARGET_FPS);
+
 	// Initialize the scene camera
 	init_camera(vec3_new(0, 0, 0), vec3_new(0, 0, 1));
 
 	// Initialize the scene light
 	init_light(1.0, vec3_new(0.5, -0.5, 1));
 
-	// Initialize the perspective projection matrix
-	float aspect_y = (float)get_window_height() / (float)get_window_width();
-	float aspect_x = (float)get_window_width() / (float)get_window_height();
-	float fov_y = 3.141592 / 3.0;  // the same as 180 / 3 or 60deg
-	float fov_x = atan(tan(fov_y / 2) * aspect_x) * 2.0;
-	float z_near = 0.5;
-	float z_far = 20.0;
-	proj_matrix = mat4_make_perspective(fov_y, aspect_y, z_near, z_far);
-	
-	// Initialize frustum planes with a point and a normal
-	init_frustum_planes(fov_x, fov_y, z_near, z_far);
+	// Add the local lights of the scene (placed again every frame)
+	for (int i = 0; i < NUM_ORBIT_LIGHTS; i++) {
+		orbit_lights[i] = add_point_light(vec3_new(0, 0, 0), 0.8, 2.5);
+	}
+	camera_spot_light = add_spot_light(vec3_new(0, 0, 0), vec3_new(0, 0, 1), 0.6, 12.0, 0.15, 0.3);
+
+	// Initialize the perspective projection matrix and the frustum planes
+	update_projection();
+
+	// Reorder faces and vertices of the loaded meshes for better vertex cache reuse
+	set_mesh_optimization(true);
+
+	// Keep the texels of all textures within a memory budget (evicted mip levels are reloaded from a cache file)
+	init_texture_cache();
+	set_texture_budget(DEFAULT_TEXTURE_BUDGET);
+
+	// Start the job workers shared by the geometry, raster and loader jobs (the main thread is a worker too)
+	init_job_system(SDL_GetCPUCount() - 1);
 
-	// Loads the cube values in the mesh data structure
-	load_mesh("./assets/cube.obj", "./assets/cube.png", vec3_new(1, 1, 1), vec3_new(-3, 0, 7), vec3_new(0, 0, 0));
-	load_mesh("./assets/cube.obj", "./assets/cube.png", vec3_new(1, 1, 1), vec3_new(+3, 0, 7), vec3_new(0, 0, 0));
+	// Start the background loader, its requests run as jobs
+	init_loader();
+
+	// Loads the cube values in the mesh data structure (placeholders are drawn until the files are loaded)
+	load_mesh_async("./assets/cube.obj", "./assets/cube.png", vec3_new(1, 1, 1), vec3_new(-3, 0, 7), vec3_new(0, 0, 0));
+	load_mesh_async("./assets/cube.obj", "./assets/cube.png", vec3_new(1, 1, 1), vec3_new(+3, 0, 7), vec3_new(0, 0, 0));
+	load_mesh_async("./assets/cube.obj", "./assets/cube.png", vec3_new(4, 4, 4), vec3_new(0, -6, 10), vec3_new(0, 0, 0));
+
+	// Texture filter mode of each mesh
+	set_mesh_texture_filter(0, TEXTURE_FILTER_BILINEAR);
+	set_mesh_texture_filter(1, TEXTURE_FILTER_TRILINEAR);
+	set_mesh_texture_filter(floor_mesh_index, TEXTURE_FILTER_TRILINEAR);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -111,6 +299,44 @@ void process_input(void) {
 					set_render_method(RENDER_TEXTURED_WIRE);
 					break;
 				}
+				if (event.key.keysym.sym == SDLK_f) {
+					// Cycle the texture filter of all meshes: nearest -> bilinear -> trilinear
+					for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+						mesh_t* mesh = get_mesh(mesh_index);
+						set_mesh_texture_filter(mesh_index, (mesh->texture_filter + 1) % 3);
+					}
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_d) {
+					// Toggle between texturing every drawn pixel and every visible pixel once
+					set_texturing_mode(get_texturing_mode() == TEXTURING_FORWARD ? TEXTURING_DEFERRED : TEXTURING_FORWARD);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_l) {
+					// Toggle the point and spot lights
+					set_local_lights_enabled(!are_local_lights_enabled());
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_h) {
+					// Toggle the shadows of the directional light
+					set_shadows_enabled(!are_shadows_enabled());
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_j) {
+					// Toggle between hard and filtered (PCF) shadow edges
+					set_shadow_filter(get_shadow_filter() == SHADOW_FILTER_HARD ? SHADOW_FILTER_PCF : SHADOW_FILTER_HARD);
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_p) {
+					// Toggle between drawing the geometry of the same frame and overlapping it with the next frame
+					frame_pipeline_mode = frame_pipeline_mode == PIPELINE_LATENCY ? PIPELINE_THROUGHPUT : PIPELINE_LATENCY;
+					break;
+				}
+				if (event.key.keysym.sym == SDLK_m) {
+					// Cycle the frame pacing: uncapped -> fixed -> adaptive
+					set_pacing_mode((get_pacing_mode() + 1) % 3);
+					break;
+				}
 				if (event.key.keysym.sym == SDLK_c) {
 					set_cull_method(CULL_BACKFACE);
 					break;
@@ -150,6 +376,121 @@ void process_input(void) {
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Compute the matrices of a mesh, shared by all the geometry jobs of the mesh
+///////////////////////////////////////////////////////////////////////////////
+void prepare_mesh_instance(mesh_instance_t* instance, mesh_t* mesh) {
+	// Create a scale, rotation and translation matrices that will be used to multiply the mesh vertices
+	mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+	mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+	mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+	mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+	mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
+
+	// Create a World Matrix combining scale, rotation and translation matrices
+	world_matrix = mat4_identity();
+
+	// Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
+	mat4_mul_mat4_ptr(&world_matrix, &scale_matrix, &world_matrix);
+	mat4_mul_mat4_ptr(&world_matrix, &rotation_matrix_x, &world_matrix);
+	mat4_mul_mat4_ptr(&world_matrix, &rotation_matrix_y, &world_matrix);
+	mat4_mul_mat4_ptr(&world_matrix, &rotation_matrix_z, &world_matrix);
+	mat4_mul_mat4_ptr(&world_matrix, &translation_matrix, &world_matrix);
+
+	// Combined world and view matrix used to move the vertices and meshlet bounds to camera space
+	instance->mesh = mesh;
+	mat4_mul_mat4_ptr(&instance->world_view_matrix, &view_matrix, &world_matrix);
+	instance->max_scale = fmaxf(fabsf(mesh->scale.x), fmaxf(fabsf(mesh->scale.y), fabsf(mesh->scale.z)));
+	instance->is_uniform_scale = mesh->scale.x == mesh->scale.y && mesh->scale.y == mesh->scale.z;
+
+	// Move the light direction (camera space) to model space with the transposed matrix, so the vertices are lit with their model space normals
+	mat4_t* m = &instance->world_view_matrix;
+	vec3_t light_direction = get_light_direction();
+	vec3_t model_light_direction = {
+		m->m[0][0] * light_direction.x + m->m[1][0] * light_direction.y + m->m[2][0] * light_direction.z,
+		m->m[0][1] * light_direction.x + m->m[1][1] * light_direction.y + m->m[2][1] * light_direction.z,
+		m->m[0][2] * light_direction.x + m->m[1][2] * light_direction.y + m->m[2][2] * light_direction.z
+	};
+	vec3_normalize(&model_light_direction);
+	instance->light_vector = vec3_mul(model_light_direction, -get_light_intensity());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Append a triangle to the private output list of a geometry job
+///////////////////////////////////////////////////////////////////////////////
+static void emit_triangle(geometry_job_t* job, triangle_t* triangle) {
+	if (job->num_triangles == job->capacity) {
+		job->capacity = job->capacity ? job->capacity * 2 : 256;
+		job->triangles = (triangle_t*)realloc(job->triangles, sizeof(triangle_t) * job->capacity);
+	}
+	job->triangles[job->num_triangles++] = *triangle;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Append a triangle to the private shadow map list of a geometry job and to
+// the bins of the shadow map bands it overlaps
+///////////////////////////////////////////////////////////////////////////////
+static void emit_shadow_triangle(geometry_job_t* job, shadow_triangle_t* triangle) {
+	vec3_t* points = triangle->points;
+	float y_min = fminf(points[0].y, fminf(points[1].y, points[2].y));
+	float y_max = fmaxf(points[0].y, fmaxf(points[1].y, points[2].y));
+	int first_tile = (int)floorf(y_min / SHADOW_TILE_HEIGHT);
+	int last_tile = (int)floorf(y_max / SHADOW_TILE_HEIGHT);
+	if (last_tile < 0 || first_tile >= NUM_SHADOW_TILES) {
+		return;
+	}
+	first_tile = first_tile < 0 ? 0 : first_tile;
+	last_tile = last_tile >= NUM_SHADOW_TILES ? NUM_SHADOW_TILES - 1 : last_tile;
+
+	if (job->num_shadow_triangles == job->shadow_capacity) {
+		job->shadow_capacity = job->shadow_capacity ? job->shadow_capacity * 2 : 256;
+		job->shadow_triangles = (shadow_triangle_t*)realloc(job->shadow_triangles, sizeof(shadow_triangle_t) * job->shadow_capacity);
+	}
+	int index = job->num_shadow_triangles++;
+	job->shadow_triangles[index] = *triangle;
+
+	for (int tile = first_tile; tile <= last_tile; tile++) {
+		shadow_bin_t* bin = &job->shadow_bins[tile];
+		if (bin->count == bin->capacity) {
+			bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+			bin->indices = (int*)realloc(bin->indices, sizeof(int) * bin->capacity);
+		}
+		bin->indices[bin->count++] = index;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move the faces of a meshlet to shadow map space for the shadow map
+///////////////////////////////////////////////////////////////////////////////
+// Only the faces looking away from the light are kept, so the shadow map
+// holds the depth of the far side of the meshes: the lit faces are always in
+// front of it and never shadow themselves. The shadow map is orthographic and
+// covers all the meshes, so the faces need no clipping.
+///////////////////////////////////////////////////////////////////////////////
+static void process_shadow_meshlet(geometry_job_t* job, vertex_cache_t* vertex_cache, meshlet_t* meshlet) {
+	mesh_t* mesh = job->instance->mesh;
+	transform_vertex_range(vertex_cache, &job->instance->world_shadow_matrix, &mesh->vertices, meshlet->first_vertex, meshlet->num_vertices);
+
+	int last_face = meshlet->first_face + meshlet->num_faces;
+	for (int i = meshlet->first_face; i < last_face; i++) {
+		int* face_indices = &mesh->indices[i * 3];
+		vec4_t a = get_cached_vertex(vertex_cache, face_indices[0]);
+		vec4_t b = get_cached_vertex(vertex_cache, face_indices[1]);
+		vec4_t c = get_cached_vertex(vertex_cache, face_indices[2]);
+
+		// Faces towards the light have a positive area, like the faces towards the camera on the screen
+		float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+		if (area >= 0) {
+			continue;
+		}
+
+		shadow_triangle_t triangle = {
+			.points = { vec3_from_vec4(a), vec3_from_vec4(b), vec3_from_vec4(c) }
+		};
+		emit_shadow_triangle(job, &triangle);
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process the graphics pipeline stages for all the mesh triangles
 ///////////////////////////////////////////////////////////////////////////////
@@ -175,170 +516,377 @@ void process_input(void) {
 //                        `--> | Screen space |  <-- ready to render
 //                             +--------------+
 ///////////////////////////////////////////////////////////////////////////////
-void process_graphics_pipeline_stages(mesh_t* mesh) {
-	// Create a scale, rotation and translation matrices that will be used to multiply the mesh vertices
-	mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-	mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-	mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-	mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-	mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
+void process_graphics_pipeline_stages(geometry_job_t* job, vertex_cache_t* vertex_cache) {
+	mesh_instance_t* instance = job->instance;
+	mesh_t* mesh = instance->mesh;
+	light_list_t local_lights;
 
-	// Update camera look at target to create view matrix
-	vec3_t target = get_camera_lookat_target();
-	vec3_t up_direction = vec3_new(0, 1, 0);
-	view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+	// Loop the meshlets (clusters of neighbouring faces) of the job
+	int last_meshlet = job->first_meshlet + job->num_meshlets;
+	for (int m = job->first_meshlet; m < last_meshlet; m++) {
+		meshlet_t* meshlet = &mesh->meshlets[m];
 
-	// Loop all triangle faces of the mesh
-	int num_faces = array_length(mesh->faces);
-	for (int i = 0; i < num_faces; i++) {
-		face_t mesh_face = mesh->faces[i];
-
-		vec3_t face_vertices[3];
-		face_vertices[0] = mesh->vertices[mesh_face.a];
-		face_vertices[1] = mesh->vertices[mesh_face.b];
-		face_vertices[2] = mesh->vertices[mesh_face.c];
-
-		vec4_t transformed_vertices[3];
-
-		// Loop all three vertices of this current face and apply transformations
-		for (int j = 0; j < 3; j++) {
-			vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-			
-			// Create a World Matrix combining scale, rotation and translation matrices
-			world_matrix = mat4_identity();
-			
-			// Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
-			world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-			world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-			// Multiply the world matrix by the original vector
-			transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-			// Multiply the view matrix by the original vector to transform the scene to camera space
-			transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-			// Save transformed vertex in the array of transformed vertices
-			transformed_vertices[j] = transformed_vertex;
+		// Every meshlet goes to the shadow map, the ones outside the view can still cast shadows into it
+		if (geometry_shadow_map) {
+			process_shadow_meshlet(job, vertex_cache, meshlet);
 		}
 
-		// Calculate the triangle face normal
-		vec3_t face_normal = get_triangle_normal(transformed_vertices);
+		// Move the meshlet bounding sphere to camera space
+		vec4_t center = vec4_from_vec3(meshlet->center);
+		mat4_mul_vec4_ptr(&center, &instance->world_view_matrix, &center);
+		vec3_t view_center = vec3_from_vec4(center);
+		float view_radius = meshlet->radius * instance->max_scale;
 
-		if (should_cull_backface()) {
-			// Find the vector between a point in the triangle (A) and the camera origin
-			vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(transformed_vertices[0]));
+		// Bypass the meshlets that are completely outside the view frustum
+		int frustum_test = classify_sphere_against_frustum(view_center, view_radius);
+		if (frustum_test == FRUSTUM_OUTSIDE) {
+			continue;
+		}
 
-			// Check normal alignment
-			float dot_normal_camera = vec3_dot(face_normal, camera_ray);
+		// Bypass the meshlets whose faces are all looking away from the camera
+		if (should_cull_backface() && instance->is_uniform_scale && is_meshlet_backfacing(meshlet, &instance->world_view_matrix, view_center, view_radius)) {
+			continue;
+		}
 
-			// Bypass the triangles that are looking away from the camera
-			if (dot_normal_camera < 0) {
-				continue;
-			}
+		// Transform and light the vertices used by the meshlet in one batch
+		transform_vertex_range(vertex_cache, &instance->world_view_matrix, &mesh->vertices, meshlet->first_vertex, meshlet->num_vertices);
+		light_vertex_range(vertex_cache, instance->light_vector, &mesh->vertices, meshlet->first_vertex, meshlet->num_vertices);
+
+		// Add the local lights found in the light grid clusters the meshlet overlaps
+		if (get_lights_in_sphere(&local_lights, view_center, view_radius) > 0) {
+			light_vertex_range_local(vertex_cache, &local_lights, &instance->world_view_matrix, &mesh->vertices, meshlet->first_vertex, meshlet->num_vertices);
 		}
+
+		// Loop all triangle faces of the meshlet
+		int last_face = meshlet->first_face + meshlet->num_faces;
+		for (int i = meshlet->first_face; i < last_face; i++) {
+			int* face_indices = &mesh->indices[i * 3];
+
+			vec4_t transformed_vertices[3];
+			for (int j = 0; j < 3; j++) {
+				transformed_vertices[j] = get_cached_vertex(vertex_cache, face_indices[j]);
+			}
+
+			if (should_cull_backface()) {
+				// Calculate the triangle face normal
+				vec3_t face_normal = get_triangle_normal(transformed_vertices);
+
+				// Find the vector between a point in the triangle (A) and the camera origin
+				vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(transformed_vertices[0]));
+
+				// Check normal alignment
+				float dot_normal_camera = vec3_dot(face_normal, camera_ray);
+
+				// Bypass the triangles that are looking away from the camera
+				if (dot_normal_camera < 0) {
+					continue;
+				}
+			}
 		
-		// Create a polygon from the original transformed triangle to be clipped
-		polygon_t polygon = polygon_from_triangle(
-			vec3_from_vec4(transformed_vertices[0]),
-			vec3_from_vec4(transformed_vertices[1]),
-			vec3_from_vec4(transformed_vertices[2]),
-			mesh_face.a_uv,
-			mesh_face.b_uv,
-			mesh_face.c_uv
-		);
+			// Create a polygon from the original transformed triangle to be clipped
+			polygon_t polygon = polygon_from_triangle(
+				vec3_from_vec4(transformed_vertices[0]),
+				vec3_from_vec4(transformed_vertices[1]),
+				vec3_from_vec4(transformed_vertices[2]),
+				(tex2_t){ mesh->vertices.u[face_indices[0]], mesh->vertices.v[face_indices[0]] },
+				(tex2_t){ mesh->vertices.u[face_indices[1]], mesh->vertices.v[face_indices[1]] },
+				(tex2_t){ mesh->vertices.u[face_indices[2]], mesh->vertices.v[face_indices[2]] },
+				get_cached_vertex_light(vertex_cache, face_indices[0]),
+				get_cached_vertex_light(vertex_cache, face_indices[1]),
+				get_cached_vertex_light(vertex_cache, face_indices[2]),
+				get_cached_vertex_shadowed_light(vertex_cache, face_indices[0]),
+				get_cached_vertex_shadowed_light(vertex_cache, face_indices[1]),
+				get_cached_vertex_shadowed_light(vertex_cache, face_indices[2])
+			);
 
-		// Clip the polygon and returns a new polygon with potentional new vertices
-		clip_polygon(&polygon);
+			// Clip the polygon and returns a new polygon with potentional new vertices (only if the meshlet crosses a frustum plane)
+			if (frustum_test == FRUSTUM_INTERSECT) {
+				clip_polygon(&polygon);
+			}
 
-		// Break the clipped polygon apart back into indicidual triangles
-		triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
-		int num_triangles_after_clipping = 0;
-		triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+			// Break the clipped polygon apart back into indicidual triangles
+			triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
+			int num_triangles_after_clipping = 0;
+			triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
 
-		// Loops all the assembled triangles after clipping
-		for (int t = 0; t < num_triangles_after_clipping; t++) {
-			triangle_t triangle_after_clipping = triangles_after_clipping[t];
+			// Loops all the assembled triangles after clipping
+			for (int t = 0; t < num_triangles_after_clipping; t++) {
+				triangle_t triangle_after_clipping = triangles_after_clipping[t];
 
-			// Project
-			vec4_t projected_points[3];
-			for (int j = 0; j < 3; j++) {
-				// Project the current vertex
-				projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
-
-				/*
-				// Perform perspective divide
-				if (projected_points[j].w != 0) {
-					projected_points[j].x /= projected_points[j].w;
-					projected_points[j].y /= projected_points[j].w;
-					projected_points[j].z /= projected_points[j].w;
+				// Find the shadow map position of the clipped vertices while they are still in camera space
+				for (int j = 0; j < 3; j++) {
+					vec4_t shadow_position = { 0, 0, 0, 1 };
+					if (geometry_shadow_map) {
+						mat4_mul_vec4_ptr(&shadow_position, &geometry_shadow_map->matrix, &triangle_after_clipping.points[j]);
+					}
+					triangle_after_clipping.shadow.position[j] = vec3_from_vec4(shadow_position);
+				}
+
+				// Project
+				vec4_t projected_points[3];
+				for (int j = 0; j < 3; j++) {
+					// Project the current vertex
+					mat4_mul_vec4_project_ptr(&projected_points[j], &proj_matrix, &triangle_after_clipping.points[j]);
+
+					/*
+					// Perform perspective divide
+					if (projected_points[j].w != 0) {
+						projected_points[j].x /= projected_points[j].w;
+						projected_points[j].y /= projected_points[j].w;
+						projected_points[j].z /= projected_points[j].w;
+					}
+					*/
+
+					// Flip vertically since the y values of the 3D mesh grow bottom->up and in screen space y values grow top->down
+					projected_points[j].y *= -1;
+
+					// Scale into the view
+					projected_points[j].x *= (get_window_width() / 2.0);
+					projected_points[j].y *= (get_window_height() / 2.0);
+
+					// Translate the projected points to the middle of the screen
+					projected_points[j].x += (get_window_width() / 2.0);
+					projected_points[j].y += (get_window_height() / 2.0);
 				}
-				*/
 
-				// Flip vertically since the y values of the 3D mesh grow bottom->up and in screen space y values grow top->down
-				projected_points[j].y *= -1;
+				triangle_t triangle_to_render = {
+					.points = {
+						{ projected_points[0].x, projected_points[0].y, projected_points[0].z, projected_points[0].w },
+						{ projected_points[1].x, projected_points[1].y, projected_points[1].z, projected_points[1].w },
+						{ projected_points[2].x, projected_points[2].y, projected_points[2].z, projected_points[2].w }
+					},
+					.texcoords = {
+						{ triangle_after_clipping.texcoords[0].u, triangle_after_clipping.texcoords[0].v },
+						{ triangle_after_clipping.texcoords[1].u, triangle_after_clipping.texcoords[1].v },
+						{ triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v }
+					},
+					.light = { triangle_after_clipping.light[0], triangle_after_clipping.light[1], triangle_after_clipping.light[2] },
+					.shadow = triangle_after_clipping.shadow,
+					.texture = mesh->texture,
+					.texture_filter = mesh->texture_filter
+				};
 
-				// Scale into the view
-				projected_points[j].x *= (get_window_width() / 2.0);
-				projected_points[j].y *= (get_window_height() / 2.0);
+				// Save the projected triangle in the output list of the job
+				emit_triangle(job, &triangle_to_render);
+			}
+		}
+	}
+}
+
+static void process_geometry_jobs(void* data, int first, int last, int worker_index) {
+	for (int i = first; i < last; i++) {
+		geometry_jobs[i].num_triangles = 0;
+		geometry_jobs[i].num_shadow_triangles = 0;
+		for (int tile = 0; tile < NUM_SHADOW_TILES; tile++) {
+			geometry_jobs[i].shadow_bins[tile].count = 0;
+		}
+		process_graphics_pipeline_stages(&geometry_jobs[i], &vertex_caches[worker_index]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Split the meshlets of a mesh into geometry jobs of about the same size
+///////////////////////////////////////////////////////////////////////////////
+static void add_geometry_jobs(mesh_instance_t* instance) {
+	mesh_t* mesh = instance->mesh;
+	int num_meshlets = array_length(mesh->meshlets);
+	int m = 0;
+	while (m < num_meshlets && num_geometry_jobs < MAX_GEOMETRY_JOBS) {
+		geometry_job_t* job = &geometry_jobs[num_geometry_jobs++];
+		job->instance = instance;
+		job->first_meshlet = m;
+
+		// The last job available takes all the remaining meshlets
+		int num_faces = 0;
+		while (m < num_meshlets && (num_faces < GEOMETRY_JOB_FACES || num_geometry_jobs == MAX_GEOMETRY_JOBS)) {
+			num_faces += mesh->meshlets[m].num_faces;
+			m++;
+		}
+		job->num_meshlets = m - job->first_meshlet;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Clear and draw bands of rows of the shadow map with the depth-only
+// rasterizer, from the bins of the band in all the geometry jobs
+///////////////////////////////////////////////////////////////////////////////
+static void draw_shadow_tiles(void* data, int first, int last, int worker_index) {
+	shadow_map_t* shadow_map = (shadow_map_t*)data;
+	for (int tile = first; tile < last; tile++) {
+		int y_min = tile * SHADOW_TILE_HEIGHT;
+		int y_max = y_min + SHADOW_TILE_HEIGHT - 1;
+		clear_shadow_map(shadow_map, y_min, y_max);
 
-				// Translate the projected points to the middle of the screen
-				projected_points[j].x += (get_window_width() / 2.0);
-				projected_points[j].y += (get_window_height() / 2.0);
+		for (int i = 0; i < num_geometry_jobs; i++) {
+			shadow_bin_t* bin = &geometry_jobs[i].shadow_bins[tile];
+			for (int j = 0; j < bin->count; j++) {
+				vec3_t* points = geometry_jobs[i].shadow_triangles[bin->indices[j]].points;
+				draw_depth_triangle(
+					points[0].x, points[0].y, points[0].z,
+					points[1].x, points[1].y, points[1].z,
+					points[2].x, points[2].y, points[2].z,
+					shadow_map->depth, SHADOW_MAP_SIZE,
+					y_min, y_max
+				);
 			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the geometry jobs of all meshes and merge their output lists
+///////////////////////////////////////////////////////////////////////////////
+// Every job writes to its own triangle list, so the workers never share
+// output. The lists are concatenated in job order afterwards, which gives the
+// same triangle order as processing the meshes one after another. The result
+// goes to the list that is not being drawn. The shadow triangles of the jobs
+// are drawn into the shadow map of the list once all jobs are done.
+///////////////////////////////////////////////////////////////////////////////
+static void scene_geometry_job(void* data, int worker_index) {
+	parallel_for(num_geometry_jobs, 1, process_geometry_jobs, NULL);
+
+	if (geometry_shadow_map) {
+		parallel_for(NUM_SHADOW_TILES, 1, draw_shadow_tiles, geometry_shadow_map);
+	}
 
-			// Calculate the shade intensity based on how aligned the face normal and the inverse of the light ray
-			float light_intensity_factor = get_light_intensity() * -vec3_dot(face_normal, get_light_direction());
-
-			triangle_t triangle_to_render = {
-				.points = {
-					{ projected_points[0].x, projected_points[0].y, projected_points[0].z, projected_points[0].w },
-					{ projected_points[1].x, projected_points[1].y, projected_points[1].z, projected_points[1].w },
-					{ projected_points[2].x, projected_points[2].y, projected_points[2].z, projected_points[2].w }
-				},
-				.texcoords = {
-					{ triangle_after_clipping.texcoords[0].u, triangle_after_clipping.texcoords[0].v },
-					{ triangle_after_clipping.texcoords[1].u, triangle_after_clipping.texcoords[1].v },
-					{ triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v }
-				},
-				.light = light_intensity_factor,
-                .texture = mesh->texture
-			};
-
-			// Save the projected triangle in the array of triangles to render
-			if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH) {
-				triangles_to_render[num_triangles_to_render++] = triangle_to_render;
+	int list = 1 - render_list;
+	num_triangles_to_render[list] = 0;
+	for (int i = 0; i < num_geometry_jobs; i++) {
+		int count = geometry_jobs[i].num_triangles;
+		if (count > MAX_SCENE_TRIANGLES - num_triangles_to_render[list]) {
+			count = MAX_SCENE_TRIANGLES - num_triangles_to_render[list];
+			if (!has_reported_triangle_overflow) {
+				fprintf(stderr, "Too many triangles in the scene (max %d), some triangles are not drawn.\n", MAX_SCENE_TRIANGLES);
+				has_reported_triangle_overflow = true;
 			}
 		}
+		memcpy(&triangles_to_render[list][num_triangles_to_render[list]], geometry_jobs[i].triangles, sizeof(triangle_t) * count);
+		num_triangles_to_render[list] += count;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Aim a shadow map along the light so it covers all the meshes, and find the
+// shadow map matrices of the mesh instances
+///////////////////////////////////////////////////////////////////////////////
+// The bounds are the camera space box around the bounding spheres of all the
+// meshlets, the shadow map covers the sphere around that box.
+///////////////////////////////////////////////////////////////////////////////
+static void fit_scene_shadow_map(shadow_map_t* shadow_map) {
+	vec3_t box_min = vec3_new(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3_t box_max = vec3_new(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		mesh_instance_t* instance = &mesh_instances[mesh_index];
+		mesh_t* mesh = instance->mesh;
+		for (int m = 0; m < array_length(mesh->meshlets); m++) {
+			vec4_t center = vec4_from_vec3(mesh->meshlets[m].center);
+			mat4_mul_vec4_ptr(&center, &instance->world_view_matrix, &center);
+			float radius = mesh->meshlets[m].radius * instance->max_scale;
+			box_min = vec3_new(fminf(box_min.x, center.x - radius), fminf(box_min.y, center.y - radius), fminf(box_min.z, center.z - radius));
+			box_max = vec3_new(fmaxf(box_max.x, center.x + radius), fmaxf(box_max.y, center.y + radius), fmaxf(box_max.z, center.z + radius));
+		}
+	}
+
+	vec3_t center = vec3_new(0, 0, 0);
+	float radius = 1.0;
+	if (box_min.x <= box_max.x) {
+		center = vec3_mul(vec3_add(box_min, box_max), 0.5);
+		radius = fmaxf(vec3_length(vec3_sub(box_max, box_min)) * 0.5, 0.001);
+	}
+	fit_shadow_map(shadow_map, get_light_direction(), center, radius);
+
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		mesh_instance_t* instance = &mesh_instances[mesh_index];
+		mat4_mul_mat4_ptr(&instance->world_shadow_matrix, &shadow_map->matrix, &instance->world_view_matrix);
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Start processing the geometry of the scene in its current state
+///////////////////////////////////////////////////////////////////////////////
+// The meshes must not change until finish_scene_geometry() returns.
+///////////////////////////////////////////////////////////////////////////////
+void begin_scene_geometry(void) {
+	// Update camera look at target to create view matrix
+	vec3_t target = get_camera_lookat_target();
+	vec3_t up_direction = vec3_new(0, 1, 0);
+	view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+
+	// Move the local lights to camera space and assign them to the light grid clusters
+	assign_local_lights(&view_matrix);
+
+	num_geometry_jobs = 0;
+	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+		prepare_mesh_instance(&mesh_instances[mesh_index], get_mesh(mesh_index));
+		add_geometry_jobs(&mesh_instances[mesh_index]);
+	}
+
+	// The geometry draws the shadow map that goes with its triangle list
+	geometry_shadow_map = NULL;
+	if (are_shadows_enabled()) {
+		geometry_shadow_map = &shadow_maps[1 - render_list];
+		fit_scene_shadow_map(geometry_shadow_map);
+	}
+	has_shadow_map[1 - render_list] = geometry_shadow_map != NULL;
+
+	job_t job = { .function = scene_geometry_job, .data = NULL };
+	submit_jobs(&job, 1, &geometry_counter);
+	is_geometry_pending = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for the geometry of the scene and make it the list to render
+///////////////////////////////////////////////////////////////////////////////
+void finish_scene_geometry(void) {
+	if (!is_geometry_pending) {
+		return;
+	}
+	wait_for_counter(&geometry_counter);
+	render_list = 1 - render_list;
+	is_geometry_pending = false;
+	is_render_list_valid = true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Update function frame by frame with a fixed time step
 ///////////////////////////////////////////////////////////////////////////////
 void update(void) {	
-	// Wait some time until the reach the target frame time in milliseconds
-	int time_to_wait = FRAME_TARGET_TIME - (SDL_GetTicks() - previous_frame_time);
+	// Wait as the pacing mode requires and get the delta time in seconds to be used to update our game objects
+	delta_time = wait_for_next_frame();
+
+	begin_frame_stage(FRAME_STAGE_UPDATE);
+
+	// Follow the frame quality of the adaptive pacing with the render resolution (the pixel count scales with the quality)
+	if (set_render_scale(sqrtf(get_frame_quality()))) {
+		update_projection();
 
-	// Only delay execution if we are running too fast
-	if (time_to_wait > 0 && time_to_wait <= FRAME_TARGET_TIME) {
-		SDL_Delay(time_to_wait);
+		// The triangles of the last frame were projected for the old resolution
+		is_render_list_valid = false;
 	}
 
-	// Get a delta time factor converted to secdons to be used to update our game objects
-	delta_time = (SDL_GetTicks() - previous_frame_time) / 1000.0;
+	// Swap in the meshes and textures that finished loading since the last frame
+	if (apply_loaded_assets() > 0) {
+		// The triangles of the last frame may point to textures that were just replaced
+		is_render_list_valid = false;
 
-	previous_frame_time = SDL_GetTicks();
+		// Pack the small textures into shared atlas pages once everything queued is loaded
+		if (get_num_pending_loads() == 0) {
+			pack_mesh_textures();
+		}
+	}
 
-	// Initialize the counter of triangles to render for the current frame
-	num_triangles_to_render = 0;
+	// Reload the texture levels requested by the last frame and evict the least recently used ones
+	update_texture_residency();
 
 	// Loop all the meshes in the scene
 	for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
 		mesh_t* mesh = get_mesh(mesh_index);
 
+		// The floor stays in place
+		if (mesh_index == floor_mesh_index) {
+			continue;
+		}
+
 		// Change the mesh scale / rotation values per animation frame
 		//mesh.scale.x += 0.002 * delta_time;
 		//mesh.scale.y += 0.001 * delta_time;
@@ -348,72 +896,240 @@ void update(void) {
 		//mesh.rotation.z += 0.5 * delta_time;
 		//mesh.translation.x += 0.01 * delta_time;
 		//mesh.translation.z = 5.0;
+	}
 
-		// Process the graphics pipeline stages for every mesh of the 3D scene
-		process_graphics_pipeline_stages(mesh);
+	// Orbit the point lights and follow the camera with the spot light
+	orbit_angle += 0.8 * delta_time;
+	place_scene_lights();
+
+	end_frame_stage(FRAME_STAGE_UPDATE);
+
+	// Process the graphics pipeline stages for every mesh of the 3D scene
+	begin_frame_stage(FRAME_STAGE_GEOMETRY);
+	begin_scene_geometry();
+
+	// Draw this geometry in this frame, unless it can overlap with drawing the last frame
+	if (frame_pipeline_mode == PIPELINE_LATENCY || !is_render_list_valid) {
+		finish_scene_geometry();
 	}
+	end_frame_stage(FRAME_STAGE_GEOMETRY);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Render function to draw objects on the display
+// Split the screen rows into raster tiles, returns the number of tiles
 ///////////////////////////////////////////////////////////////////////////////
-void render(void) {
-	
-	clear_color_buffer(color_bg);
-	clear_z_buffer();
+static int split_raster_tiles(void) {
+	int num_tiles = (get_window_height() + RASTER_TILE_HEIGHT - 1) / RASTER_TILE_HEIGHT;
+	if (num_tiles > MAX_RASTER_TILES) {
+		num_tiles = MAX_RASTER_TILES;
+	}
+	for (int i = 0; i < num_tiles; i++) {
+		raster_tiles[i].y_min = i * RASTER_TILE_HEIGHT;
+		raster_tiles[i].y_max = i * RASTER_TILE_HEIGHT + RASTER_TILE_HEIGHT - 1;
+	}
+	// The last tile takes all the remaining rows
+	raster_tiles[num_tiles - 1].y_max = get_window_height() - 1;
+	return num_tiles;
+}
+
+static void upscale_rows(void* data, int first, int last, int worker_index) {
+	upscale_color_buffer(first, last - 1);
+}
+
+static void clear_tile_job(void* data, int worker_index) {
+	raster_tile_t* tile = (raster_tile_t*)data;
+	clear_color_buffer(color_bg, tile->y_min, tile->y_max);
+	clear_z_buffer(tile->y_min, tile->y_max);
+	if (should_defer_texturing()) {
+		clear_visibility_buffer(tile->y_min, tile->y_max);
+	}
+}
 
-	draw_grid(color_grid);
+///////////////////////////////////////////////////////////////////////////////
+// Draw the wireframe and the vertex points of a triangle if the render method
+// asks for them
+///////////////////////////////////////////////////////////////////////////////
+static void draw_triangle_outline(triangle_t* triangle, int y_min, int y_max) {
+	// Draw unfilled triangle
+	if (should_render_wire()) {
+		draw_triangle(
+			triangle->points[0].x, triangle->points[0].y, 
+			triangle->points[1].x, triangle->points[1].y, 
+			triangle->points[2].x, triangle->points[2].y, 
+			color_wireframe,
+			y_min, y_max
+		);
+	}
+
+	// Draw vertex points
+	if (should_render_wire_vertex()) {
+		draw_rect(triangle->points[0].x, triangle->points[0].y, 3, 3, color_vertex_point, y_min, y_max);
+		draw_rect(triangle->points[1].x, triangle->points[1].y, 3, 3, color_vertex_point, y_min, y_max);
+		draw_rect(triangle->points[2].x, triangle->points[2].y, 3, 3, color_vertex_point, y_min, y_max);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw the grid and all the projected triangles that touch one raster tile
+///////////////////////////////////////////////////////////////////////////////
+// Triangles are drawn in the same order in every tile, so the image is the
+// same as drawing the whole screen at once. With deferred texturing the
+// textured triangles only write their depth and id, the tile is textured once
+// all of them are drawn and the wireframes are drawn on top of it.
+///////////////////////////////////////////////////////////////////////////////
+static void raster_tile_job(void* data, int worker_index) {
+	raster_tile_t* tile = (raster_tile_t*)data;
+	int y_min = tile->y_min;
+	int y_max = tile->y_max;
+	bool is_deferred = should_defer_texturing();
+	shadow_map_t* shadow_map = has_shadow_map[render_list] ? &shadow_maps[render_list] : NULL;
+
+	draw_grid(color_grid, y_min, y_max);
 
 	// Loop all projected triangles and render them
-	for (int i = 0; i < num_triangles_to_render; i++) {
-		triangle_t triangle = triangles_to_render[i];
+	for (int i = 0; i < num_triangles_to_render[render_list]; i++) {
+		triangle_t* triangle = &triangles_to_render[render_list][i];
+
+		// Skip the triangles above or below the tile (vertex points reach 2 rows below the vertex)
+		int triangle_y_min = fminf(triangle->points[0].y, fminf(triangle->points[1].y, triangle->points[2].y));
+		int triangle_y_max = fmaxf(triangle->points[0].y, fmaxf(triangle->points[1].y, triangle->points[2].y));
+		if (triangle_y_max + 2 < y_min || triangle_y_min > y_max) {
+			continue;
+		}
 
 		// Draw filled triangle
 		if (should_render_filled_triangle()) {
 			draw_filled_triangle(
-				triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w,
-				triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w,
-				triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w,
-				triangle.light, color_filled_triangle
+				triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w, triangle->light[0],
+				triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w, triangle->light[1],
+				triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w, triangle->light[2],
+				color_filled_triangle,
+				y_min, y_max
+			);
+		}
+
+		// Draw the depth and id of a textured triangle, it is textured by the resolve below
+		if (is_deferred && triangle->texture) {
+			draw_visibility_triangle(
+				triangle->points[0].x, triangle->points[0].y, triangle->points[0].w,
+				triangle->points[1].x, triangle->points[1].y, triangle->points[1].w,
+				triangle->points[2].x, triangle->points[2].y, triangle->points[2].w,
+				i + 1,
+				y_min, y_max
 			);
+			continue;
 		}
 
 		// Draw textured triangle
-		if (should_render_textured_triangle()) {
+		if (should_render_textured_triangle() && triangle->texture) {
 			draw_textured_triangle(
-				triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v, // vertex A
-				triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v, // vertex B
-				triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v, // vertex C
-				triangle.light, triangle.texture
+				triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w, triangle->texcoords[0].u, triangle->texcoords[0].v, triangle->light[0], // vertex A
+				triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w, triangle->texcoords[1].u, triangle->texcoords[1].v, triangle->light[1], // vertex B
+				triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w, triangle->texcoords[2].u, triangle->texcoords[2].v, triangle->light[2], // vertex C
+				&triangle_samplers[i],
+				shadow_map, &triangle->shadow,
+				y_min, y_max
 			);
 		}
 
-		// Draw unfilled triangle
-		if (should_render_wire()) {
-			draw_triangle(
-				triangle.points[0].x, triangle.points[0].y, 
-				triangle.points[1].x, triangle.points[1].y, 
-				triangle.points[2].x, triangle.points[2].y, 
-				color_wireframe
-			);
+		draw_triangle_outline(triangle, y_min, y_max);
+	}
+
+	if (is_deferred) {
+		// Texture every visible pixel once, then draw the wireframes on top
+		resolve_visibility_buffer(triangles_to_render[render_list], triangle_samplers, shadow_map, y_min, y_max);
+		for (int i = 0; i < num_triangles_to_render[render_list]; i++) {
+			triangle_t* triangle = &triangles_to_render[render_list][i];
+			if (!triangle->texture) {
+				continue;
+			}
+			int triangle_y_min = fminf(triangle->points[0].y, fminf(triangle->points[1].y, triangle->points[2].y));
+			int triangle_y_max = fmaxf(triangle->points[0].y, fmaxf(triangle->points[1].y, triangle->points[2].y));
+			if (triangle_y_max + 2 < y_min || triangle_y_min > y_max) {
+				continue;
+			}
+			draw_triangle_outline(triangle, y_min, y_max);
 		}
+	}
+}
 
-		// Draw vertex points
-		if (should_render_wire_vertex()) {
-			draw_rect(triangle.points[0].x, triangle.points[0].y, 3, 3, color_vertex_point);
-			draw_rect(triangle.points[1].x, triangle.points[1].y, 3, 3, color_vertex_point);
-			draw_rect(triangle.points[2].x, triangle.points[2].y, 3, 3, color_vertex_point);
+///////////////////////////////////////////////////////////////////////////////
+// Render function to draw objects on the display
+///////////////////////////////////////////////////////////////////////////////
+// The tiles are cleared by one batch of jobs and drawn by a second batch that
+// only starts once the clears are done. The main thread resolves the texture
+// samplers in the meantime. With the throughput pipeline the geometry jobs of
+// the next frame run on the same workers and are waited for at the end.
+///////////////////////////////////////////////////////////////////////////////
+void render(void) {
+	begin_frame_stage(FRAME_STAGE_RASTER);
+
+	// Draw straight into the texture memory if the present mode allows it
+	lock_color_buffer();
+
+	int num_tiles = split_raster_tiles();
+	job_t clear_jobs[MAX_RASTER_TILES];
+	job_t raster_jobs[MAX_RASTER_TILES];
+	for (int i = 0; i < num_tiles; i++) {
+		clear_jobs[i].function = clear_tile_job;
+		clear_jobs[i].data = &raster_tiles[i];
+		raster_jobs[i].function = raster_tile_job;
+		raster_jobs[i].data = &raster_tiles[i];
+	}
+
+	SDL_atomic_t clear_counter;
+	SDL_atomic_t raster_counter;
+	SDL_AtomicSet(&clear_counter, 0);
+	SDL_AtomicSet(&raster_counter, 0);
+	submit_jobs(clear_jobs, num_tiles, &clear_counter);
+
+	if (should_render_textured_triangle()) {
+		triangle_t* triangles = triangles_to_render[render_list];
+		for (int i = 0; i < num_triangles_to_render[render_list]; i++) {
+			if (triangles[i].texture) {
+				triangle_samplers[i] = get_triangle_texture_sampler(&triangles[i]);
+			}
 		}
 	}
 
+	submit_jobs_after(raster_jobs, num_tiles, &raster_counter, &clear_counter);
+	wait_for_counter(&raster_counter);
+	end_frame_stage(FRAME_STAGE_RASTER);
+
+	begin_frame_stage(FRAME_STAGE_PRESENT);
+	if (is_render_scaled()) {
+		parallel_for(get_output_height(), UPSCALE_JOB_ROWS, upscale_rows, NULL);
+	}
 	render_color_buffer();
+	end_frame_stage(FRAME_STAGE_PRESENT);
+
+	// The geometry of the next frame becomes the list to render
+	begin_frame_stage(FRAME_STAGE_GEOMETRY);
+	finish_scene_geometry();
+	end_frame_stage(FRAME_STAGE_GEOMETRY);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Free memory taht was dunamicaly allocated by the program
 ///////////////////////////////////////////////////////////////////////////////
 void free_resources(void) {
+	free_loader();
+	free_job_system();
 	free_meshes();
+	free_texture_atlases();
+	free_texture_cache();
+	for (int i = 0; i < MAX_GEOMETRY_JOBS; i++) {
+		free(geometry_jobs[i].triangles);
+		free(geometry_jobs[i].shadow_triangles);
+		for (int tile = 0; tile < NUM_SHADOW_TILES; tile++) {
+			free(geometry_jobs[i].shadow_bins[tile].indices);
+		}
+	}
+	free_shadow_map(&shadow_maps[0]);
+	free_shadow_map(&shadow_maps[1]);
+	for (int i = 0; i <= MAX_JOB_THREADS; i++) {
+		free_vertex_cache(&vertex_caches[i]);
+	}
 	destroy_window();
 }
 
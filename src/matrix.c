@@ -1,6 +1,13 @@
 #include <math.h>
 #include "matrix.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
 mat4_t mat4_identity(void) {
 	mat4_t m = {{
 		{ 1, 0, 0, 0 },
@@ -82,20 +89,13 @@ mat4_t mat4_make_rotation_z(float angle) {
 
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v) {
 	vec4_t result;
-	result.x = m.m[0][0] * v.x + m.m[0][1] * v.y + m.m[0][2] * v.z + m.m[0][3] * v.w;
-	result.y = m.m[1][0] * v.x + m.m[1][1] * v.y + m.m[1][2] * v.z + m.m[1][3] * v.w;
-	result.z = m.m[2][0] * v.x + m.m[2][1] * v.y + m.m[2][2] * v.z + m.m[2][3] * v.w;
-	result.w = m.m[3][0] * v.x + m.m[3][1] * v.y + m.m[3][2] * v.z + m.m[3][3] * v.w;
+	mat4_mul_vec4_ptr(&result, &m, &v);
 	return result;
 }
 
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b) {
 	mat4_t m;
-	for (int i = 0; i < 4; i++) {
-		for (int j = 0; j < 4; j++) {
-			m.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
-		}
-	}
+	mat4_mul_mat4_ptr(&m, &a, &b);
 	return m;
 }
 
@@ -133,14 +133,166 @@ mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
 }
 
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
+	vec4_t result;
+	mat4_mul_vec4_project_ptr(&result, &mat_proj, &v);
+	return result;
+}
+
+#if defined(__SSE2__)
+///////////////////////////////////////////////////////////////////////////////
+// Load the matrix as four column registers, the matrix is stored row-major
+///////////////////////////////////////////////////////////////////////////////
+static inline void mat4_load_columns(const mat4_t* m, __m128* c0, __m128* c1, __m128* c2, __m128* c3) {
+	__m128 r0 = _mm_loadu_ps(m->m[0]);
+	__m128 r1 = _mm_loadu_ps(m->m[1]);
+	__m128 r2 = _mm_loadu_ps(m->m[2]);
+	__m128 r3 = _mm_loadu_ps(m->m[3]);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	*c0 = r0;
+	*c1 = r1;
+	*c2 = r2;
+	*c3 = r3;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// M * v as a sum of the columns scaled by the vector components
+///////////////////////////////////////////////////////////////////////////////
+// The sum is evaluated in the same order as the scalar dot products, so the
+// SSE and scalar builds produce bit identical results.
+///////////////////////////////////////////////////////////////////////////////
+static inline __m128 mat4_mul_columns(__m128 c0, __m128 c1, __m128 c2, __m128 c3, __m128 v) {
+	__m128 result = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+	result = _mm_add_ps(result, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+	result = _mm_add_ps(result, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+	result = _mm_add_ps(result, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+	return result;
+}
+#endif
+
+void mat4_mul_vec4_ptr(vec4_t* result, const mat4_t* m, const vec4_t* v) {
+#if defined(__SSE2__)
+	__m128 c0, c1, c2, c3;
+	mat4_load_columns(m, &c0, &c1, &c2, &c3);
+	_mm_storeu_ps(&result->x, mat4_mul_columns(c0, c1, c2, c3, _mm_loadu_ps(&v->x)));
+#else
+	vec4_t r;
+	r.x = m->m[0][0] * v->x + m->m[0][1] * v->y + m->m[0][2] * v->z + m->m[0][3] * v->w;
+	r.y = m->m[1][0] * v->x + m->m[1][1] * v->y + m->m[1][2] * v->z + m->m[1][3] * v->w;
+	r.z = m->m[2][0] * v->x + m->m[2][1] * v->y + m->m[2][2] * v->z + m->m[2][3] * v->w;
+	r.w = m->m[3][0] * v->x + m->m[3][1] * v->y + m->m[3][2] * v->z + m->m[3][3] * v->w;
+	*result = r;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A * B, each row of the result is a combination of the rows of B
+// (result may point to a or b)
+///////////////////////////////////////////////////////////////////////////////
+void mat4_mul_mat4_ptr(mat4_t* result, const mat4_t* a, const mat4_t* b) {
+#if defined(__SSE2__)
+	__m128 b0 = _mm_loadu_ps(b->m[0]);
+	__m128 b1 = _mm_loadu_ps(b->m[1]);
+	__m128 b2 = _mm_loadu_ps(b->m[2]);
+	__m128 b3 = _mm_loadu_ps(b->m[3]);
+	for (int i = 0; i < 4; i++) {
+		__m128 row = mat4_mul_columns(b0, b1, b2, b3, _mm_loadu_ps(a->m[i]));
+		_mm_storeu_ps(result->m[i], row);
+	}
+#else
+	mat4_t m;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			m.m[i][j] = a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j] + a->m[i][2] * b->m[2][j] + a->m[i][3] * b->m[3][j];
+		}
+	}
+	*result = m;
+#endif
+}
+
+void mat4_mul_vec4_project_ptr(vec4_t* result, const mat4_t* mat_proj, const vec4_t* v) {
 	// Multiply the projection matrix by our original vector
-	vec4_t result = mat4_mul_vec4(mat_proj, v);
+	mat4_mul_vec4_ptr(result, mat_proj, v);
 
 	// Perform perspective divide with original z-value that is stored in w
-	if (result.w != 0.0) {
-		result.x /= result.w;
-		result.y /= result.w;
-		result.z /= result.w;
+	if (result->w != 0.0) {
+		result->x /= result->w;
+		result->y /= result->w;
+		result->z /= result->w;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform an array of vectors by the same matrix (in and out may be equal)
+///////////////////////////////////////////////////////////////////////////////
+void mat4_mul_vec4_array(const mat4_t* m, const vec4_t* in, vec4_t* out, int count) {
+#if defined(__SSE2__)
+	// The matrix is transposed once for the whole array
+	__m128 c0, c1, c2, c3;
+	mat4_load_columns(m, &c0, &c1, &c2, &c3);
+	for (int i = 0; i < count; i++) {
+		_mm_storeu_ps(&out[i].x, mat4_mul_columns(c0, c1, c2, c3, _mm_loadu_ps(&in[i].x)));
+	}
+#else
+	for (int i = 0; i < count; i++) {
+		mat4_mul_vec4_ptr(&out[i], m, &in[i]);
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform points (w = 1) stored as separate x, y and z arrays
+///////////////////////////////////////////////////////////////////////////////
+// Every lane of a register holds a different point, so there is no shuffling
+// at all: each output component is 3 multiplies and 3 adds of whole registers
+// against broadcast matrix elements. AVX builds do 8 points per step, SSE
+// builds 4, and the remainder goes through the scalar loop.
+// out_w can be NULL when the matrix is affine and w is known to stay 1, the
+// outputs may overwrite the inputs.
+///////////////////////////////////////////////////////////////////////////////
+void mat4_transform_points_soa(
+	const mat4_t* m,
+	const float* x, const float* y, const float* z,
+	float* out_x, float* out_y, float* out_z, float* out_w,
+	int count
+) {
+	int num_rows = out_w ? 4 : 3;
+	float* out[4] = { out_x, out_y, out_z, out_w };
+	int i = 0;
+
+#if defined(__AVX__)
+	for (; i + 8 <= count; i += 8) {
+		__m256 px = _mm256_loadu_ps(&x[i]);
+		__m256 py = _mm256_loadu_ps(&y[i]);
+		__m256 pz = _mm256_loadu_ps(&z[i]);
+		for (int r = 0; r < num_rows; r++) {
+			__m256 result = _mm256_mul_ps(_mm256_set1_ps(m->m[r][0]), px);
+			result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[r][1]), py));
+			result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[r][2]), pz));
+			result = _mm256_add_ps(result, _mm256_set1_ps(m->m[r][3]));
+			_mm256_storeu_ps(&out[r][i], result);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 4 <= count; i += 4) {
+		__m128 px = _mm_loadu_ps(&x[i]);
+		__m128 py = _mm_loadu_ps(&y[i]);
+		__m128 pz = _mm_loadu_ps(&z[i]);
+		for (int r = 0; r < num_rows; r++) {
+			__m128 result = _mm_mul_ps(_mm_set1_ps(m->m[r][0]), px);
+			result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[r][1]), py));
+			result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[r][2]), pz));
+			result = _mm_add_ps(result, _mm_set1_ps(m->m[r][3]));
+			_mm_storeu_ps(&out[r][i], result);
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		float px = x[i];
+		float py = y[i];
+		float pz = z[i];
+		for (int r = 0; r < num_rows; r++) {
+			out[r][i] = m->m[r][0] * px + m->m[r][1] * py + m->m[r][2] * pz + m->m[r][3];
+		}
 	}
-	return result;
 }
\ No newline at end of file
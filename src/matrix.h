@@ -19,4 +19,22 @@ mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
 
+///////////////////////////////////////////////////////////////////////////////
+// Pointer variants for the hot paths (no 64 byte matrix copies per call)
+///////////////////////////////////////////////////////////////////////////////
+void mat4_mul_vec4_ptr(vec4_t* result, const mat4_t* m, const vec4_t* v);
+void mat4_mul_mat4_ptr(mat4_t* result, const mat4_t* a, const mat4_t* b);
+void mat4_mul_vec4_project_ptr(vec4_t* result, const mat4_t* mat_proj, const vec4_t* v);
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch transforms of many vectors by one matrix
+///////////////////////////////////////////////////////////////////////////////
+void mat4_mul_vec4_array(const mat4_t* m, const vec4_t* in, vec4_t* out, int count);
+void mat4_transform_points_soa(
+	const mat4_t* m,
+	const float* x, const float* y, const float* z,
+	float* out_x, float* out_y, float* out_z, float* out_w,
+	int count
+);
+
 #endif
\ No newline at end of file
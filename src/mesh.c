@@ -3,53 +3,205 @@
 #include <string.h>
 #include "array.h"
 #include "mesh.h"
+#include "vertex_cache.h"
+#include "loader.h"
+#include "texture_cache.h"
+#include "atlas.h"
 
-#define MAX_NUM_MESHES 10
 static mesh_t meshes[MAX_NUM_MESHES];
 static int mesh_count = 0;
 
+static bool optimize_meshes = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// Low-LOD proxy (a 2x2x2 cube) shown while the real mesh is loading
+///////////////////////////////////////////////////////////////////////////////
+#define MESH_PLACEHOLDER_COLOR 0xFF808080
+#define N_PLACEHOLDER_VERTICES 8
+#define N_PLACEHOLDER_FACES (6 * 2)
+
+static const vec3_t placeholder_vertices[N_PLACEHOLDER_VERTICES] = {
+	{ .x = -1, .y = -1, .z = +1 },
+	{ .x = +1, .y = -1, .z = +1 },
+	{ .x = -1, .y = +1, .z = +1 },
+	{ .x = +1, .y = +1, .z = +1 },
+	{ .x = -1, .y = +1, .z = -1 },
+	{ .x = +1, .y = +1, .z = -1 },
+	{ .x = -1, .y = -1, .z = -1 },
+	{ .x = +1, .y = -1, .z = -1 }
+};
+
+static const int placeholder_faces[N_PLACEHOLDER_FACES][3] = {
+	{ 0, 1, 2 }, { 2, 1, 3 }, // front
+	{ 2, 3, 4 }, { 4, 3, 5 }, // top
+	{ 4, 5, 6 }, { 6, 5, 7 }, // back
+	{ 6, 7, 0 }, { 0, 7, 1 }, // bottom
+	{ 1, 7, 3 }, { 3, 7, 5 }, // right
+	{ 6, 0, 4 }, { 4, 0, 2 }  // left
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Build the vertex buffer and the index buffer from the face corners
+///////////////////////////////////////////////////////////////////////////////
+// OBJ faces index positions, texture coordinates and normals separately.
+// Every unique (position, texcoord, normal) triple becomes one vertex,
+// numbered in the order it is first used, so the vertices of consecutive
+// faces stay close in memory. Without normal indices (normals is NULL) the
+// smooth vertex normals are computed from the faces instead.
+///////////////////////////////////////////////////////////////////////////////
+static void build_mesh_vertices(mesh_t* mesh, vec3_t* positions, tex2_t* texcoords, vec3_t* normals, int* position_indices, int* texcoord_indices, int* normal_indices, int num_corners) {
+	int table_size = 16;
+	while (table_size < num_corners * 2) {
+		table_size *= 2;
+	}
+	int* table = (int*)malloc(sizeof(int) * table_size);
+	int* unique_positions = (int*)malloc(sizeof(int) * (num_corners + 1));
+	int* unique_texcoords = (int*)malloc(sizeof(int) * (num_corners + 1));
+	int* unique_normals = (int*)malloc(sizeof(int) * (num_corners + 1));
+	int num_unique = 0;
+	for (int i = 0; i < table_size; i++) {
+		table[i] = -1;
+	}
+
+	for (int i = 0; i < num_corners; i++) {
+		int p = position_indices[i];
+		int t = texcoord_indices[i];
+		int n = normals ? normal_indices[i] : -1;
+		unsigned slot = ((unsigned)p * 73856093u ^ (unsigned)t * 19349663u ^ (unsigned)n * 83492791u) & (table_size - 1);
+		while (table[slot] >= 0 && (unique_positions[table[slot]] != p || unique_texcoords[table[slot]] != t || unique_normals[table[slot]] != n)) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (table[slot] < 0) {
+			table[slot] = num_unique;
+			unique_positions[num_unique] = p;
+			unique_texcoords[num_unique] = t;
+			unique_normals[num_unique] = n;
+			num_unique++;
+		}
+		array_push(mesh->indices, table[slot]);
+	}
+
+	init_vertex_buffer(&mesh->vertices, num_unique);
+	for (int i = 0; i < num_unique; i++) {
+		vec3_t position = positions[unique_positions[i]];
+		mesh->vertices.x[i] = position.x;
+		mesh->vertices.y[i] = position.y;
+		mesh->vertices.z[i] = position.z;
+		if (unique_texcoords[i] >= 0) {
+			mesh->vertices.u[i] = texcoords[unique_texcoords[i]].u;
+			mesh->vertices.v[i] = texcoords[unique_texcoords[i]].v;
+		}
+		if (normals) {
+			vec3_t normal = normals[unique_normals[i]];
+			vec3_normalize(&normal);
+			mesh->vertices.nx[i] = normal.x;
+			mesh->vertices.ny[i] = normal.y;
+			mesh->vertices.nz[i] = normal.z;
+		}
+	}
+	if (!normals) {
+		compute_vertex_normals(&mesh->vertices, mesh->indices, array_length(mesh->indices));
+	}
+
+	free(table);
+	free(unique_positions);
+	free(unique_texcoords);
+	free(unique_normals);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Read the indices of one face corner in any of the OBJ forms v, v/t, v//n
+// and v/t/n (indices that are not given are 0)
+///////////////////////////////////////////////////////////////////////////////
+static void read_face_corner(char* corner, int* position_index, int* texcoord_index, int* normal_index) {
+	*position_index = 0;
+	*texcoord_index = 0;
+	*normal_index = 0;
+	if (sscanf(corner, "%d/%d/%d", position_index, texcoord_index, normal_index) == 3) {
+		return;
+	}
+	if (sscanf(corner, "%d//%d", position_index, normal_index) == 2) {
+		return;
+	}
+	*normal_index = 0;
+	sscanf(corner, "%d/%d", position_index, texcoord_index);
+}
+
 void load_mesh_obj_data(mesh_t* mesh, char* obj_filename){
 	FILE* file = fopen(obj_filename, "r");
 	char line[1024];
 	if (file == NULL) {
 		printf("Not able to open .obj file.");
 	} else {
+		vec3_t* positions = NULL;
 		tex2_t* texcoords = NULL;
+		vec3_t* normals = NULL;
+		int* position_indices = NULL;
+		int* texcoord_indices = NULL;
+		int* normal_indices = NULL;
+		bool has_normal_indices = true;
+		int num_skipped_faces = 0;
 		while (fgets(line, 1024, file)) {
 			// Read vertex data
 			if (line[0] == 'v' && line[1] == ' ') {
 				vec3_t vertex;
 				sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-				array_push(mesh->vertices, vertex);
+				array_push(positions, vertex);
 			// Read vertex texture UV
 			} else if (line[0] == 'v' && line[1] == 't') {
 				tex2_t texcoord;
 				sscanf(line, "vt %f %f", &texcoord.u, &texcoord.v);
 				array_push(texcoords, texcoord);
+			// Read vertex normal
+			} else if (line[0] == 'v' && line[1] == 'n') {
+				vec3_t normal;
+				sscanf(line, "vn %f %f %f", &normal.x, &normal.y, &normal.z);
+				array_push(normals, normal);
 			// Read face data
 			} else if (line[0] == 'f' && line[1] == ' ') {
+				char corners[3][64];
 				int vertex_indices[3];
 				int texture_indices[3];
-				int normal_indices[3];
-				sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d", 
-					&vertex_indices[0], &texture_indices[0], &normal_indices[0],
-					&vertex_indices[1], &texture_indices[1], &normal_indices[1],
-					&vertex_indices[2], &texture_indices[2], &normal_indices[2]
-				);
-				face_t face = {
-					.a = vertex_indices[0] - 1,
-					.b = vertex_indices[1] - 1,
-					.c = vertex_indices[2] - 1,
-					.a_uv = texcoords[texture_indices[0] - 1],
-					.b_uv = texcoords[texture_indices[1] - 1],
-					.c_uv = texcoords[texture_indices[2] - 1]
-				};
-				array_push(mesh->faces, face);
+				int face_normal_indices[3];
+				bool is_valid = sscanf(line, "f %63s %63s %63s", corners[0], corners[1], corners[2]) == 3;
+				for (int j = 0; j < 3 && is_valid; j++) {
+					read_face_corner(corners[j], &vertex_indices[j], &texture_indices[j], &face_normal_indices[j]);
+					is_valid = vertex_indices[j] >= 1 && vertex_indices[j] <= array_length(positions);
+				}
+				if (!is_valid) {
+					num_skipped_faces++;
+					continue;
+				}
+				for (int j = 0; j < 3; j++) {
+					// Missing or invalid texture coordinates leave the corner without UV (-1)
+					int texture_index = texture_indices[j] >= 1 && texture_indices[j] <= array_length(texcoords) ? texture_indices[j] - 1 : -1;
+					array_push(position_indices, vertex_indices[j] - 1);
+					array_push(texcoord_indices, texture_index);
+					array_push(normal_indices, face_normal_indices[j] - 1);
+					if (face_normal_indices[j] < 1 || face_normal_indices[j] > array_length(normals)) {
+						has_normal_indices = false;
+					}
+				}
 			}
 		}
+		if (num_skipped_faces > 0) {
+			fprintf(stderr, "Skipped %d faces with invalid vertex indices in %s.\n", num_skipped_faces, obj_filename);
+		}
+
+		// Use the normals of the file only if every face corner has a valid one
+		build_mesh_vertices(mesh, positions, texcoords, has_normal_indices ? normals : NULL, position_indices, texcoord_indices, normal_indices, array_length(position_indices));
+		array_free(positions);
 		array_free(texcoords);
+		array_free(normals);
+		array_free(position_indices);
+		array_free(texcoord_indices);
+		array_free(normal_indices);
+		fclose(file);
 	}
-	fclose(file);
+}
+
+int get_mesh_num_faces(mesh_t* mesh) {
+	return array_length(mesh->indices) / 3;
 }
 
 void load_mesh_png_data(mesh_t* mesh, char* png_filename) {
@@ -57,20 +209,112 @@ void load_mesh_png_data(mesh_t* mesh, char* png_filename) {
     if (png_image != NULL) {
         upng_decode(png_image);
         if (upng_get_error(png_image) == UPNG_EOK) {
-            mesh->texture = png_image;
+            // Copy the decoded image into a texture with a full mip chain
+            mesh->texture = texture_from_png(png_image);
+
+            // Keep a compressed copy of the levels so they can be evicted and reloaded
+            write_texture_cache(mesh->texture);
         }
+        upng_free(png_image);
     }
 }
 
+void set_mesh_optimization(bool enabled) {
+	optimize_meshes = enabled;
+}
+
+void optimize_mesh(mesh_t* mesh) {
+	optimize_mesh_face_order(mesh);
+	optimize_mesh_vertex_order(mesh);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Load the faces and vertices of a mesh and prepare them for rendering
+///////////////////////////////////////////////////////////////////////////////
+// Only touches the given mesh, so the load jobs can call it on their
+// own mesh_t and hand the result over to the scene when it is done.
+///////////////////////////////////////////////////////////////////////////////
+void load_mesh_geometry(mesh_t* mesh, char* obj_filename) {
+	load_mesh_obj_data(mesh, obj_filename);
+	if (optimize_meshes) {
+		optimize_mesh(mesh);
+	}
+	mesh->meshlets = build_meshlets(mesh->indices, &mesh->vertices);
+}
+
+void load_mesh_placeholder(mesh_t* mesh) {
+	tex2_t uvs[3] = { { 0, 0 }, { 1, 0 }, { 0, 1 } };
+	int position_indices[N_PLACEHOLDER_FACES * 3];
+	int texcoord_indices[N_PLACEHOLDER_FACES * 3];
+	for (int i = 0; i < N_PLACEHOLDER_FACES * 3; i++) {
+		position_indices[i] = placeholder_faces[i / 3][i % 3];
+		texcoord_indices[i] = i % 3;
+	}
+	build_mesh_vertices(mesh, (vec3_t*)placeholder_vertices, uvs, NULL, position_indices, texcoord_indices, NULL, N_PLACEHOLDER_FACES * 3);
+	mesh->meshlets = build_meshlets(mesh->indices, &mesh->vertices);
+	mesh->texture = create_flat_texture(MESH_PLACEHOLDER_COLOR);
+}
+
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation) {
-	load_mesh_obj_data(&meshes[mesh_count], obj_filename);
+	if (mesh_count == MAX_NUM_MESHES) {
+		fprintf(stderr, "Too many meshes (max %d), %s was not loaded.\n", MAX_NUM_MESHES, obj_filename);
+		return;
+	}
+	load_mesh_geometry(&meshes[mesh_count], obj_filename);
 	load_mesh_png_data(&meshes[mesh_count], png_filename);
+	register_texture(meshes[mesh_count].texture);
+	meshes[mesh_count].scale = scale;
+	meshes[mesh_count].translation = translation;
+	meshes[mesh_count].rotation = rotation;
+	mesh_count++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Add a mesh to the scene right away and load its files in the background
+///////////////////////////////////////////////////////////////////////////////
+// The mesh is drawn as a flat colored proxy until apply_loaded_assets() swaps
+// in the loaded geometry and texture at the start of a frame.
+///////////////////////////////////////////////////////////////////////////////
+void load_mesh_async(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation) {
+	if (mesh_count == MAX_NUM_MESHES) {
+		fprintf(stderr, "Too many meshes (max %d), %s was not loaded.\n", MAX_NUM_MESHES, obj_filename);
+		return;
+	}
+	load_mesh_placeholder(&meshes[mesh_count]);
 	meshes[mesh_count].scale = scale;
 	meshes[mesh_count].translation = translation;
 	meshes[mesh_count].rotation = rotation;
+	request_mesh_obj_load(mesh_count, obj_filename);
+	request_mesh_png_load(mesh_count, png_filename);
 	mesh_count++;
 }
 
+void replace_mesh_geometry(int mesh_index, mesh_t* loaded_mesh) {
+	mesh_t* mesh = &meshes[mesh_index];
+	free_mesh_geometry(mesh);
+	mesh->vertices = loaded_mesh->vertices;
+	mesh->indices = loaded_mesh->indices;
+	mesh->meshlets = loaded_mesh->meshlets;
+}
+
+void replace_mesh_texture(int mesh_index, texture_t* texture) {
+	unregister_texture(meshes[mesh_index].texture);
+	free_texture(meshes[mesh_index].texture);
+	meshes[mesh_index].texture = texture;
+	register_texture(texture);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pack the small textures of all meshes into shared atlas pages
+///////////////////////////////////////////////////////////////////////////////
+void pack_mesh_textures(void) {
+	texture_t* textures[MAX_NUM_MESHES];
+	for (int i = 0; i < mesh_count; i++) {
+		textures[i] = meshes[i].texture;
+	}
+	pack_texture_atlas(textures, mesh_count);
+}
+
 mesh_t* get_mesh(int mesh_index) {
 	return &meshes[mesh_index];
 }
@@ -79,6 +323,10 @@ int get_num_meshes(void) {
 	return mesh_count;
 }
 
+void set_mesh_texture_filter(int mesh_index, int filter) {
+	meshes[mesh_index].texture_filter = filter;
+}
+
 void rotate_mesh_x(int mesh_index, float angle) {
     meshes[mesh_index].rotation.x += angle;
 }
@@ -91,10 +339,18 @@ void rotate_mesh_z(int mesh_index, float angle) {
     meshes[mesh_index].rotation.z += angle;
 }
 
+void free_mesh_geometry(mesh_t* mesh) {
+	array_free(mesh->meshlets);
+	array_free(mesh->indices);
+	free_vertex_buffer(&mesh->vertices);
+	mesh->meshlets = NULL;
+	mesh->indices = NULL;
+}
+
 void free_meshes(void) {
 	for (int i = 0; i < mesh_count; i++) {
-		upng_free(meshes[i].texture);
-		array_free(meshes[i].faces);
-		array_free(meshes[i].vertices);
+		unregister_texture(meshes[i].texture);
+		free_texture(meshes[i].texture);
+		free_mesh_geometry(&meshes[i]);
 	}
 }
\ No newline at end of file
@@ -1,23 +1,44 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
 #include "vector.h"
 #include "triangle.h"
-#include "upng.h"
+#include "texture.h"
+#include "meshlet.h"
+#include "vertex_buffer.h"
+
+#define MAX_NUM_MESHES 10
 
 typedef struct {
-	vec3_t* vertices;   // Mesh dynamic array of verts
-	face_t* faces;      // Mesh dynamic array of faces
-	upng_t* texture;	// Mesh PNG texture pointer
-	vec3_t scale;       // Mesh scale with x, y and z values
-	vec3_t rotation;    // Mesh rotation with x, y and z values
-	vec3_t translation; // Mesh translation with x, y and z values
+	vertex_buffer_t vertices; // Mesh vertex attributes, one array per attribute
+	int* indices;             // Mesh dynamic array of vertex indices, three per face
+	meshlet_t* meshlets;      // Mesh dynamic array of face clusters
+	texture_t* texture;       // Mesh texture with mip chain
+	int texture_filter;       // Texture filter mode (nearest, bilinear or trilinear)
+	vec3_t scale;             // Mesh scale with x, y and z values
+	vec3_t rotation;          // Mesh rotation with x, y and z values
+	vec3_t translation;       // Mesh translation with x, y and z values
 } mesh_t;
 
 void load_mesh_obj_data(mesh_t* mesh, char* obj_filename);
+int get_mesh_num_faces(mesh_t* mesh);
 void load_mesh_png_data(mesh_t* mesh, char* png_filename);
 
+void set_mesh_optimization(bool enabled);
+void optimize_mesh(mesh_t* mesh);
+
+void load_mesh_geometry(mesh_t* mesh, char* obj_filename);
+void load_mesh_placeholder(mesh_t* mesh);
+
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
+void load_mesh_async(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
+void replace_mesh_geometry(int mesh_index, mesh_t* loaded_mesh);
+void replace_mesh_texture(int mesh_index, texture_t* texture);
+void free_mesh_geometry(mesh_t* mesh);
+void pack_mesh_textures(void);
+
+void set_mesh_texture_filter(int mesh_index, int filter);
 
 mesh_t* get_mesh(int mesh_index);
 int get_num_meshes(void);
@@ -0,0 +1,220 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+#include "meshlet.h"
+
+static vec3_t get_vertex_position(vertex_buffer_t* vertices, int index) {
+	return vec3_new(vertices->x[index], vertices->y[index], vertices->z[index]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compute the bounding sphere and the normal cone of a range of faces
+///////////////////////////////////////////////////////////////////////////////
+static void compute_meshlet_bounds(meshlet_t* meshlet, int* indices, vertex_buffer_t* vertices) {
+	int* first = &indices[meshlet->first_face * 3];
+	int num_indices = meshlet->num_faces * 3;
+
+	// The bounding sphere is centered in the middle of the bounding box
+	vec3_t box_min = get_vertex_position(vertices, first[0]);
+	vec3_t box_max = box_min;
+	for (int i = 0; i < num_indices; i++) {
+		vec3_t v = get_vertex_position(vertices, first[i]);
+		box_min.x = fminf(box_min.x, v.x);
+		box_min.y = fminf(box_min.y, v.y);
+		box_min.z = fminf(box_min.z, v.z);
+		box_max.x = fmaxf(box_max.x, v.x);
+		box_max.y = fmaxf(box_max.y, v.y);
+		box_max.z = fmaxf(box_max.z, v.z);
+	}
+	meshlet->center = vec3_mul(vec3_add(box_min, box_max), 0.5);
+
+	float radius_squared = 0;
+	vec3_t normal_sum = { 0, 0, 0 };
+	for (int i = 0; i < meshlet->num_faces; i++) {
+		vec3_t corners[3];
+		for (int j = 0; j < 3; j++) {
+			corners[j] = get_vertex_position(vertices, first[i * 3 + j]);
+			vec3_t offset = vec3_sub(corners[j], meshlet->center);
+			radius_squared = fmaxf(radius_squared, vec3_dot(offset, offset));
+		}
+
+		// Same winding as get_triangle_normal() so the cone matches the backface test
+		vec3_t normal = vec3_cross(
+			vec3_sub(corners[1], corners[0]),
+			vec3_sub(corners[2], corners[0])
+		);
+		if (vec3_length(normal) > 0) {
+			vec3_normalize(&normal);
+			normal_sum = vec3_add(normal_sum, normal);
+		}
+	}
+	meshlet->radius = sqrt(radius_squared);
+
+	// Faces pointing in opposite directions cancel out; such meshlets are never cone culled
+	meshlet->cone_axis = vec3_new(0, 0, 1);
+	meshlet->cone_cos = -1;
+	if (vec3_length(normal_sum) < 1e-6) {
+		return;
+	}
+	meshlet->cone_axis = normal_sum;
+	vec3_normalize(&meshlet->cone_axis);
+
+	float min_cos = 1;
+	for (int i = 0; i < meshlet->num_faces; i++) {
+		vec3_t a = get_vertex_position(vertices, first[i * 3 + 0]);
+		vec3_t b = get_vertex_position(vertices, first[i * 3 + 1]);
+		vec3_t c = get_vertex_position(vertices, first[i * 3 + 2]);
+		vec3_t normal = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+		if (vec3_length(normal) > 0) {
+			vec3_normalize(&normal);
+			min_cos = fminf(min_cos, vec3_dot(normal, meshlet->cone_axis));
+		}
+	}
+	meshlet->cone_cos = min_cos;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Split the faces into meshlets of consecutive faces
+///////////////////////////////////////////////////////////////////////////////
+// Faces are taken in their current order, so meshes that went through the
+// vertex cache optimization give compact meshlets. A new meshlet is started
+// whenever the triangle or the unique vertex budget would be exceeded.
+//
+// The vertices are then renumbered so every meshlet owns one contiguous range
+// of at most MESHLET_MAX_VERTICES vertices. Vertices shared with an earlier
+// meshlet are duplicated, otherwise the range of a meshlet could span all the
+// vertices between its lowest and highest index.
+///////////////////////////////////////////////////////////////////////////////
+meshlet_t* build_meshlets(int* indices, vertex_buffer_t* vertices) {
+	meshlet_t* meshlets = NULL;
+	int num_faces = array_length(indices) / 3;
+	int num_source_vertices = vertices->num_vertices;
+
+	// Meshlet that last used every source vertex and its new index in that meshlet
+	int* vertex_meshlet = (int*)malloc(sizeof(int) * (num_source_vertices > 0 ? num_source_vertices : 1));
+	int* vertex_slot = (int*)malloc(sizeof(int) * (num_source_vertices > 0 ? num_source_vertices : 1));
+	for (int i = 0; i < num_source_vertices; i++) {
+		vertex_meshlet[i] = -1;
+	}
+
+	// Source vertex of every new vertex
+	int* source_vertices = NULL;
+	int num_new_total = 0;
+
+	int meshlet_index = 0;
+	meshlet_t meshlet = { .first_face = 0, .num_faces = 0, .first_vertex = 0, .num_vertices = 0 };
+
+	for (int i = 0; i < num_faces; i++) {
+		int* face_indices = &indices[i * 3];
+
+		// Count how many new vertices this face would add to the current meshlet
+		int num_new_vertices = 0;
+		for (int j = 0; j < 3; j++) {
+			bool found = vertex_meshlet[face_indices[j]] == meshlet_index;
+			for (int k = 0; k < j && !found; k++) {
+				found = face_indices[k] == face_indices[j];
+			}
+			if (!found) {
+				num_new_vertices++;
+			}
+		}
+
+		// Close the current meshlet when it is full
+		if (meshlet.num_faces == MESHLET_MAX_TRIANGLES || meshlet.num_vertices + num_new_vertices > MESHLET_MAX_VERTICES) {
+			array_push(meshlets, meshlet);
+			meshlet_index++;
+			meshlet.first_face = i;
+			meshlet.num_faces = 0;
+			meshlet.first_vertex = num_new_total;
+			meshlet.num_vertices = 0;
+		}
+
+		// Give the vertices new to the meshlet the next indices and renumber the face
+		for (int j = 0; j < 3; j++) {
+			int source = face_indices[j];
+			if (vertex_meshlet[source] != meshlet_index) {
+				vertex_meshlet[source] = meshlet_index;
+				vertex_slot[source] = num_new_total++;
+				array_push(source_vertices, source);
+				meshlet.num_vertices++;
+			}
+			face_indices[j] = vertex_slot[source];
+		}
+		meshlet.num_faces++;
+	}
+
+	if (meshlet.num_faces > 0) {
+		array_push(meshlets, meshlet);
+	}
+	free(vertex_meshlet);
+	free(vertex_slot);
+
+	// Copy the vertices to their new positions
+	vertex_buffer_t renumbered;
+	init_vertex_buffer(&renumbered, num_new_total);
+	for (int i = 0; i < num_new_total; i++) {
+		int source = source_vertices[i];
+		renumbered.x[i] = vertices->x[source];
+		renumbered.y[i] = vertices->y[source];
+		renumbered.z[i] = vertices->z[source];
+		renumbered.u[i] = vertices->u[source];
+		renumbered.v[i] = vertices->v[source];
+		renumbered.nx[i] = vertices->nx[source];
+		renumbered.ny[i] = vertices->ny[source];
+		renumbered.nz[i] = vertices->nz[source];
+	}
+	array_free(source_vertices);
+	free_vertex_buffer(vertices);
+	*vertices = renumbered;
+
+	for (int i = 0; i < array_length(meshlets); i++) {
+		compute_meshlet_bounds(&meshlets[i], indices, vertices);
+	}
+
+	return meshlets;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check if every face of a meshlet is facing away from the camera
+///////////////////////////////////////////////////////////////////////////////
+// The camera sits at the origin of camera space. Seen from the camera, the
+// bounding sphere covers directions within angle beta of the direction to its
+// center, and the face normals lie within angle alpha of the cone axis. If the
+// axis is within (90deg - alpha - beta) of the view direction, all faces are
+// guaranteed to look away from the camera:
+//
+//   cos(theta) > sin(alpha + beta)   with   sin(beta) = radius / distance
+//
+// The axis is transformed with the world view matrix, which is only valid for
+// rigid transformations with uniform scale.
+///////////////////////////////////////////////////////////////////////////////
+bool is_meshlet_backfacing(meshlet_t* meshlet, mat4_t* world_view_matrix, vec3_t view_center, float view_radius) {
+	if (meshlet->cone_cos <= 0) {
+		return false;
+	}
+
+	float distance = vec3_length(view_center);
+	if (distance <= view_radius) {
+		return false;
+	}
+
+	// Rotate the cone axis into camera space (w = 0 ignores the translation)
+	vec4_t axis4 = { meshlet->cone_axis.x, meshlet->cone_axis.y, meshlet->cone_axis.z, 0 };
+	mat4_mul_vec4_ptr(&axis4, world_view_matrix, &axis4);
+	vec3_t axis = vec3_from_vec4(axis4);
+	vec3_normalize(&axis);
+
+	float cos_alpha = meshlet->cone_cos;
+	float sin_alpha = sqrt(1 - cos_alpha * cos_alpha);
+	float sin_beta = view_radius / distance;
+	float cos_beta = sqrt(1 - sin_beta * sin_beta);
+
+	// alpha + beta must stay below 90 degrees for the test to make sense
+	if (cos_alpha * cos_beta - sin_alpha * sin_beta <= 0) {
+		return false;
+	}
+
+	float cos_theta = vec3_dot(axis, view_center) / distance;
+	return cos_theta > sin_alpha * cos_beta + cos_alpha * sin_beta;
+}
@@ -0,0 +1,30 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+#include "triangle.h"
+#include "vertex_buffer.h"
+
+#define MESHLET_MAX_TRIANGLES 128
+#define MESHLET_MAX_VERTICES 96
+
+///////////////////////////////////////////////////////////////////////////////
+// Cluster of neighbouring faces that is culled as a whole before its faces
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	int first_face;   // Index of the first face of the meshlet in the mesh faces
+	int num_faces;    // Number of consecutive faces in the meshlet
+	int first_vertex; // First vertex of the contiguous vertex range owned by the meshlet
+	int num_vertices; // Number of vertices in the range (at most MESHLET_MAX_VERTICES)
+	vec3_t center;    // Bounding sphere center in model space
+	float radius;     // Bounding sphere radius in model space
+	vec3_t cone_axis; // Average face normal in model space
+	float cone_cos;   // Cosine of the normal cone half angle (<= 0 disables cone culling)
+} meshlet_t;
+
+meshlet_t* build_meshlets(int* indices, vertex_buffer_t* vertices);
+bool is_meshlet_backfacing(meshlet_t* meshlet, mat4_t* world_view_matrix, vec3_t view_center, float view_radius);
+
+#endif
@@ -0,0 +1,135 @@
+#include "pacing.h"
+
+static int pacing_mode = PACING_FIXED;
+static Uint64 frame_period = 0;       // Target frame time in performance counter ticks
+static Uint64 frame_start = 0;        // Performance counter at the start of the current frame
+
+// Time spent in every stage, summed over the current frame and kept for the last frame
+static Uint64 stage_start[NUM_FRAME_STAGES];
+static Uint64 stage_time[NUM_FRAME_STAGES];
+static float last_stage_time[NUM_FRAME_STAGES];
+
+// Adaptive mode: smoothed work time of a frame and the resulting render quality
+static float average_work_time = 0;
+static float frame_quality = 1.0;
+static int frames_since_adjust = 0;
+
+void init_frame_pacing(int mode, int target_fps) {
+	pacing_mode = mode;
+	frame_period = SDL_GetPerformanceFrequency() / target_fps;
+	frame_start = SDL_GetPerformanceCounter();
+}
+
+void set_pacing_mode(int mode) {
+	pacing_mode = mode;
+	frame_quality = 1.0;
+	frames_since_adjust = 0;
+}
+
+int get_pacing_mode(void) {
+	return pacing_mode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait until the performance counter reaches the deadline
+///////////////////////////////////////////////////////////////////////////////
+// SDL_Delay() only has millisecond precision and can oversleep, so it is
+// used while the deadline is far away and the last few milliseconds are spent
+// polling the high resolution counter.
+///////////////////////////////////////////////////////////////////////////////
+static void wait_until(Uint64 deadline) {
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 spin_ticks = frequency * PACING_SPIN_TIME / 1000;
+	Uint64 now = SDL_GetPerformanceCounter();
+	while (now + spin_ticks < deadline) {
+		Uint32 sleep_time = (Uint32)((deadline - now - spin_ticks) * 1000 / frequency);
+		if (sleep_time == 0) {
+			break;
+		}
+		SDL_Delay(sleep_time);
+		now = SDL_GetPerformanceCounter();
+	}
+	while (now < deadline) {
+		now = SDL_GetPerformanceCounter();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move the render quality towards the frame budget (adaptive mode)
+///////////////////////////////////////////////////////////////////////////////
+// The work time of a frame is the sum of its stage times, the time spent
+// waiting for the deadline is not included. Quality drops faster than it
+// rises and is only changed every few frames, so the smoothed time can catch
+// up with the last change before the next one.
+///////////////////////////////////////////////////////////////////////////////
+static void adjust_frame_quality(float work_time) {
+	average_work_time += (work_time - average_work_time) * 0.2;
+	if (++frames_since_adjust < ADAPTIVE_ADJUST_FRAMES) {
+		return;
+	}
+
+	float budget = frame_period * 1000.0 / SDL_GetPerformanceFrequency();
+	if (average_work_time > budget * ADAPTIVE_BUDGET_HIGH && frame_quality > ADAPTIVE_QUALITY_MIN) {
+		frame_quality -= ADAPTIVE_QUALITY_DOWN_STEP;
+		if (frame_quality < ADAPTIVE_QUALITY_MIN) {
+			frame_quality = ADAPTIVE_QUALITY_MIN;
+		}
+		frames_since_adjust = 0;
+	} else if (average_work_time < budget * ADAPTIVE_BUDGET_LOW && frame_quality < 1.0) {
+		frame_quality += ADAPTIVE_QUALITY_UP_STEP;
+		if (frame_quality > 1.0) {
+			frame_quality = 1.0;
+		}
+		frames_since_adjust = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// End the current frame, wait as the pacing mode requires and start the next
+///////////////////////////////////////////////////////////////////////////////
+// Returns the time between the start of the last frame and the start of this
+// one in seconds. The deadline is counted from the actual start of the last
+// frame, so after a frame that ran late the next ones do not try to catch up.
+///////////////////////////////////////////////////////////////////////////////
+float wait_for_next_frame(void) {
+	float work_time = 0;
+	for (int i = 0; i < NUM_FRAME_STAGES; i++) {
+		last_stage_time[i] = stage_time[i] * 1000.0 / SDL_GetPerformanceFrequency();
+		work_time += last_stage_time[i];
+		stage_time[i] = 0;
+	}
+	if (pacing_mode == PACING_ADAPTIVE) {
+		adjust_frame_quality(work_time);
+	}
+
+	if (pacing_mode != PACING_UNCAPPED) {
+		wait_until(frame_start + frame_period);
+	}
+
+	Uint64 now = SDL_GetPerformanceCounter();
+	float delta_time = (float)(now - frame_start) / SDL_GetPerformanceFrequency();
+	frame_start = now;
+	return delta_time;
+}
+
+void begin_frame_stage(int stage) {
+	stage_start[stage] = SDL_GetPerformanceCounter();
+}
+
+void end_frame_stage(int stage) {
+	stage_time[stage] += SDL_GetPerformanceCounter() - stage_start[stage];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Time spent in a stage during the last frame in milliseconds
+///////////////////////////////////////////////////////////////////////////////
+float get_frame_stage_time(int stage) {
+	return last_stage_time[stage];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Render quality from ADAPTIVE_QUALITY_MIN to 1.0 (always 1.0 unless adaptive)
+///////////////////////////////////////////////////////////////////////////////
+float get_frame_quality(void) {
+	return frame_quality;
+}
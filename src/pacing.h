@@ -0,0 +1,44 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+#define DEFAULT_TARGET_FPS 60
+
+// Time before the frame deadline that is spin-waited instead of slept (milliseconds)
+#define PACING_SPIN_TIME 2
+
+// Adaptive mode: quality drops when the frame work goes above the high mark of
+// the frame budget and rises again below the low mark
+#define ADAPTIVE_BUDGET_HIGH 0.90
+#define ADAPTIVE_BUDGET_LOW 0.70
+#define ADAPTIVE_QUALITY_MIN 0.25
+#define ADAPTIVE_QUALITY_DOWN_STEP 0.10
+#define ADAPTIVE_QUALITY_UP_STEP 0.05
+#define ADAPTIVE_ADJUST_FRAMES 8
+
+enum pacing_mode {
+	PACING_UNCAPPED,  // Start the next frame right away
+	PACING_FIXED,     // Sleep and spin until the target frame time
+	PACING_ADAPTIVE   // Fixed rate, lowering the render quality when frames run long
+};
+
+enum frame_stage {
+	FRAME_STAGE_UPDATE,
+	FRAME_STAGE_GEOMETRY,
+	FRAME_STAGE_RASTER,
+	FRAME_STAGE_PRESENT,
+	NUM_FRAME_STAGES
+};
+
+void init_frame_pacing(int mode, int target_fps);
+void set_pacing_mode(int mode);
+int get_pacing_mode(void);
+float wait_for_next_frame(void);
+void begin_frame_stage(int stage);
+void end_frame_stage(int stage);
+float get_frame_stage_time(int stage);
+float get_frame_quality(void);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <math.h>
+#include "shadow.h"
+
+static bool is_shadow_mapping_enabled = true;
+static int shadow_filter = SHADOW_FILTER_PCF;
+
+void init_shadow_map(shadow_map_t* shadow_map) {
+	shadow_map->depth = (float*)malloc(sizeof(float) * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE);
+	shadow_map->matrix = mat4_identity();
+	clear_shadow_map(shadow_map, 0, SHADOW_MAP_SIZE - 1);
+}
+
+void free_shadow_map(shadow_map_t* shadow_map) {
+	free(shadow_map->depth);
+	shadow_map->depth = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Aim the shadow map along the light so it covers a camera space sphere
+///////////////////////////////////////////////////////////////////////////////
+// The light axes are built like mat4_look_at(): x = up cross forward and
+// y = forward cross x, so a face has the same winding seen from the light as
+// seen from the camera when it faces both of them.
+///////////////////////////////////////////////////////////////////////////////
+void fit_shadow_map(shadow_map_t* shadow_map, vec3_t light_direction, vec3_t center, float radius) {
+	vec3_t forward = light_direction;
+	vec3_normalize(&forward);
+	vec3_t up = fabsf(forward.y) > 0.99 ? vec3_new(0, 0, 1) : vec3_new(0, 1, 0);
+	vec3_t right = vec3_cross(up, forward);
+	vec3_normalize(&right);
+	up = vec3_cross(forward, right);
+
+	// Texels per unit across the map and depth per unit along the light
+	float texel_scale = SHADOW_MAP_SIZE / (2 * radius);
+	float depth_scale = 1.0 / (2 * radius);
+
+	mat4_t* m = &shadow_map->matrix;
+	*m = mat4_identity();
+	m->m[0][0] = right.x * texel_scale;
+	m->m[0][1] = right.y * texel_scale;
+	m->m[0][2] = right.z * texel_scale;
+	m->m[0][3] = SHADOW_MAP_SIZE / 2.0 - vec3_dot(right, center) * texel_scale;
+	m->m[1][0] = -up.x * texel_scale;
+	m->m[1][1] = -up.y * texel_scale;
+	m->m[1][2] = -up.z * texel_scale;
+	m->m[1][3] = SHADOW_MAP_SIZE / 2.0 + vec3_dot(up, center) * texel_scale;
+	m->m[2][0] = forward.x * depth_scale;
+	m->m[2][1] = forward.y * depth_scale;
+	m->m[2][2] = forward.z * depth_scale;
+	m->m[2][3] = 0.5 - vec3_dot(forward, center) * depth_scale;
+}
+
+void clear_shadow_map(shadow_map_t* shadow_map, int y_min, int y_max) {
+	for (int i = SHADOW_MAP_SIZE * y_min; i < SHADOW_MAP_SIZE * (y_max + 1); i++)
+		shadow_map->depth[i] = 1.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// 1.0 if a texel is lit at the given depth, 0.0 if something is closer to the
+// light (texels outside the map are lit)
+///////////////////////////////////////////////////////////////////////////////
+static float get_texel_visibility(shadow_map_t* shadow_map, int x, int y, float depth) {
+	if (x < 0 || x >= SHADOW_MAP_SIZE || y < 0 || y >= SHADOW_MAP_SIZE) {
+		return 1.0;
+	}
+	return depth <= shadow_map->depth[(SHADOW_MAP_SIZE * y) + x] + SHADOW_DEPTH_BIAS ? 1.0 : 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// How much of the directional light reaches a shadow map space position,
+// 0.0 (in shadow) - 1.0 (lit)
+///////////////////////////////////////////////////////////////////////////////
+// PCF compares the depth with the four texels around the position and blends
+// the results bilinearly, which softens the stair steps of the shadow edges.
+///////////////////////////////////////////////////////////////////////////////
+float get_shadow_visibility(shadow_map_t* shadow_map, float x, float y, float depth) {
+	if (shadow_filter == SHADOW_FILTER_HARD) {
+		return get_texel_visibility(shadow_map, (int)floorf(x), (int)floorf(y), depth);
+	}
+
+	// Move to texel centers and split into the top left texel and the blend factors
+	x -= 0.5;
+	y -= 0.5;
+	float x_floor = floorf(x);
+	float y_floor = floorf(y);
+	float fx = x - x_floor;
+	float fy = y - y_floor;
+	int x0 = (int)x_floor;
+	int y0 = (int)y_floor;
+
+	float top = get_texel_visibility(shadow_map, x0, y0, depth) * (1 - fx) + get_texel_visibility(shadow_map, x0 + 1, y0, depth) * fx;
+	float bottom = get_texel_visibility(shadow_map, x0, y0 + 1, depth) * (1 - fx) + get_texel_visibility(shadow_map, x0 + 1, y0 + 1, depth) * fx;
+	return top * (1 - fy) + bottom * fy;
+}
+
+void set_shadows_enabled(bool enabled) {
+	is_shadow_mapping_enabled = enabled;
+}
+
+bool are_shadows_enabled(void) {
+	return is_shadow_mapping_enabled;
+}
+
+void set_shadow_filter(int filter) {
+	shadow_filter = filter;
+}
+
+int get_shadow_filter(void) {
+	return shadow_filter;
+}
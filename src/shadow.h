@@ -0,0 +1,46 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+
+// Width and height of a shadow map in texels
+#define SHADOW_MAP_SIZE 512
+
+// Rows of the shadow map cleared and drawn by one job
+#define SHADOW_TILE_HEIGHT 32
+#define NUM_SHADOW_TILES (SHADOW_MAP_SIZE / SHADOW_TILE_HEIGHT)
+
+// Depth added to the shadow map depths before they are compared, so surfaces do not shadow themselves
+#define SHADOW_DEPTH_BIAS 0.002
+
+enum shadow_filter {
+	SHADOW_FILTER_HARD,  // One depth comparison per pixel
+	SHADOW_FILTER_PCF    // Percentage closer filtering: four comparisons blended by the position between the texels
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Shadow map of the directional light: the depth of the scene seen along the
+// light with an orthographic projection
+///////////////////////////////////////////////////////////////////////////////
+// Shadow map space has the texel position in x and y (y grows down like the
+// screen) and the depth along the light in z, 0.0 - 1.0 over the fitted bounds.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	float* depth;   // Depth of the surface nearest to the light at every texel
+	mat4_t matrix;  // Camera space to shadow map space
+} shadow_map_t;
+
+void init_shadow_map(shadow_map_t* shadow_map);
+void free_shadow_map(shadow_map_t* shadow_map);
+void fit_shadow_map(shadow_map_t* shadow_map, vec3_t light_direction, vec3_t center, float radius);
+void clear_shadow_map(shadow_map_t* shadow_map, int y_min, int y_max);
+float get_shadow_visibility(shadow_map_t* shadow_map, float x, float y, float depth);
+
+void set_shadows_enabled(bool enabled);
+bool are_shadows_enabled(void);
+void set_shadow_filter(int filter);
+int get_shadow_filter(void);
+
+#endif
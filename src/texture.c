@@ -1,6 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "display.h"
 #include "texture.h"
+#include "texture_cache.h"
 
 tex2_t tex2_clone(tex2_t* t) {
     tex2_t result = { t->u, t->v };
     return result;
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Create a texture from a decoded PNG image and build its mip chain
+///////////////////////////////////////////////////////////////////////////////
+texture_t* texture_from_png(upng_t* png_image) {
+	int width = upng_get_width(png_image);
+	int height = upng_get_height(png_image);
+	const unsigned char* pixels = upng_get_buffer(png_image);
+	upng_format format = upng_get_format(png_image);
+
+	if (format != UPNG_RGBA8 && format != UPNG_RGB8) {
+		return NULL;
+	}
+
+	texture_t* texture = (texture_t*)calloc(1, sizeof(texture_t));
+	texture->num_levels = 1;
+	texture->levels[0].width = width;
+	texture->levels[0].height = height;
+	texture->levels[0].texels = (uint32_t*)malloc(sizeof(uint32_t) * width * height);
+	texture->levels[0].is_tiled = false;
+	texture->levels[0].is_power_of_two = false;
+
+	// Convert the PNG bytes (RGBA or RGB) to the packed ARGB format of the color buffer
+	uint32_t* texels = texture->levels[0].texels;
+	if (format == UPNG_RGBA8) {
+		for (int i = 0; i < width * height; i++) {
+			texels[i] = MAKE_ARGB(pixels[i * 4 + 3], pixels[i * 4 + 0], pixels[i * 4 + 1], pixels[i * 4 + 2]);
+		}
+	} else {
+		for (int i = 0; i < width * height; i++) {
+			texels[i] = MAKE_ARGB(0xFF, pixels[i * 3 + 0], pixels[i * 3 + 1], pixels[i * 3 + 2]);
+		}
+	}
+
+	generate_texture_mipmaps(texture);
+
+	// Switch the levels to the cache friendly tiled layout once the mip chain is built
+	for (int i = 0; i < texture->num_levels; i++) {
+		tile_texture_level(&texture->levels[i]);
+	}
+	return texture;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Create a single texel texture, used as a placeholder while a texture loads
+///////////////////////////////////////////////////////////////////////////////
+texture_t* create_flat_texture(uint32_t color) {
+	texture_t* texture = (texture_t*)calloc(1, sizeof(texture_t));
+	texture->num_levels = 1;
+	texture->levels[0].width = 1;
+	texture->levels[0].height = 1;
+	texture->levels[0].texels = (uint32_t*)malloc(sizeof(uint32_t));
+	texture->levels[0].texels[0] = color;
+	tile_texture_level(&texture->levels[0]);
+	return texture;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Average four texels channel by channel
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t average_texels(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+	uint32_t result = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF) + ((c >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+		result |= ((sum + 2) / 4) << shift;
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Build the mip chain of a texture with a 2x2 box filter down to 1x1
+///////////////////////////////////////////////////////////////////////////////
+void generate_texture_mipmaps(texture_t* texture) {
+	while (texture->num_levels < MAX_TEXTURE_LEVELS) {
+		texture_level_t* src = &texture->levels[texture->num_levels - 1];
+		if (src->width == 1 && src->height == 1) {
+			break;
+		}
+
+		texture_level_t* dst = &texture->levels[texture->num_levels];
+		dst->width = src->width > 1 ? src->width / 2 : 1;
+		dst->height = src->height > 1 ? src->height / 2 : 1;
+		dst->texels = (uint32_t*)malloc(sizeof(uint32_t) * dst->width * dst->height);
+		dst->is_tiled = false;
+		dst->is_power_of_two = false;
+
+		for (int y = 0; y < dst->height; y++) {
+			// Odd sizes and 1 texel wide levels reuse the last row/column
+			int y0 = y * 2 < src->height ? y * 2 : src->height - 1;
+			int y1 = y * 2 + 1 < src->height ? y * 2 + 1 : src->height - 1;
+			for (int x = 0; x < dst->width; x++) {
+				int x0 = x * 2 < src->width ? x * 2 : src->width - 1;
+				int x1 = x * 2 + 1 < src->width ? x * 2 + 1 : src->width - 1;
+				dst->texels[(dst->width * y) + x] = average_texels(
+					src->texels[(src->width * y0) + x0],
+					src->texels[(src->width * y0) + x1],
+					src->texels[(src->width * y1) + x0],
+					src->texels[(src->width * y1) + x1]
+				);
+			}
+		}
+		texture->num_levels++;
+	}
+}
+
+static bool is_power_of_two(int value) {
+	return value > 0 && (value & (value - 1)) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rearrange a row-major level into 4x4 tiles stored one after the other
+///////////////////////////////////////////////////////////////////////////////
+//
+//   row-major:  0  1  2  3  4  5  6  7     tiled:  0  1  2  3 | 16 17 18 19
+//               8  9 10 11 12 13 14 15             4  5  6  7 | 20 21 22 23
+//              ...                                 8  9 10 11 | 24 25 26 27
+//                                                 12 13 14 15 | 28 29 30 31
+//
+// A texel and its neighbours in both directions share the same cache line,
+// so vertical and rotated spans do not miss the cache on every texel.
+// Levels that are not powers of two or smaller than a tile stay row-major.
+///////////////////////////////////////////////////////////////////////////////
+void tile_texture_level(texture_level_t* level) {
+	level->is_tiled = false;
+	level->is_power_of_two = is_power_of_two(level->width) && is_power_of_two(level->height);
+	if (!level->is_power_of_two) {
+		return;
+	}
+
+	level->width_shift = 0;
+	while ((1 << level->width_shift) < level->width) {
+		level->width_shift++;
+	}
+	level->width_mask = level->width - 1;
+	level->height_mask = level->height - 1;
+
+	if (level->width < TEXTURE_TILE_SIZE || level->height < TEXTURE_TILE_SIZE) {
+		return;
+	}
+
+	uint32_t* tiled_texels = (uint32_t*)malloc(sizeof(uint32_t) * level->width * level->height);
+	level->is_tiled = true;
+	for (int y = 0; y < level->height; y++) {
+		for (int x = 0; x < level->width; x++) {
+			uint32_t tile = ((y >> TEXTURE_TILE_SHIFT) << (level->width_shift - TEXTURE_TILE_SHIFT)) + (x >> TEXTURE_TILE_SHIFT);
+			uint32_t offset = ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) + (x & (TEXTURE_TILE_SIZE - 1));
+			tiled_texels[(tile << (2 * TEXTURE_TILE_SHIFT)) + offset] = level->texels[(level->width * y) + x];
+		}
+	}
+	free(level->texels);
+	level->texels = tiled_texels;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Select the mip level where one texel covers about one screen pixel
+///////////////////////////////////////////////////////////////////////////////
+// The ratio between the triangle area in texels (UV area scaled by the size
+// of level 0) and its area in pixels is the squared texel footprint of a
+// pixel, so half of its log2 is the level of detail.
+///////////////////////////////////////////////////////////////////////////////
+float get_texture_lod_level(texture_t* texture, float screen_area, float uv_area) {
+	float texel_area = uv_area * texture->levels[0].width * texture->levels[0].height;
+	if (screen_area < 1.0) {
+		screen_area = 1.0;
+	}
+	if (texel_area <= screen_area) {
+		return 0;
+	}
+
+	float lod = 0.5 * log2f(texel_area / screen_area);
+	return lod < texture->num_levels - 1 ? lod : texture->num_levels - 1;
+}
+
+int get_texture_lod(texture_t* texture, float screen_area, float uv_area) {
+	return (int)(get_texture_lod_level(texture, screen_area, uv_area) + 0.5);
+}
+
+texture_descriptor_t get_level_descriptor(texture_level_t* level) {
+	texture_descriptor_t descriptor = {
+		.texels = level->texels,
+		.width = level->width,
+		.height = level->height,
+		.x = 0,
+		.y = 0,
+		.row_shift = level->width_shift,
+		.row_width = level->width,
+		.width_mask = level->width_mask,
+		.height_mask = level->height_mask,
+		.is_tiled = level->is_tiled,
+		.is_power_of_two = level->is_power_of_two
+	};
+	return descriptor;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Resolve the descriptor used to draw a texture at a level of detail
+///////////////////////////////////////////////////////////////////////////////
+// Marks the level as used for the residency manager, which may hand back a
+// coarser level while the requested one is reloaded. A texture packed in an
+// atlas samples the same level of the page, inside its own rectangle.
+///////////////////////////////////////////////////////////////////////////////
+texture_descriptor_t get_texture_descriptor(texture_t* texture, int level) {
+	if (texture->atlas_page == NULL) {
+		return get_level_descriptor(&texture->levels[use_texture_level(texture, level)]);
+	}
+
+	level = use_texture_level(texture->atlas_page, level);
+	texture_descriptor_t descriptor = get_level_descriptor(&texture->atlas_page->levels[level]);
+
+	// Past the last level of the image (only while falling back) the rectangle is kept at one texel
+	int size = texture->levels[0].width >> level;
+	descriptor.width = size > 0 ? size : 1;
+	descriptor.height = descriptor.width;
+	descriptor.x = texture->atlas_x >> level;
+	descriptor.y = texture->atlas_y >> level;
+	descriptor.width_mask = descriptor.width - 1;
+	descriptor.height_mask = descriptor.height - 1;
+	return descriptor;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Resolve the levels a draw samples with the given filter mode
+///////////////////////////////////////////////////////////////////////////////
+// Trilinear filtering blends the two levels around the fractional level of
+// detail of the triangle, the other modes use the closest level.
+///////////////////////////////////////////////////////////////////////////////
+texture_sampler_t get_texture_sampler(texture_t* texture, int filter, float screen_area, float uv_area) {
+	texture_sampler_t sampler = { .filter = filter, .level_blend = 0 };
+	if (filter != TEXTURE_FILTER_TRILINEAR) {
+		sampler.levels[0] = get_texture_descriptor(texture, get_texture_lod(texture, screen_area, uv_area));
+		return sampler;
+	}
+
+	float lod = get_texture_lod_level(texture, screen_area, uv_area);
+	int level = (int)lod;
+	int coarser_level = level + 1 < texture->num_levels ? level + 1 : level;
+	sampler.levels[0] = get_texture_descriptor(texture, level);
+	sampler.levels[1] = get_texture_descriptor(texture, coarser_level);
+	sampler.level_blend = (uint32_t)((lod - level) * 256.0);
+	if (sampler.level_blend > 255) {
+		sampler.level_blend = 255;
+	}
+	return sampler;
+}
+
+void free_texture(texture_t* texture) {
+	if (texture == NULL) {
+		return;
+	}
+	for (int i = 0; i < texture->num_levels; i++) {
+		free(texture->levels[i].texels);
+	}
+	free(texture);
+}
@@ -1,11 +1,179 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "upng.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MAX_TEXTURE_LEVELS 16
+
+// Power of two levels are stored as 4x4 texel tiles (16 texels = one 64 byte cache line)
+#define TEXTURE_TILE_SHIFT 2
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_SHIFT)
+
 typedef struct {
 	float u;
 	float v;
 } tex2_t;
 
+typedef struct {
+	int width;
+	int height;
+	uint32_t* texels;
+	bool is_tiled;        // Texels are stored in 4x4 tiles instead of rows
+	bool is_power_of_two; // Width and height are powers of two, so masks can wrap coordinates
+	int width_shift;      // log2 of the width (power of two levels only)
+	uint32_t width_mask;  // width - 1 (power of two levels only)
+	uint32_t height_mask; // height - 1 (power of two levels only)
+	uint32_t last_used_frame; // Last frame that sampled or requested the level (residency manager)
+	long cache_offset;    // Position of the compressed texels in the texture cache file
+	uint32_t cache_size;  // Size of the compressed texels in bytes
+} texture_level_t;
+
+typedef struct texture {
+	int num_levels;                              // Level 0 is the full size image
+	texture_level_t levels[MAX_TEXTURE_LEVELS];  // Mip chain, each level half the size of the previous one
+	bool is_cached;                              // Levels can be evicted (texels == NULL) and reloaded from the cache file
+	struct texture* atlas_page;                  // Atlas page holding the texels when the texture was packed (NULL otherwise)
+	int atlas_x;                                 // Position of level 0 in the atlas page
+	int atlas_y;
+} texture_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Everything the rasterizer needs to sample one texture level, resolved once
+// per draw: base pointer, size, masks and the origin in an atlas page
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	uint32_t* texels;     // Texels of the stored level (the atlas page level for packed textures)
+	int width;            // Size of the image in texels
+	int height;
+	int x;                // Origin of the image in the stored level (0, 0 unless packed)
+	int y;
+	int row_shift;        // log2 of the stored level width (power of two levels only)
+	int row_width;        // Stored level width in texels
+	uint32_t width_mask;  // width - 1 (power of two levels only)
+	uint32_t height_mask; // height - 1 (power of two levels only)
+	bool is_tiled;
+	bool is_power_of_two;
+} texture_descriptor_t;
+
+enum texture_filter {
+	TEXTURE_FILTER_NEAREST,
+	TEXTURE_FILTER_BILINEAR,
+	TEXTURE_FILTER_TRILINEAR
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Filter mode and resolved levels used to sample a texture in one draw
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	int filter;                      // One of the texture_filter modes
+	texture_descriptor_t levels[2];  // Selected level and the next coarser one (trilinear only)
+	uint32_t level_blend;            // Weight of the coarser level from 0 to 255 (trilinear only)
+} texture_sampler_t;
+
 tex2_t tex2_clone(tex2_t* t);
 
-#endif
\ No newline at end of file
+texture_t* texture_from_png(upng_t* png_image);
+texture_t* create_flat_texture(uint32_t color);
+void generate_texture_mipmaps(texture_t* texture);
+void tile_texture_level(texture_level_t* level);
+float get_texture_lod_level(texture_t* texture, float screen_area, float uv_area);
+int get_texture_lod(texture_t* texture, float screen_area, float uv_area);
+texture_descriptor_t get_level_descriptor(texture_level_t* level);
+texture_descriptor_t get_texture_descriptor(texture_t* texture, int level);
+texture_sampler_t get_texture_sampler(texture_t* texture, int filter, float screen_area, float uv_area);
+void free_texture(texture_t* texture);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return the texel of a descriptor at the (unwrapped) texel coordinates x, y
+///////////////////////////////////////////////////////////////////////////////
+// Power of two images wrap with masks inside their rectangle of the stored
+// level and address tiles with shifts. Other images are row-major and wrap
+// with modulo.
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t get_texel(texture_descriptor_t* texture, int x, int y) {
+	if (texture->is_power_of_two) {
+		uint32_t tx = texture->x + ((uint32_t)x & texture->width_mask);
+		uint32_t ty = texture->y + ((uint32_t)y & texture->height_mask);
+		if (!texture->is_tiled) {
+			return texture->texels[(ty << texture->row_shift) + tx];
+		}
+		uint32_t tile = ((ty >> TEXTURE_TILE_SHIFT) << (texture->row_shift - TEXTURE_TILE_SHIFT)) + (tx >> TEXTURE_TILE_SHIFT);
+		uint32_t offset = ((ty & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) + (tx & (TEXTURE_TILE_SIZE - 1));
+		return texture->texels[(tile << (2 * TEXTURE_TILE_SHIFT)) + offset];
+	}
+	int tex_x = texture->x + abs(x) % texture->width;
+	int tex_y = texture->y + abs(y) % texture->height;
+	return texture->texels[(texture->row_width * tex_y) + tex_x];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Blend a 2x2 block of texels with 8 bit fractions fx and fy (0 to 255)
+///////////////////////////////////////////////////////////////////////////////
+// All four channels of two texels are blended at once in 16 bit lanes: first
+// the top and bottom rows with fy, then the left and right columns with fx.
+// A product is at most 255 * 256 and a weighted sum of two of them still fits
+// in an unsigned 16 bit lane.
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t bilinear_filter(uint32_t t00, uint32_t t10, uint32_t t01, uint32_t t11, uint32_t fx, uint32_t fy) {
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(t00), _mm_cvtsi32_si128(t10)), zero);
+	__m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(t01), _mm_cvtsi32_si128(t11)), zero);
+	__m128i columns = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16(256 - fy)), _mm_mullo_epi16(bottom, _mm_set1_epi16(fy)));
+	columns = _mm_srli_epi16(columns, 8);
+	__m128i weighted = _mm_mullo_epi16(columns, _mm_setr_epi16(256 - fx, 256 - fx, 256 - fx, 256 - fx, fx, fx, fx, fx));
+	__m128i result = _mm_srli_epi16(_mm_add_epi16(weighted, _mm_srli_si128(weighted, 8)), 8);
+	return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+#else
+	uint32_t result = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t left = (((t00 >> shift) & 0xFF) * (256 - fy) + ((t01 >> shift) & 0xFF) * fy) >> 8;
+		uint32_t right = (((t10 >> shift) & 0xFF) * (256 - fy) + ((t11 >> shift) & 0xFF) * fy) >> 8;
+		result |= ((left * (256 - fx) + right * fx) >> 8) << shift;
+	}
+	return result;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bilinear sample at the texture coordinates u and v
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t get_texel_bilinear(texture_descriptor_t* texture, float u, float v) {
+	// 8.8 fixed point texel coordinates, moved by half a texel so the fractions are relative to texel centers
+	int x = (int)(u * texture->width * 256.0f) - 128;
+	int y = (int)(v * texture->height * 256.0f) - 128;
+	int x0 = x >> 8;
+	int y0 = y >> 8;
+	return bilinear_filter(
+		get_texel(texture, x0, y0), get_texel(texture, x0 + 1, y0),
+		get_texel(texture, x0, y0 + 1), get_texel(texture, x0 + 1, y0 + 1),
+		x & 0xFF, y & 0xFF
+	);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sample a texture with the filter of the sampler
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t sample_texture(texture_sampler_t* sampler, float u, float v) {
+	texture_descriptor_t* texture = &sampler->levels[0];
+	if (sampler->filter == TEXTURE_FILTER_NEAREST) {
+		return get_texel(texture, (int)(u * texture->width), (int)(v * texture->height));
+	}
+
+	uint32_t color = get_texel_bilinear(texture, u, v);
+	if (sampler->filter == TEXTURE_FILTER_TRILINEAR && sampler->level_blend > 0) {
+		// Blend with the coarser level (a bilinear blend along x only)
+		uint32_t coarser_color = get_texel_bilinear(&sampler->levels[1], u, v);
+		color = bilinear_filter(color, coarser_color, color, coarser_color, sampler->level_blend, 0);
+	}
+	return color;
+}
+
+#endif
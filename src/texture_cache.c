@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include "texture_cache.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Registered textures, texel budget and the frame counter used for the LRU
+///////////////////////////////////////////////////////////////////////////////
+static texture_t* textures[MAX_CACHED_TEXTURES];
+static int num_textures = 0;
+static size_t texture_budget = DEFAULT_TEXTURE_BUDGET;
+static uint32_t current_frame = 1;
+
+///////////////////////////////////////////////////////////////////////////////
+// Temporary file holding the compressed texels of every cached texture level
+///////////////////////////////////////////////////////////////////////////////
+static FILE* cache_file = NULL;
+static SDL_mutex* cache_file_mutex = NULL;
+
+bool init_texture_cache(void) {
+	cache_file_mutex = SDL_CreateMutex();
+	cache_file = tmpfile();
+	if (!cache_file_mutex || !cache_file) {
+		fprintf(stderr, "Error creating texture cache file, textures will stay resident.\n");
+		return false;
+	}
+	return true;
+}
+
+void set_texture_budget(size_t budget_bytes) {
+	texture_budget = budget_bytes;
+}
+
+static size_t get_level_bytes(texture_level_t* level) {
+	return sizeof(uint32_t) * level->width * level->height;
+}
+
+size_t get_texture_resident_bytes(void) {
+	size_t bytes = 0;
+	for (int i = 0; i < num_textures; i++) {
+		for (int l = 0; l < textures[i]->num_levels; l++) {
+			if (textures[i]->levels[l].texels) {
+				bytes += get_level_bytes(&textures[i]->levels[l]);
+			}
+		}
+	}
+	return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run-length encoding of 32-bit texels
+///////////////////////////////////////////////////////////////////////////////
+// Packets start with a word holding a count in the low 31 bits. With the top
+// bit set, one texel follows that is repeated count times, otherwise count
+// literal texels follow. Flat and dithered areas of textures compress well
+// and decoding is little more than memcpy and fill loops.
+///////////////////////////////////////////////////////////////////////////////
+#define RLE_RUN_FLAG 0x80000000
+#define RLE_MIN_RUN 3
+
+static uint32_t* compress_texels(const uint32_t* texels, int count, uint32_t* compressed_words) {
+	// Worst case: a literal packet between every pair of runs
+	uint32_t* out = (uint32_t*)malloc(sizeof(uint32_t) * (count * 2 + 2));
+	uint32_t n = 0;
+	int literal_start = 0;
+	int i = 0;
+	while (i < count) {
+		int run = 1;
+		while (i + run < count && texels[i + run] == texels[i]) {
+			run++;
+		}
+		if (run < RLE_MIN_RUN) {
+			i += run;
+			continue;
+		}
+		if (i > literal_start) {
+			out[n++] = i - literal_start;
+			memcpy(&out[n], &texels[literal_start], sizeof(uint32_t) * (i - literal_start));
+			n += i - literal_start;
+		}
+		out[n++] = RLE_RUN_FLAG | run;
+		out[n++] = texels[i];
+		i += run;
+		literal_start = i;
+	}
+	if (count > literal_start) {
+		out[n++] = count - literal_start;
+		memcpy(&out[n], &texels[literal_start], sizeof(uint32_t) * (count - literal_start));
+		n += count - literal_start;
+	}
+	*compressed_words = n;
+	return out;
+}
+
+static bool decompress_texels(const uint32_t* in, uint32_t words, uint32_t* texels, int count) {
+	uint32_t i = 0;
+	int n = 0;
+	while (i < words) {
+		uint32_t packet_count = in[i] & ~RLE_RUN_FLAG;
+		if (packet_count > (uint32_t)(count - n)) {
+			return false;
+		}
+		if (in[i] & RLE_RUN_FLAG) {
+			if (i + 1 >= words) {
+				return false;
+			}
+			uint32_t texel = in[i + 1];
+			for (uint32_t k = 0; k < packet_count; k++) {
+				texels[n + k] = texel;
+			}
+			i += 2;
+		} else {
+			if (i + 1 + packet_count > words) {
+				return false;
+			}
+			memcpy(&texels[n], &in[i + 1], sizeof(uint32_t) * packet_count);
+			i += 1 + packet_count;
+		}
+		n += packet_count;
+	}
+	return n == count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Append the compressed levels of a texture to the cache file
+///////////////////////////////////////////////////////////////////////////////
+// Called by the load jobs once a texture is decoded. Only textures that
+// are written completely can have their levels evicted.
+///////////////////////////////////////////////////////////////////////////////
+bool write_texture_cache(texture_t* texture) {
+	if (!cache_file || !texture) {
+		return false;
+	}
+
+	bool is_written = true;
+	for (int l = 0; l < texture->num_levels && is_written; l++) {
+		texture_level_t* level = &texture->levels[l];
+		uint32_t words;
+		uint32_t* compressed = compress_texels(level->texels, level->width * level->height, &words);
+
+		SDL_LockMutex(cache_file_mutex);
+		is_written = fseek(cache_file, 0, SEEK_END) == 0;
+		level->cache_offset = ftell(cache_file);
+		level->cache_size = sizeof(uint32_t) * words;
+		is_written = is_written && level->cache_offset >= 0 && fwrite(compressed, sizeof(uint32_t), words, cache_file) == words;
+		SDL_UnlockMutex(cache_file_mutex);
+
+		free(compressed);
+	}
+	texture->is_cached = is_written;
+	return is_written;
+}
+
+static bool reload_texture_level(texture_level_t* level) {
+	uint32_t words = level->cache_size / sizeof(uint32_t);
+	uint32_t* compressed = (uint32_t*)malloc(level->cache_size);
+
+	SDL_LockMutex(cache_file_mutex);
+	bool is_read = fseek(cache_file, level->cache_offset, SEEK_SET) == 0 && fread(compressed, sizeof(uint32_t), words, cache_file) == words;
+	SDL_UnlockMutex(cache_file_mutex);
+
+	uint32_t* texels = (uint32_t*)malloc(get_level_bytes(level));
+	if (!is_read || !decompress_texels(compressed, words, texels, level->width * level->height)) {
+		fprintf(stderr, "Error reading texture cache file.\n");
+		free(texels);
+		texels = NULL;
+	}
+	free(compressed);
+
+	level->texels = texels;
+	return texels != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Textures have to be registered to be counted against the budget
+///////////////////////////////////////////////////////////////////////////////
+void register_texture(texture_t* texture) {
+	if (!texture) {
+		return;
+	}
+	if (num_textures == MAX_CACHED_TEXTURES) {
+		fprintf(stderr, "Too many textures, the texture will not be managed by the cache.\n");
+		return;
+	}
+	textures[num_textures++] = texture;
+}
+
+void unregister_texture(texture_t* texture) {
+	for (int i = 0; i < num_textures; i++) {
+		if (textures[i] == texture) {
+			textures[i] = textures[--num_textures];
+			return;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return the level to sample for a draw and mark it as used in this frame
+///////////////////////////////////////////////////////////////////////////////
+// An evicted level is requested for reload at the next frame boundary and
+// the closest coarser resident level is used meanwhile. The coarsest level is
+// never evicted, so there is always a level to fall back to.
+///////////////////////////////////////////////////////////////////////////////
+int use_texture_level(texture_t* texture, int level) {
+	texture->levels[level].last_used_frame = current_frame;
+	while (texture->levels[level].texels == NULL && level < texture->num_levels - 1) {
+		level++;
+	}
+	texture->levels[level].last_used_frame = current_frame;
+	return level;
+}
+
+static int compare_least_recently_used(const void* a, const void* b) {
+	const texture_level_t* level_a = *(const texture_level_t**)a;
+	const texture_level_t* level_b = *(const texture_level_t**)b;
+	if (level_a->last_used_frame != level_b->last_used_frame) {
+		return level_a->last_used_frame < level_b->last_used_frame ? -1 : 1;
+	}
+	// Among levels of the same age evict the larger ones first
+	return (int)level_b->width * level_b->height - (int)level_a->width * level_a->height;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reload the requested levels and evict the least recently used ones
+///////////////////////////////////////////////////////////////////////////////
+// Must be called between two frames, when no triangle is being rasterized.
+///////////////////////////////////////////////////////////////////////////////
+void update_texture_residency(void) {
+	// Reload the levels the last frame asked for (a limited amount per frame to avoid hitches)
+	size_t reloaded_bytes = 0;
+	for (int i = 0; i < num_textures; i++) {
+		texture_t* texture = textures[i];
+		for (int l = 0; l < texture->num_levels && texture->is_cached; l++) {
+			texture_level_t* level = &texture->levels[l];
+			if (level->texels == NULL && level->last_used_frame == current_frame && reloaded_bytes < MAX_TEXTURE_RELOAD_BYTES) {
+				if (reload_texture_level(level)) {
+					reloaded_bytes += get_level_bytes(level);
+				}
+			}
+		}
+	}
+
+	// Evict the least recently used levels while the resident texels are over the budget
+	size_t resident_bytes = get_texture_resident_bytes();
+	if (resident_bytes > texture_budget) {
+		texture_level_t* candidates[MAX_CACHED_TEXTURES * MAX_TEXTURE_LEVELS];
+		int num_candidates = 0;
+		for (int i = 0; i < num_textures; i++) {
+			texture_t* texture = textures[i];
+			for (int l = 0; l < texture->num_levels - 1 && texture->is_cached; l++) {
+				texture_level_t* level = &texture->levels[l];
+				if (level->texels && level->last_used_frame != current_frame) {
+					candidates[num_candidates++] = level;
+				}
+			}
+		}
+		qsort(candidates, num_candidates, sizeof(texture_level_t*), compare_least_recently_used);
+
+		for (int i = 0; i < num_candidates && resident_bytes > texture_budget; i++) {
+			free(candidates[i]->texels);
+			candidates[i]->texels = NULL;
+			resident_bytes -= get_level_bytes(candidates[i]);
+		}
+	}
+
+	current_frame++;
+}
+
+void free_texture_cache(void) {
+	num_textures = 0;
+	if (cache_file) {
+		fclose(cache_file);
+		cache_file = NULL;
+	}
+	if (cache_file_mutex) {
+		SDL_DestroyMutex(cache_file_mutex);
+		cache_file_mutex = NULL;
+	}
+}
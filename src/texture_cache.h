@@ -0,0 +1,29 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "texture.h"
+
+#define MAX_CACHED_TEXTURES 64
+
+// Default byte budget for the texels of all registered textures
+#define DEFAULT_TEXTURE_BUDGET (64 * 1024 * 1024)
+
+// Upper limit of texel bytes reloaded from the cache file in one frame
+#define MAX_TEXTURE_RELOAD_BYTES (8 * 1024 * 1024)
+
+bool init_texture_cache(void);
+void set_texture_budget(size_t budget_bytes);
+size_t get_texture_resident_bytes(void);
+
+bool write_texture_cache(texture_t* texture);
+void register_texture(texture_t* texture);
+void unregister_texture(texture_t* texture);
+
+int use_texture_level(texture_t* texture, int level);
+void update_texture_residency(void);
+
+void free_texture_cache(void);
+
+#endif
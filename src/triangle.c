@@ -1,6 +1,11 @@
 #include "display.h"
 #include "swap.h"
 #include "triangle.h"
+#include "texture_cache.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Return the normal vector of a triangle face
@@ -25,312 +30,343 @@ vec3_t get_triangle_normal(vec4_t vertices[3]) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Return the barycentric weights alpha, beta, and gamma for point p
+// Resolve the texture levels a textured triangle is sampled from
 ///////////////////////////////////////////////////////////////////////////////
-//
-//         (B)
-//         /|\
-//        / | \
-//       /  |  \
-//      /  (P)  \
-//     /  /   \  \
-//    / /       \ \
-//   //           \\
-//  (A)------------(C)
-//
+// The mip level comes from the ratio of the triangle area in texture space
+// and in screen space. Resolving a level marks it as used for the residency
+// manager, so this runs on the main thread before the raster tiles start.
 ///////////////////////////////////////////////////////////////////////////////
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-	// Find the vectors between the vertices ABC and point p
-	vec2_t ac = vec2_sub(c, a);
-	vec2_t ab = vec2_sub(b, a);
-	vec2_t ap = vec2_sub(p, a);
-	vec2_t pc = vec2_sub(c, p);
-	vec2_t pb = vec2_sub(b, p);
+texture_sampler_t get_triangle_texture_sampler(triangle_t* triangle) {
+	vec4_t* p = triangle->points;
+	tex2_t* uv = triangle->texcoords;
+	float screen_area = fabs((p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y));
+	float uv_area = fabs((uv[1].u - uv[0].u) * (uv[2].v - uv[0].v) - (uv[2].u - uv[0].u) * (uv[1].v - uv[0].v));
+	return get_texture_sampler(triangle->texture, triangle->texture_filter, screen_area, uv_area);
+}
 
-	// Compute the area of the full parallegram/triangle ABC using 2D cross product
-	float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x); // || AC x AB ||
+///////////////////////////////////////////////////////////////////////////////
+// Snap a screen coordinate to 28.4 fixed point (1/16th of a pixel)
+///////////////////////////////////////////////////////////////////////////////
+static int snap_to_subpixel(float value) {
+	return (int)floorf(value * SUBPIXEL_ONE + 0.5);
+}
 
-	// Alpha is the area of the small parallelogram/triangle PBC divided by the area of the full parallelogram/triangle ABC
-	float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
+///////////////////////////////////////////////////////////////////////////////
+// Edge function of point p against the edge from a to b (2D cross product)
+///////////////////////////////////////////////////////////////////////////////
+static int edge_cross(int ax, int ay, int bx, int by, int px, int py) {
+	return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
 
-	// Beta is the area of the small parallelogram/triangle APC divided by the area of the full parallelogram/triangle ABC
-	float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
+///////////////////////////////////////////////////////////////////////////////
+// Top-left rasterization rule: pixels exactly on a top or left edge belong
+// to the triangle, pixels on the other edges belong to the neighbour
+///////////////////////////////////////////////////////////////////////////////
+static bool is_top_left(int ax, int ay, int bx, int by) {
+	bool is_top_edge = ay == by && bx > ax;
+	bool is_left_edge = by < ay;
+	return is_top_edge || is_left_edge;
+}
 
-	// Weight gamma is easily found since barycentric coordinates always add up to 1.0
-	float gamma = 1 - alpha - beta;
+///////////////////////////////////////////////////////////////////////////////
+// Set up the edge functions of a triangle for the rows y_min to y_max of a
+// buffer with the given width
+///////////////////////////////////////////////////////////////////////////////
+// The vertices are in 28.4 fixed point and wound so the area is positive.
+// Edge i is the edge opposite of vertex i, so its value divided by the area
+// is the barycentric weight of that vertex. All the edge values are exact
+// integers, which makes the covered pixels the same no matter how the screen
+// is split into tiles. With 28.4 coordinates the values fit in 32 bits for
+// render resolutions up to 1920x1080.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	int x_min, x_max;   // Pixel columns to visit, clipped to the screen
+	int y_min, y_max;   // Pixel rows to visit, clipped to the screen and the tile
+	int w_row[3];       // Edge values at the center of the first pixel
+	int step_x[3];      // Change of the edge values one pixel to the right
+	int step_y[3];      // Change of the edge values one pixel down
+	int bias[3];        // Smallest edge value inside the triangle (top-left rule)
+	float inv_area;     // Turns edge values into barycentric weights
+} triangle_edges_t;
+
+static bool setup_triangle_edges(triangle_edges_t* edges, int x[3], int y[3], int width, int y_min, int y_max) {
+	int area = edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]);
+	if (area <= 0) {
+		return false;
+	}
+
+	// Bounding box of the pixel centers the triangle can cover
+	int box_x_min = fminf(x[0], fminf(x[1], x[2]));
+	int box_x_max = fmaxf(x[0], fmaxf(x[1], x[2]));
+	int box_y_min = fminf(y[0], fminf(y[1], y[2]));
+	int box_y_max = fmaxf(y[0], fmaxf(y[1], y[2]));
+	edges->x_min = box_x_min >> SUBPIXEL_BITS;
+	edges->x_max = box_x_max >> SUBPIXEL_BITS;
+	edges->y_min = box_y_min >> SUBPIXEL_BITS;
+	edges->y_max = box_y_max >> SUBPIXEL_BITS;
+	if (edges->x_min < 0) edges->x_min = 0;
+	if (edges->x_max > width - 1) edges->x_max = width - 1;
+	if (edges->y_min < y_min) edges->y_min = y_min;
+	if (edges->y_max > y_max) edges->y_max = y_max;
+	if (edges->x_min > edges->x_max || edges->y_min > edges->y_max) {
+		return false;
+	}
 
-	vec3_t weights = { alpha, beta, gamma };
-	return weights;
+	// Evaluate the edges at the center of the first pixel, the rest is stepped
+	int px = (edges->x_min << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+	int py = (edges->y_min << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+	for (int i = 0; i < 3; i++) {
+		int a = (i + 1) % 3;
+		int b = (i + 2) % 3;
+		edges->w_row[i] = edge_cross(x[a], y[a], x[b], y[b], px, py);
+		edges->step_x[i] = (y[a] - y[b]) * SUBPIXEL_ONE;
+		edges->step_y[i] = (x[b] - x[a]) * SUBPIXEL_ONE;
+		edges->bias[i] = is_top_left(x[a], y[a], x[b], y[b]) ? 0 : 1;
+	}
+	edges->inv_area = 1.0 / area;
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Function to draw the colored triangle pixel at position x and y with z_buffer
+// Attribute that changes linearly across the screen (like 1/w, u/w and v/w)
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle_pixel(
-	int x, int y, uint32_t color,
-	vec4_t point_a, vec4_t point_b, vec4_t point_c
-) {
-	vec2_t point_p = { x, y };
-	vec2_t a = vec2_from_vec4(point_a);
-	vec2_t b = vec2_from_vec4(point_b);
-	vec2_t c = vec2_from_vec4(point_c);
-	vec3_t weights = barycentric_weights(a, b, c, point_p);
-
-	float alpha = weights.x;
-	float beta = weights.y;
-	float gamma = weights.z;
+// The value at the start of every row is computed from the exact edge values
+// and stepped by step_x along the row, so the inner loop only adds and a row
+// gets the same values no matter which tile it is drawn in.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	float vertex[3];    // Value at the three vertices
+	float step_x;       // Change of the value one pixel to the right
+} attribute_plane_t;
+
+static attribute_plane_t setup_attribute_plane(triangle_edges_t* edges, float a0, float a1, float a2) {
+	attribute_plane_t plane = {
+		.vertex = { a0, a1, a2 },
+		.step_x = (a0 * edges->step_x[0] + a1 * edges->step_x[1] + a2 * edges->step_x[2]) * edges->inv_area
+	};
+	return plane;
+}
 
-	// Interpolate the values of 1/w for the current pixel
-	float interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+static float get_attribute_at(attribute_plane_t* plane, int edge_values[3], float inv_area) {
+	return (
+		plane->vertex[0] * edge_values[0] +
+		plane->vertex[1] * edge_values[1] +
+		plane->vertex[2] * edge_values[2]
+	) * inv_area;
+}
 
+///////////////////////////////////////////////////////////////////////////////
+// Function to draw the colored triangle pixel at position x and y with z_buffer
+///////////////////////////////////////////////////////////////////////////////
+void draw_triangle_pixel(int x, int y, uint32_t color, float light, float reciprocal_w) {
 	// Adjust 1/w so the pixels that are closer to the camera have smaller values
-	interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+	float depth = 1.0 - reciprocal_w;
 
 	// Only draw the pixel if the depth value is less than the one previously stored in the z-buffer
-	if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
+	if (depth < get_zbuffer_at(x, y)) {
 
-		// Draw a pixel at position (x,y) with the color that comes from the mapped texture
-		draw_pixel(x, y, color);
+		// Draw a pixel at position (x,y) with the color of the triangle lit by the interpolated light
+		draw_pixel(x, y, apply_light_intensity(color, light));
 
 		// Update the z-buffer value with the 1/w of this current pixel
-		update_zbuffer_at(x, y, interpolated_reciprocal_w);
+		update_zbuffer_at(x, y, depth);
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Blend the light of a pixel towards the light it gets without the
+// directional light, by how much of the pixel is in the shadow
+///////////////////////////////////////////////////////////////////////////////
+static float get_shadowed_light(shadow_map_t* shadow_map, float light, float shadowed_light, float x, float y, float depth) {
+	float visibility = get_shadow_visibility(shadow_map, x, y, depth);
+	return shadowed_light + (light - shadowed_light) * visibility;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Function to draw the textured pixel at position x and y using interpolation
 ///////////////////////////////////////////////////////////////////////////////
 void draw_triangle_texel(
 	int x, int y, 
-	float light, uint32_t* texture_buffer,
-	int texture_width, int texture_height,
-	vec4_t point_a, vec4_t point_b, vec4_t point_c,
-	tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
+	float light, texture_sampler_t* sampler,
+	float u_over_w, float v_over_w, float reciprocal_w,
+	shadow_map_t* shadow_map, float shadowed_light,
+	float shadow_x_over_w, float shadow_y_over_w, float shadow_depth_over_w
 ) {
-	vec2_t point_p = { x, y };
-	vec2_t a = vec2_from_vec4(point_a);
-	vec2_t b = vec2_from_vec4(point_b);
-	vec2_t c = vec2_from_vec4(point_c);
-	vec3_t weights = barycentric_weights(a, b, c, point_p);
-
-	float alpha = weights.x;
-	float beta = weights.y;
-	float gamma = weights.z;
-
-	// Variables to store the interpolated values of U, V, and also 1/W for the current pixel
-	float interpolated_u;
-	float interpolated_v;
-	float interpolated_reciprocal_w;
-
-	// Perform the interpolation of all U/w and V/w values using barycentric weights and a factor of 1/w
-	interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-	interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
-
-	// Also interpolate the values of 1/w for the current pixel
-	interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;;
-	
-	// Divide back both interpolated values by 1/w
-	interpolated_u /= interpolated_reciprocal_w;
-	interpolated_v /= interpolated_reciprocal_w;
-
-	// Map the UV coordinate to the full texture width and height
-	int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-	int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
-
 	// Adjust 1/w so the pixels that are closer to the camera have smaller values
-	interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+	float depth = 1.0 - reciprocal_w;
 
 	// Only draw the pixel if the depth value is less than the one previously stored in the z-buffer
-	if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-		
+	if (depth < get_zbuffer_at(x, y)) {
+
+		// Divide back the interpolated U/w and V/w by 1/w (one divide per visible pixel)
+		float w = 1 / reciprocal_w;
+
+		// Fetch the filtered texel, wrapping the coordinates around the texture
+		uint32_t color = sample_texture(sampler, u_over_w * w, v_over_w * w);
 
-		uint32_t color = texture_buffer[(texture_width * tex_y) + tex_x];
+		// Look up the shadow map position of the pixel (divided back by 1/w like the texture coordinates)
+		if (shadow_map) {
+			light = get_shadowed_light(shadow_map, light, shadowed_light, shadow_x_over_w * w, shadow_y_over_w * w, shadow_depth_over_w * w);
+		}
 
-		// Calculate the triangle color based on the light angle
+		// Calculate the texel color based on the interpolated light
 		uint32_t color_with_light = apply_light_intensity(color, light);
 
 		// Draw a pixel at position (x,y) with the color that comes from the mapped texture
 		draw_pixel(x, y, color_with_light);
 
 		// Update the z-buffer value with the 1/w of this current pixel
-		update_zbuffer_at(x, y, interpolated_reciprocal_w);
+		update_zbuffer_at(x, y, depth);
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Draw a triangle using three raw line calls
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color) {
-	draw_line(x0, y0, x1, y1, color);
-	draw_line(x1, y1, x2, y2, color);
-	draw_line(x2, y2, x0, y0, color);
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, int y_min, int y_max) {
+	draw_line(x0, y0, x1, y1, color, y_min, y_max);
+	draw_line(x1, y1, x2, y2, color, y_min, y_max);
+	draw_line(x2, y2, x0, y0, color, y_min, y_max);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a filled triangle with the flat-top/flat-bottom method
-// We split the original triangle in two, half flat-bottom and half flat-top
+// Draw a filled triangle with the edge function method
+// Every pixel center in the bounding box is tested against the three edges
 ///////////////////////////////////////////////////////////////////////////////
 //
 //          (x0,y0)
-//            / \
-//           /   \
-//          /     \
-//         /       \
-//        /         \
-//   (x1,y1)---------\
-//       \_           \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                         (x2,y2)
+//      +-----/-\-----------+
+//      |    /   \          |
+//      |   /     \         |
+//      |  /       \        |
+//      | /         \       |
+//   (x1,y1)_        \      |
+//      |   \_        \     |
+//      |      \_      \    |
+//      |         \_    \   |
+//      |            \_  \  |
+//      +---------------\_\-+
+//                        (x2,y2)
 //
 ///////////////////////////////////////////////////////////////////////////////
 void draw_filled_triangle(
-	int x0, int y0, float z0, float w0,
-	int x1, int y1, float z1, float w1, 
-	int x2, int y2, float z2, float w2,
-	float light, uint32_t color) {
-	
-	// Calculate the triangle color based on the light angle
-	uint32_t color_with_light = apply_light_intensity(color, light);
-
-	// We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-	}
-	if (y1 > y2) {
-		int_swap(&y1, &y2);
-		int_swap(&x1, &x2);
+	float x0, float y0, float z0, float w0, float l0,
+	float x1, float y1, float z1, float w1, float l1,
+	float x2, float y2, float z2, float w2, float l2,
+	uint32_t color,
+	int y_min, int y_max) {
+
+	// Snap the screen positions to the subpixel grid
+	int x[3] = { snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2) };
+	int y[3] = { snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2) };
+
+	// Swap B and C if the triangle is wound the other way (culling can be turned off)
+	if (edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]) < 0) {
+		int_swap(&x[1], &x[2]);
+		int_swap(&y[1], &y[2]);
+		float_swap(&x1, &x2);
+		float_swap(&y1, &y2);
 		float_swap(&z1, &z2);
 		float_swap(&w1, &w2);
+		float_swap(&l1, &l2);
 	}
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-	}
-
-	// Create vector points and texture coords after we sort the vertices
-	vec4_t point_a = { x0, y0, z0, w0 };
-	vec4_t point_b = { x1, y1, z1, w1 };
-	vec4_t point_c = { x2, y2, z2, w2 };
-
-	///////////////////////////////////////////////////////
-	// Render the upper part of the triangle (flat-bottom)
-	///////////////////////////////////////////////////////
-	float inv_slope_1 = 0;
-	float inv_slope_2 = 0;
-
-	if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
 
-	if (y1 - y0 != 0) {
-		for (int y = y0; y <= y1; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
-
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-			}
-
-			for (int x = x_start; x < x_end; x++) {
-				// Draw our pixel with the color that comes from the texture
-				draw_triangle_pixel(x, y, color_with_light, point_a, point_b, point_c);
-			}
-		}
+	triangle_edges_t edges;
+	if (!setup_triangle_edges(&edges, x, y, get_window_width(), y_min, y_max)) {
+		return;
 	}
 
-	///////////////////////////////////////////////////////
-	// Render the bottom part of the triangle (flat-top)
-	///////////////////////////////////////////////////////
-	inv_slope_1 = 0;
-	inv_slope_2 = 0;
-
-	if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-	if (y2 - y1 != 0) {
-		for (int y = y1; y <= y2; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
-
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-			}
-
-			for (int x = x_start; x < x_end; x++) {
-				// Draw our pixel with the color that comes from the texture
-				draw_triangle_pixel(x, y, color_with_light, point_a, point_b, point_c);
+	// Set up the planes of 1/w and the light after we wind the vertices
+	attribute_plane_t reciprocal_w_plane = setup_attribute_plane(&edges, 1 / w0, 1 / w1, 1 / w2);
+	attribute_plane_t light_plane = setup_attribute_plane(&edges, l0, l1, l2);
+
+	for (int y = edges.y_min; y <= edges.y_max; y++) {
+		int e0 = edges.w_row[0];
+		int e1 = edges.w_row[1];
+		int e2 = edges.w_row[2];
+		float reciprocal_w = get_attribute_at(&reciprocal_w_plane, edges.w_row, edges.inv_area);
+		float light = get_attribute_at(&light_plane, edges.w_row, edges.inv_area);
+		for (int x = edges.x_min; x <= edges.x_max; x++) {
+			if (e0 >= edges.bias[0] && e1 >= edges.bias[1] && e2 >= edges.bias[2]) {
+				draw_triangle_pixel(x, y, color, light, reciprocal_w);
 			}
+			e0 += edges.step_x[0];
+			e1 += edges.step_x[1];
+			e2 += edges.step_x[2];
+			reciprocal_w += reciprocal_w_plane.step_x;
+			light += light_plane.step_x;
 		}
+		edges.w_row[0] += edges.step_y[0];
+		edges.w_row[1] += edges.step_y[1];
+		edges.w_row[2] += edges.step_y[2];
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Draw a textured triangle based on a texture array of colors.
-// We split the original triangle in two, half flat-bottom and half flat-top.
+// Every pixel center in the bounding box is tested against the three edges.
 ///////////////////////////////////////////////////////////////////////////////
 //
 //        v0
-//        /\
-//       /  \
-//      /    \
-//     /      \
-//   v1--------\
-//     \_       \
-//        \_     \
-//           \_   \
-//              \_ \
-//                 \\
-//                   \
-//                    v2
+//    +---/\-----------+
+//    |  /  \          |
+//    | /    \         |
+//    |/      \        |
+//   v1--------\       |
+//    | \_      \      |
+//    |    \_    \     |
+//    |       \_  \    |
+//    |          \_\   |
+//    +------------\\--+
+//                  v2
 //
 ///////////////////////////////////////////////////////////////////////////////
 void draw_textured_triangle(
-	int x0, int y0, float z0, float w0, float u0, float v0,
-	int x1, int y1, float z1, float w1, float u1, float v1,
-	int x2, int y2, float z2, float w2, float u2, float v2,
-	float light, upng_t* texture
+	float x0, float y0, float z0, float w0, float u0, float v0, float l0,
+	float x1, float y1, float z1, float w1, float u1, float v1, float l1,
+	float x2, float y2, float z2, float w2, float u2, float v2, float l2,
+	texture_sampler_t* sampler,
+	shadow_map_t* shadow_map, triangle_shadow_t* shadow,
+	int y_min, int y_max
 ) {
-	// Get the mesh texture width and height dimensions
-	int texture_width = upng_get_width(texture);
-	int texture_height = upng_get_height(texture);
-	
-	// Create texture buffer from the mesh texture
-	uint32_t* texture_buffer = (uint32_t*)upng_get_buffer(texture);
-
-	// We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-		float_swap(&u0, &u1);
-		float_swap(&v0, &v1);
+	// Snap the screen positions to the subpixel grid
+	int x[3] = { snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2) };
+	int y[3] = { snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2) };
+
+	// Shadow map positions and shadowed lights of the vertices (only used with a shadow map)
+	float shadow_x[3] = { 0, 0, 0 };
+	float shadow_y[3] = { 0, 0, 0 };
+	float shadow_depth[3] = { 0, 0, 0 };
+	float shadowed_l[3] = { l0, l1, l2 };
+	if (shadow_map) {
+		for (int i = 0; i < 3; i++) {
+			shadow_x[i] = shadow->position[i].x;
+			shadow_y[i] = shadow->position[i].y;
+			shadow_depth[i] = shadow->position[i].z;
+			shadowed_l[i] = shadow->light[i];
+		}
 	}
-	if (y1 > y2) {
-		int_swap(&y1, &y2);
-		int_swap(&x1, &x2);
+
+	// Swap B and C if the triangle is wound the other way (culling can be turned off)
+	if (edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]) < 0) {
+		int_swap(&x[1], &x[2]);
+		int_swap(&y[1], &y[2]);
+		float_swap(&x1, &x2);
+		float_swap(&y1, &y2);
 		float_swap(&z1, &z2);
 		float_swap(&w1, &w2);
 		float_swap(&u1, &u2);
 		float_swap(&v1, &v2);
+		float_swap(&l1, &l2);
+		float_swap(&shadow_x[1], &shadow_x[2]);
+		float_swap(&shadow_y[1], &shadow_y[2]);
+		float_swap(&shadow_depth[1], &shadow_depth[2]);
+		float_swap(&shadowed_l[1], &shadowed_l[2]);
 	}
-	if (y0 > y1) {
-		int_swap(&y0, &y1);
-		int_swap(&x0, &x1);
-		float_swap(&z0, &z1);
-		float_swap(&w0, &w1);
-		float_swap(&u0, &u1);
-		float_swap(&v0, &v1);
+
+	triangle_edges_t edges;
+	if (!setup_triangle_edges(&edges, x, y, get_window_width(), y_min, y_max)) {
+		return;
 	}
 
 	// Flip the V component to account for inverted UV-coordinates
@@ -338,62 +374,335 @@ void draw_textured_triangle(
 	v1 = 1.0 - v1;
 	v2 = 1.0 - v2;
 
-	// Create vector points and texture coords after we sort the vertices
-	vec4_t point_a = { x0, y0, z0, w0 };
-	vec4_t point_b = { x1, y1, z1, w1 };
-	vec4_t point_c = { x2, y2, z2, w2 };
-	tex2_t a_uv = { u0, v0 };
-	tex2_t b_uv = { u1, v1 };
-	tex2_t c_uv = { u2, v2 };
-
-	///////////////////////////////////////////////////////
-	// Render the upper part of the triangle (flat-bottom)
-	///////////////////////////////////////////////////////
-	float inv_slope_1 = 0;
-	float inv_slope_2 = 0;
-
-	if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-	if (y1 - y0 != 0) {
-		for (int y = y0; y <= y1; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
-
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+	// Set up the planes of 1/w, U/w, V/w and the light after we wind the vertices
+	attribute_plane_t reciprocal_w_plane = setup_attribute_plane(&edges, 1 / w0, 1 / w1, 1 / w2);
+	attribute_plane_t u_over_w_plane = setup_attribute_plane(&edges, u0 / w0, u1 / w1, u2 / w2);
+	attribute_plane_t v_over_w_plane = setup_attribute_plane(&edges, v0 / w0, v1 / w1, v2 / w2);
+	attribute_plane_t light_plane = setup_attribute_plane(&edges, l0, l1, l2);
+
+	// The shadow map position is divided by w like U and V, the shadowed light is stepped like the light
+	attribute_plane_t shadow_x_over_w_plane = setup_attribute_plane(&edges, shadow_x[0] / w0, shadow_x[1] / w1, shadow_x[2] / w2);
+	attribute_plane_t shadow_y_over_w_plane = setup_attribute_plane(&edges, shadow_y[0] / w0, shadow_y[1] / w1, shadow_y[2] / w2);
+	attribute_plane_t shadow_depth_over_w_plane = setup_attribute_plane(&edges, shadow_depth[0] / w0, shadow_depth[1] / w1, shadow_depth[2] / w2);
+	attribute_plane_t shadowed_light_plane = setup_attribute_plane(&edges, shadowed_l[0], shadowed_l[1], shadowed_l[2]);
+
+	for (int y = edges.y_min; y <= edges.y_max; y++) {
+		int e0 = edges.w_row[0];
+		int e1 = edges.w_row[1];
+		int e2 = edges.w_row[2];
+		float reciprocal_w = get_attribute_at(&reciprocal_w_plane, edges.w_row, edges.inv_area);
+		float u_over_w = get_attribute_at(&u_over_w_plane, edges.w_row, edges.inv_area);
+		float v_over_w = get_attribute_at(&v_over_w_plane, edges.w_row, edges.inv_area);
+		float light = get_attribute_at(&light_plane, edges.w_row, edges.inv_area);
+		float shadow_x_over_w = get_attribute_at(&shadow_x_over_w_plane, edges.w_row, edges.inv_area);
+		float shadow_y_over_w = get_attribute_at(&shadow_y_over_w_plane, edges.w_row, edges.inv_area);
+		float shadow_depth_over_w = get_attribute_at(&shadow_depth_over_w_plane, edges.w_row, edges.inv_area);
+		float shadowed_light = get_attribute_at(&shadowed_light_plane, edges.w_row, edges.inv_area);
+		for (int x = edges.x_min; x <= edges.x_max; x++) {
+			if (e0 >= edges.bias[0] && e1 >= edges.bias[1] && e2 >= edges.bias[2]) {
+				draw_triangle_texel(
+					x, y, light, sampler, u_over_w, v_over_w, reciprocal_w,
+					shadow_map, shadowed_light, shadow_x_over_w, shadow_y_over_w, shadow_depth_over_w
+				);
 			}
+			e0 += edges.step_x[0];
+			e1 += edges.step_x[1];
+			e2 += edges.step_x[2];
+			reciprocal_w += reciprocal_w_plane.step_x;
+			u_over_w += u_over_w_plane.step_x;
+			v_over_w += v_over_w_plane.step_x;
+			light += light_plane.step_x;
+			shadow_x_over_w += shadow_x_over_w_plane.step_x;
+			shadow_y_over_w += shadow_y_over_w_plane.step_x;
+			shadow_depth_over_w += shadow_depth_over_w_plane.step_x;
+			shadowed_light += shadowed_light_plane.step_x;
+		}
+		edges.w_row[0] += edges.step_y[0];
+		edges.w_row[1] += edges.step_y[1];
+		edges.w_row[2] += edges.step_y[2];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw the depth and the id of a triangle (first pass of TEXTURING_DEFERRED)
+///////////////////////////////////////////////////////////////////////////////
+// Only the z-buffer and the visibility buffer are written, the triangle is
+// textured later by resolve_visibility_buffer() where it is still visible.
+///////////////////////////////////////////////////////////////////////////////
+void draw_visibility_triangle(
+	float x0, float y0, float w0,
+	float x1, float y1, float w1,
+	float x2, float y2, float w2,
+	uint32_t triangle_id,
+	int y_min, int y_max
+) {
+	// Snap the screen positions to the subpixel grid
+	int x[3] = { snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2) };
+	int y[3] = { snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2) };
+
+	// Swap B and C if the triangle is wound the other way (culling can be turned off)
+	if (edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]) < 0) {
+		int_swap(&x[1], &x[2]);
+		int_swap(&y[1], &y[2]);
+		float_swap(&w1, &w2);
+	}
 
-			for (int x = x_start; x < x_end; x++) {
-				// Draw our pixel with the color that comes from the texture
-				draw_triangle_texel(x, y, light, texture_buffer, texture_width, texture_height, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+	triangle_edges_t edges;
+	if (!setup_triangle_edges(&edges, x, y, get_window_width(), y_min, y_max)) {
+		return;
+	}
+	attribute_plane_t reciprocal_w_plane = setup_attribute_plane(&edges, 1 / w0, 1 / w1, 1 / w2);
+
+	for (int y = edges.y_min; y <= edges.y_max; y++) {
+		int e0 = edges.w_row[0];
+		int e1 = edges.w_row[1];
+		int e2 = edges.w_row[2];
+		float reciprocal_w = get_attribute_at(&reciprocal_w_plane, edges.w_row, edges.inv_area);
+		for (int x = edges.x_min; x <= edges.x_max; x++) {
+			if (e0 >= edges.bias[0] && e1 >= edges.bias[1] && e2 >= edges.bias[2]) {
+				float depth = 1.0 - reciprocal_w;
+				if (depth < get_zbuffer_at(x, y)) {
+					update_zbuffer_at(x, y, depth);
+					update_visibility_at(x, y, triangle_id);
+				}
 			}
+			e0 += edges.step_x[0];
+			e1 += edges.step_x[1];
+			e2 += edges.step_x[2];
+			reciprocal_w += reciprocal_w_plane.step_x;
 		}
+		edges.w_row[0] += edges.step_y[0];
+		edges.w_row[1] += edges.step_y[1];
+		edges.w_row[2] += edges.step_y[2];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Edges and attribute planes of the triangle being resolved
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	triangle_edges_t edges;
+	attribute_plane_t reciprocal_w;
+	attribute_plane_t u_over_w;
+	attribute_plane_t v_over_w;
+	attribute_plane_t light;
+	attribute_plane_t shadow_x_over_w;
+	attribute_plane_t shadow_y_over_w;
+	attribute_plane_t shadow_depth_over_w;
+	attribute_plane_t shadowed_light;
+} resolve_triangle_t;
+
+static void setup_resolve_triangle(resolve_triangle_t* resolve, triangle_t* triangle) {
+	int x[3], y[3];
+	float w[3], u[3], v[3], l[3];
+	float shadow_x[3], shadow_y[3], shadow_depth[3], shadowed_l[3];
+	for (int i = 0; i < 3; i++) {
+		x[i] = snap_to_subpixel(triangle->points[i].x);
+		y[i] = snap_to_subpixel(triangle->points[i].y);
+		w[i] = triangle->points[i].w;
+		u[i] = triangle->texcoords[i].u;
+		v[i] = 1.0 - triangle->texcoords[i].v; // Flip the V component to account for inverted UV-coordinates
+		l[i] = triangle->light[i];
+		shadow_x[i] = triangle->shadow.position[i].x;
+		shadow_y[i] = triangle->shadow.position[i].y;
+		shadow_depth[i] = triangle->shadow.position[i].z;
+		shadowed_l[i] = triangle->shadow.light[i];
+	}
+
+	// Wind the vertices the same way as draw_visibility_triangle()
+	if (edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]) < 0) {
+		int_swap(&x[1], &x[2]);
+		int_swap(&y[1], &y[2]);
+		float_swap(&w[1], &w[2]);
+		float_swap(&u[1], &u[2]);
+		float_swap(&v[1], &v[2]);
+		float_swap(&l[1], &l[2]);
+		float_swap(&shadow_x[1], &shadow_x[2]);
+		float_swap(&shadow_y[1], &shadow_y[2]);
+		float_swap(&shadow_depth[1], &shadow_depth[2]);
+		float_swap(&shadowed_l[1], &shadowed_l[2]);
+	}
+
+	// The triangle covers a visible pixel, so its bounding box is never empty
+	setup_triangle_edges(&resolve->edges, x, y, get_window_width(), 0, get_window_height() - 1);
+	resolve->reciprocal_w = setup_attribute_plane(&resolve->edges, 1 / w[0], 1 / w[1], 1 / w[2]);
+	resolve->u_over_w = setup_attribute_plane(&resolve->edges, u[0] / w[0], u[1] / w[1], u[2] / w[2]);
+	resolve->v_over_w = setup_attribute_plane(&resolve->edges, v[0] / w[0], v[1] / w[1], v[2] / w[2]);
+	resolve->light = setup_attribute_plane(&resolve->edges, l[0], l[1], l[2]);
+	resolve->shadow_x_over_w = setup_attribute_plane(&resolve->edges, shadow_x[0] / w[0], shadow_x[1] / w[1], shadow_x[2] / w[2]);
+	resolve->shadow_y_over_w = setup_attribute_plane(&resolve->edges, shadow_y[0] / w[0], shadow_y[1] / w[1], shadow_y[2] / w[2]);
+	resolve->shadow_depth_over_w = setup_attribute_plane(&resolve->edges, shadow_depth[0] / w[0], shadow_depth[1] / w[1], shadow_depth[2] / w[2]);
+	resolve->shadowed_light = setup_attribute_plane(&resolve->edges, shadowed_l[0], shadowed_l[1], shadowed_l[2]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture every visible pixel of the rows y_min to y_max once (second pass
+// of TEXTURING_DEFERRED)
+///////////////////////////////////////////////////////////////////////////////
+// Every row is split into spans of pixels with the same triangle id. The
+// attributes are evaluated at the start of a span from the exact edge values
+// and stepped along it like in draw_textured_triangle(). Small triangles
+// cover short spans on many rows, so the set up triangles are kept in a small
+// cache indexed by the low bits of the id. The triangles and samplers are the
+// ones the visibility ids were drawn with (id - 1 is the index of the triangle).
+// Shadows are looked up when a shadow map is given.
+///////////////////////////////////////////////////////////////////////////////
+void resolve_visibility_buffer(triangle_t* triangles, texture_sampler_t* samplers, shadow_map_t* shadow_map, int y_min, int y_max) {
+	int width = get_window_width();
+	resolve_triangle_t resolve_cache[RESOLVE_CACHE_SIZE];
+	uint32_t resolve_cache_ids[RESOLVE_CACHE_SIZE];
+	for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+		resolve_cache_ids[i] = VISIBILITY_EMPTY;
 	}
 
-	///////////////////////////////////////////////////////
-	// Render the bottom part of the triangle (flat-top)
-	///////////////////////////////////////////////////////
-	inv_slope_1 = 0;
-	inv_slope_2 = 0;
+	for (int y = y_min; y <= y_max; y++) {
+		int x = 0;
+		while (x < width) {
+			uint32_t id = get_visibility_at(x, y);
+			if (id == VISIBILITY_EMPTY) {
+				x++;
+				continue;
+			}
+			int slot = id & (RESOLVE_CACHE_SIZE - 1);
+			resolve_triangle_t* resolve = &resolve_cache[slot];
+			if (resolve_cache_ids[slot] != id) {
+				setup_resolve_triangle(resolve, &triangles[id - 1]);
+				resolve_cache_ids[slot] = id;
+			}
+			texture_sampler_t* sampler = &samplers[id - 1];
 
-	if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-	if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+			// Edge values at the first pixel of the span
+			triangle_edges_t* edges = &resolve->edges;
+			int edge_values[3];
+			for (int i = 0; i < 3; i++) {
+				edge_values[i] = edges->w_row[i] + (x - edges->x_min) * edges->step_x[i] + (y - edges->y_min) * edges->step_y[i];
+			}
+			float reciprocal_w = get_attribute_at(&resolve->reciprocal_w, edge_values, edges->inv_area);
+			float u_over_w = get_attribute_at(&resolve->u_over_w, edge_values, edges->inv_area);
+			float v_over_w = get_attribute_at(&resolve->v_over_w, edge_values, edges->inv_area);
+			float light = get_attribute_at(&resolve->light, edge_values, edges->inv_area);
+			float shadow_x_over_w = get_attribute_at(&resolve->shadow_x_over_w, edge_values, edges->inv_area);
+			float shadow_y_over_w = get_attribute_at(&resolve->shadow_y_over_w, edge_values, edges->inv_area);
+			float shadow_depth_over_w = get_attribute_at(&resolve->shadow_depth_over_w, edge_values, edges->inv_area);
+			float shadowed_light = get_attribute_at(&resolve->shadowed_light, edge_values, edges->inv_area);
+
+			do {
+				float w = 1 / reciprocal_w;
+				uint32_t color = sample_texture(sampler, u_over_w * w, v_over_w * w);
+				float pixel_light = light;
+				if (shadow_map) {
+					pixel_light = get_shadowed_light(shadow_map, light, shadowed_light, shadow_x_over_w * w, shadow_y_over_w * w, shadow_depth_over_w * w);
+				}
+				draw_pixel(x, y, apply_light_intensity(color, pixel_light));
+				reciprocal_w += resolve->reciprocal_w.step_x;
+				u_over_w += resolve->u_over_w.step_x;
+				v_over_w += resolve->v_over_w.step_x;
+				light += resolve->light.step_x;
+				shadow_x_over_w += resolve->shadow_x_over_w.step_x;
+				shadow_y_over_w += resolve->shadow_y_over_w.step_x;
+				shadow_depth_over_w += resolve->shadow_depth_over_w.step_x;
+				shadowed_light += resolve->shadowed_light.step_x;
+				x++;
+			} while (x < width && get_visibility_at(x, y) == id);
+		}
+	}
+}
 
-	if (y2 - y1 != 0) {
-		for (int y = y1; y <= y2; y++) {
-			int x_start = x1 + (y - y1) * inv_slope_1;
-			int x_end = x0 + (y - y0) * inv_slope_2;
+///////////////////////////////////////////////////////////////////////////////
+// Draw the depth of a triangle into a depth buffer of its own (shadow maps)
+///////////////////////////////////////////////////////////////////////////////
+// Only the depth is interpolated and tested, without perspective since the
+// shadow map projection is orthographic. With SSE2 four pixels of a row are
+// tested against the three edges and the buffer at a time, the pixels left
+// at the end of a row go through the scalar loop. Both windings are drawn,
+// the caller picks which faces to draw.
+///////////////////////////////////////////////////////////////////////////////
+void draw_depth_triangle(
+	float x0, float y0, float z0,
+	float x1, float y1, float z1,
+	float x2, float y2, float z2,
+	float* depth_buffer, int width,
+	int y_min, int y_max
+) {
+	// Snap the positions to the subpixel grid
+	int x[3] = { snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2) };
+	int y[3] = { snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2) };
+
+	// Swap B and C if the triangle is wound the other way
+	if (edge_cross(x[0], y[0], x[1], y[1], x[2], y[2]) < 0) {
+		int_swap(&x[1], &x[2]);
+		int_swap(&y[1], &y[2]);
+		float_swap(&z1, &z2);
+	}
 
-			if (x_end < x_start) {
-				int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+	triangle_edges_t edges;
+	if (!setup_triangle_edges(&edges, x, y, width, y_min, y_max)) {
+		return;
+	}
+	attribute_plane_t depth_plane = setup_attribute_plane(&edges, z0, z1, z2);
+
+#if defined(__SSE2__)
+	// Edge and depth offsets of the four pixels of a group, and the steps to the next group
+	__m128i edge_offset[3], edge_step[3], edge_limit[3];
+	for (int i = 0; i < 3; i++) {
+		int step = edges.step_x[i];
+		edge_offset[i] = _mm_set_epi32(step * 3, step * 2, step, 0);
+		edge_step[i] = _mm_set1_epi32(step * 4);
+		edge_limit[i] = _mm_set1_epi32(edges.bias[i] - 1);
+	}
+	float depth_step = depth_plane.step_x;
+	__m128 depth_offset = _mm_set_ps(depth_step * 3, depth_step * 2, depth_step, 0);
+	__m128 depth_step_4 = _mm_set1_ps(depth_step * 4);
+#endif
+
+	for (int y = edges.y_min; y <= edges.y_max; y++) {
+		float* row = &depth_buffer[width * y];
+		int e0 = edges.w_row[0];
+		int e1 = edges.w_row[1];
+		int e2 = edges.w_row[2];
+		float depth = get_attribute_at(&depth_plane, edges.w_row, edges.inv_area);
+		int x = edges.x_min;
+
+#if defined(__SSE2__)
+		__m128i e0_4 = _mm_add_epi32(_mm_set1_epi32(e0), edge_offset[0]);
+		__m128i e1_4 = _mm_add_epi32(_mm_set1_epi32(e1), edge_offset[1]);
+		__m128i e2_4 = _mm_add_epi32(_mm_set1_epi32(e2), edge_offset[2]);
+		__m128 depth_4 = _mm_add_ps(_mm_set1_ps(depth), depth_offset);
+		for (; x + 3 <= edges.x_max; x += 4) {
+			__m128i inside = _mm_and_si128(
+				_mm_and_si128(_mm_cmpgt_epi32(e0_4, edge_limit[0]), _mm_cmpgt_epi32(e1_4, edge_limit[1])),
+				_mm_cmpgt_epi32(e2_4, edge_limit[2])
+			);
+			if (_mm_movemask_epi8(inside)) {
+				__m128 old_depth = _mm_loadu_ps(&row[x]);
+				__m128 write = _mm_and_ps(_mm_castsi128_ps(inside), _mm_cmplt_ps(depth_4, old_depth));
+				_mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(write, depth_4), _mm_andnot_ps(write, old_depth)));
 			}
+			e0_4 = _mm_add_epi32(e0_4, edge_step[0]);
+			e1_4 = _mm_add_epi32(e1_4, edge_step[1]);
+			e2_4 = _mm_add_epi32(e2_4, edge_step[2]);
+			depth_4 = _mm_add_ps(depth_4, depth_step_4);
+		}
+
+		// The scalar loop continues from the first pixel of the next group
+		e0 = _mm_cvtsi128_si32(e0_4);
+		e1 = _mm_cvtsi128_si32(e1_4);
+		e2 = _mm_cvtsi128_si32(e2_4);
+		depth = _mm_cvtss_f32(depth_4);
+#endif
 
-			for (int x = x_start; x < x_end; x++) {
-				// Draw our pixel with the color that comes from the texture
-				draw_triangle_texel(x, y, light, texture_buffer, texture_width, texture_height, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+		for (; x <= edges.x_max; x++) {
+			if (e0 >= edges.bias[0] && e1 >= edges.bias[1] && e2 >= edges.bias[2] && depth < row[x]) {
+				row[x] = depth;
 			}
+			e0 += edges.step_x[0];
+			e1 += edges.step_x[1];
+			e2 += edges.step_x[2];
+			depth += depth_plane.step_x;
 		}
+		edges.w_row[0] += edges.step_y[0];
+		edges.w_row[1] += edges.step_y[1];
+		edges.w_row[2] += edges.step_y[2];
 	}
 }
 
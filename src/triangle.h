@@ -1,44 +1,75 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "texture.h"
 #include "vector.h"
 #include "upng.h"
 #include "light.h"
+#include "shadow.h"
 
+// Directional light shadow of a triangle, looked up per pixel in the shadow map
 typedef struct {
-	int a;
-	int b;
-	int c;
-	tex2_t a_uv;
-	tex2_t b_uv;
-	tex2_t c_uv;
-} face_t;
+	vec3_t position[3];    // Shadow map position of the vertices (texel x, texel y, depth)
+	float light[3];        // Light intensity at the vertices where the directional light is shadowed
+} triangle_shadow_t;
 
 typedef struct {
 	vec4_t points[3];
 	tex2_t texcoords[3];
-	float light;
-	upng_t* texture;
+	float light[3];        // Light intensity at the vertices, interpolated across the triangle
+	triangle_shadow_t shadow;
+	texture_t* texture;
+	int texture_filter;
 } triangle_t;
 
+// Screen positions are snapped to 28.4 fixed point before rasterization
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+
+// Triangles kept set up while resolving the visibility buffer of a tile (power of two)
+#define RESOLVE_CACHE_SIZE 256
+
 vec3_t get_triangle_normal(vec4_t vertices[3]);
 
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+texture_sampler_t get_triangle_texture_sampler(triangle_t* triangle);
+
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, int y_min, int y_max);
 
 void draw_filled_triangle(
-	int x0, int y0, float z0, float w0, 
-	int x1, int y1, float z1, float w1, 
-	int x2, int y2, float z2, float w2, 
-	float light, uint32_t color
+	float x0, float y0, float z0, float w0, float l0,
+	float x1, float y1, float z1, float w1, float l1,
+	float x2, float y2, float z2, float w2, float l2,
+	uint32_t color,
+	int y_min, int y_max
 );
 
 void draw_textured_triangle(
-	int x0, int y0, float z0, float w0, float u0, float v0, 
-	int x1, int y1, float z1, float w1, float u1, float v1, 
-	int x2, int y2, float z2, float w2, float u2, float v2,
-	float light, upng_t* texture
+	float x0, float y0, float z0, float w0, float u0, float v0, float l0,
+	float x1, float y1, float z1, float w1, float u1, float v1, float l1,
+	float x2, float y2, float z2, float w2, float u2, float v2, float l2,
+	texture_sampler_t* sampler,
+	shadow_map_t* shadow_map, triangle_shadow_t* shadow,
+	int y_min, int y_max
+);
+
+void draw_visibility_triangle(
+	float x0, float y0, float w0,
+	float x1, float y1, float w1,
+	float x2, float y2, float w2,
+	uint32_t triangle_id,
+	int y_min, int y_max
+);
+
+void resolve_visibility_buffer(triangle_t* triangles, texture_sampler_t* samplers, shadow_map_t* shadow_map, int y_min, int y_max);
+
+void draw_depth_triangle(
+	float x0, float y0, float z0,
+	float x1, float y1, float z1,
+	float x2, float y2, float z2,
+	float* depth_buffer, int width,
+	int y_min, int y_max
 );
 
 #endif
\ No newline at end of file
@@ -28,6 +28,14 @@ freely, subject to the following restrictions:
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 #include "upng.h"
 
@@ -47,14 +55,14 @@ freely, subject to the following restrictions:
 #define NUM_CODE_LENGTH_CODES 19	/*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros */
 #define MAX_SYMBOLS 288 /* largest number of symbols used by any tree type */
 
-#define DEFLATE_CODE_BITLEN 15
-#define DISTANCE_BITLEN 15
-#define CODE_LENGTH_BITLEN 7
 #define MAX_BIT_LENGTH 15 /* largest bitlen used by any tree type */
 
-#define DEFLATE_CODE_BUFFER_SIZE (NUM_DEFLATE_CODE_SYMBOLS * 2)
-#define DISTANCE_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
-#define CODE_LENGTH_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
+#define HUFFMAN_ROOT_BITS 10 /* bits looked up at once in the root decoding table, longer codes continue in a subtable */
+#define HUFFMAN_TABLE_SIZE(numcodes) ((1 << HUFFMAN_ROOT_BITS) + ((numcodes) << (MAX_BIT_LENGTH - HUFFMAN_ROOT_BITS))) /* root table and at most one subtable per code */
+#define HUFFMAN_ENTRY(value, bits) (((unsigned)(bits) << 16) | (unsigned)(value))
+#define HUFFMAN_ENTRY_VALUE(entry) ((entry) & 0xFFFF)
+#define HUFFMAN_ENTRY_BITS(entry) (((entry) >> 16) & 0x1F)
+#define HUFFMAN_LINK 0x1000000
 
 #define SET_ERROR(upng,code) do { (upng)->error = (code); (upng)->error_line = __LINE__; } while (0)
 
@@ -100,11 +108,23 @@ struct upng_t {
 	upng_source		source;
 };
 
-typedef struct huffman_tree {
-	unsigned* tree2d;
-	unsigned maxbitlen;	/*maximum number of bits a single code can get */
-	unsigned numcodes;	/*number of symbols in the alphabet = number of codes */
-} huffman_tree;
+/*huffman decoding table: a root table indexed by the next root_bits bits of the input, plus subtables for the longer codes.
+   deflate stores huffman codes starting with their most significant bit, so the table is indexed with the codes bit-reversed.
+   an entry holds the symbol (or the subtable offset) in bits 0-15 and the number of bits to consume (or the subtable index bits)
+   in bits 16-20; bit 24 marks a link to a subtable. an entry of 0 is a code that doesn't exist in an incomplete tree */
+typedef struct huffman_table {
+	unsigned* entries;
+	unsigned root_bits;	/*number of bits used to index the root table */
+} huffman_table;
+
+/*bit reader over the deflate stream, keeps up to 64 bits buffered so most symbols are decoded with a single table lookup */
+typedef struct bit_reader {
+	const unsigned char* data;
+	unsigned long size;	/*size of the deflate stream in bytes */
+	unsigned long pos;	/*next byte to move into the bit buffer (may run past the end, the missing bytes read as 0) */
+	uint64_t buffer;	/*buffered bits, the next bit of the stream is the lsb */
+	unsigned count;	/*number of valid bits in the buffer */
+} bit_reader;
 
 static const unsigned LENGTH_BASE[29] = {	/*the base lengths represented by codes 257-285 */
 	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
@@ -129,204 +149,211 @@ static const unsigned DISTANCE_EXTRA[30] = {	/*the extra bits of backwards dista
 static const unsigned CLCL[NUM_CODE_LENGTH_CODES]	/*the order in which "code length alphabet code lengths" are stored, out of this the huffman tree of the dynamic huffman tree lengths is generated */
 = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
-	289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0, 1,
-	2, 3, 298, 299, 4, 5, 6, 7, 301, 304, 302, 303, 8, 9, 10, 11, 305, 306, 12,
-	13, 14, 15, 308, 339, 309, 324, 310, 317, 311, 314, 312, 313, 16, 17, 18,
-	19, 315, 316, 20, 21, 22, 23, 318, 321, 319, 320, 24, 25, 26, 27, 322, 323,
-	28, 29, 30, 31, 325, 332, 326, 329, 327, 328, 32, 33, 34, 35, 330, 331, 36,
-	37, 38, 39, 333, 336, 334, 335, 40, 41, 42, 43, 337, 338, 44, 45, 46, 47,
-	340, 355, 341, 348, 342, 345, 343, 344, 48, 49, 50, 51, 346, 347, 52, 53,
-	54, 55, 349, 352, 350, 351, 56, 57, 58, 59, 353, 354, 60, 61, 62, 63, 356,
-	363, 357, 360, 358, 359, 64, 65, 66, 67, 361, 362, 68, 69, 70, 71, 364,
-	367, 365, 366, 72, 73, 74, 75, 368, 369, 76, 77, 78, 79, 371, 434, 372,
-	403, 373, 388, 374, 381, 375, 378, 376, 377, 80, 81, 82, 83, 379, 380, 84,
-	85, 86, 87, 382, 385, 383, 384, 88, 89, 90, 91, 386, 387, 92, 93, 94, 95,
-	389, 396, 390, 393, 391, 392, 96, 97, 98, 99, 394, 395, 100, 101, 102, 103,
-	397, 400, 398, 399, 104, 105, 106, 107, 401, 402, 108, 109, 110, 111, 404,
-	419, 405, 412, 406, 409, 407, 408, 112, 113, 114, 115, 410, 411, 116, 117,
-	118, 119, 413, 416, 414, 415, 120, 121, 122, 123, 417, 418, 124, 125, 126,
-	127, 420, 427, 421, 424, 422, 423, 128, 129, 130, 131, 425, 426, 132, 133,
-	134, 135, 428, 431, 429, 430, 136, 137, 138, 139, 432, 433, 140, 141, 142,
-	143, 435, 483, 436, 452, 568, 437, 438, 445, 439, 442, 440, 441, 144, 145,
-	146, 147, 443, 444, 148, 149, 150, 151, 446, 449, 447, 448, 152, 153, 154,
-	155, 450, 451, 156, 157, 158, 159, 453, 468, 454, 461, 455, 458, 456, 457,
-	160, 161, 162, 163, 459, 460, 164, 165, 166, 167, 462, 465, 463, 464, 168,
-	169, 170, 171, 466, 467, 172, 173, 174, 175, 469, 476, 470, 473, 471, 472,
-	176, 177, 178, 179, 474, 475, 180, 181, 182, 183, 477, 480, 478, 479, 184,
-	185, 186, 187, 481, 482, 188, 189, 190, 191, 484, 515, 485, 500, 486, 493,
-	487, 490, 488, 489, 192, 193, 194, 195, 491, 492, 196, 197, 198, 199, 494,
-	497, 495, 496, 200, 201, 202, 203, 498, 499, 204, 205, 206, 207, 501, 508,
-	502, 505, 503, 504, 208, 209, 210, 211, 506, 507, 212, 213, 214, 215, 509,
-	512, 510, 511, 216, 217, 218, 219, 513, 514, 220, 221, 222, 223, 516, 531,
-	517, 524, 518, 521, 519, 520, 224, 225, 226, 227, 522, 523, 228, 229, 230,
-	231, 525, 528, 526, 527, 232, 233, 234, 235, 529, 530, 236, 237, 238, 239,
-	532, 539, 533, 536, 534, 535, 240, 241, 242, 243, 537, 538, 244, 245, 246,
-	247, 540, 543, 541, 542, 248, 249, 250, 251, 544, 545, 252, 253, 254, 255,
-	547, 554, 548, 551, 549, 550, 256, 257, 258, 259, 552, 553, 260, 261, 262,
-	263, 555, 558, 556, 557, 264, 265, 266, 267, 559, 560, 268, 269, 270, 271,
-	562, 565, 563, 564, 272, 273, 274, 275, 566, 567, 276, 277, 278, 279, 569,
-	572, 570, 571, 280, 281, 282, 283, 573, 574, 284, 285, 286, 287, 0, 0
-};
+static void bit_reader_init(bit_reader* reader, const unsigned char* data, unsigned long size)
+{
+	reader->data = data;
+	reader->size = size;
+	reader->pos = 0;
+	reader->buffer = 0;
+	reader->count = 0;
+}
 
-static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
-	33, 48, 34, 41, 35, 38, 36, 37, 0, 1, 2, 3, 39, 40, 4, 5, 6, 7, 42, 45, 43,
-	44, 8, 9, 10, 11, 46, 47, 12, 13, 14, 15, 49, 56, 50, 53, 51, 52, 16, 17,
-	18, 19, 54, 55, 20, 21, 22, 23, 57, 60, 58, 59, 24, 25, 26, 27, 61, 62, 28,
-	29, 30, 31, 0, 0
-};
+/*top up the bit buffer to at least 57 bits*/
+static void bit_reader_refill(bit_reader* reader)
+{
+	if (reader->pos + 8 <= reader->size) {
+		/*load 8 bytes at once and keep the whole bytes that fit, the bits of the partial byte above count are the same bits the next refill loads */
+		const unsigned char* p = reader->data + reader->pos;
+		uint64_t word = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+			| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+		reader->buffer |= word << reader->count;
+		reader->pos += (63 - reader->count) >> 3;
+		reader->count |= 56;
+	} else {
+		/*close to the end of the stream: bytes past the end read as 0, reading them is detected by bit_reader_overrun */
+		while (reader->count <= 56) {
+			if (reader->pos < reader->size) {
+				reader->buffer |= (uint64_t)reader->data[reader->pos] << reader->count;
+			}
+			reader->pos++;
+			reader->count += 8;
+		}
+	}
+}
 
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+static void bit_reader_consume(bit_reader* reader, unsigned nbits)
 {
-	unsigned char result = (unsigned char)((bitstream[(*bitpointer) >> 3] >> ((*bitpointer) & 0x7)) & 1);
-	(*bitpointer)++;
-	return result;
+	reader->buffer >>= nbits;
+	reader->count -= nbits;
 }
 
-static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream, unsigned long nbits)
+/*whether more bits were consumed than the stream holds*/
+static int bit_reader_overrun(const bit_reader* reader)
 {
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
-		result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
-	return result;
+	return reader->pos * 8 - reader->count > reader->size * 8;
 }
 
-/* the buffer must be numcodes*2 in size! */
-static void huffman_tree_init(huffman_tree* tree, unsigned* buffer, unsigned numcodes, unsigned maxbitlen)
+static unsigned read_bits(upng_t* upng, bit_reader* reader, unsigned nbits)
 {
-	tree->tree2d = buffer;
+	unsigned result;
+
+	if (reader->count < nbits) {
+		bit_reader_refill(reader);
+	}
+
+	result = (unsigned)(reader->buffer & (((uint64_t)1 << nbits) - 1));
+	bit_reader_consume(reader, nbits);
+
+	/* error, bit pointer jumped past memory */
+	if (bit_reader_overrun(reader)) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
+	return result;
+}
 
-	tree->numcodes = numcodes;
-	tree->maxbitlen = maxbitlen;
+static unsigned reverse_bits(unsigned code, unsigned nbits)
+{
+	unsigned result = 0, i;
+	for (i = 0; i < nbits; i++) {
+		result = (result << 1) | ((code >> i) & 1);
+	}
+	return result;
 }
 
-/*given the code lengths (as stored in the PNG file), generate the tree as defined by Deflate. maxbitlen is the maximum bits that a code in the tree can have. return value is error.*/
-static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, const unsigned *bitlen)
+/*given the code lengths (as stored in the PNG file), generate the decoding table as defined by Deflate. the buffer must be HUFFMAN_TABLE_SIZE(numcodes) in size! */
+static void huffman_table_create_lengths(upng_t* upng, huffman_table* table, unsigned* buffer, const unsigned *bitlen, unsigned numcodes)
 {
-	unsigned tree1d[MAX_SYMBOLS];
-	unsigned blcount[MAX_BIT_LENGTH];
-	unsigned nextcode[MAX_BIT_LENGTH+1];
+	unsigned blcount[MAX_BIT_LENGTH + 1];
+	unsigned nextcode[MAX_BIT_LENGTH + 1];
 	unsigned bits, n, i;
-	unsigned nodefilled = 0;	/*up to which node it is filled */
-	unsigned treepos = 0;	/*position in the tree (1 of the numcodes columns) */
+	unsigned maxbitlen = 0, sub_bits, next_subtable;
+	int left = 1;
 
 	/* initialize local vectors */
 	memset(blcount, 0, sizeof(blcount));
 	memset(nextcode, 0, sizeof(nextcode));
 
 	/*step 1: count number of instances of each code length */
-	for (bits = 0; bits < tree->numcodes; bits++) {
-		blcount[bitlen[bits]]++;
+	for (n = 0; n < numcodes; n++) {
+		blcount[bitlen[n]]++;
+		if (bitlen[n] > maxbitlen) {
+			maxbitlen = bitlen[n];
+		}
 	}
+	blcount[0] = 0;
 
-	/*step 2: generate the nextcode values */
-	for (bits = 1; bits <= tree->maxbitlen; bits++) {
-		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+	/*check if oversubscribed, incomplete codes are allowed (an unused code is an error when it is decoded) */
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		left = (left << 1) - (int)blcount[bits];
+		if (left < 0) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
 	}
 
-	/*step 3: generate all the codes */
-	for (n = 0; n < tree->numcodes; n++) {
-		if (bitlen[n] != 0) {
-			tree1d[n] = nextcode[bitlen[n]]++;
-		}
+	/*step 2: generate the nextcode values */
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
 	}
 
-	/*convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means uninited, a value >= numcodes is an address to another bit, a value < numcodes is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as many columns as codes - 1
-	   a good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes. Here, the internal nodes are stored (what their 0 and 1 option point to). There is only memory for such good tree currently, if there are more nodes (due to too long length codes), error 55 will happen */
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		tree->tree2d[n] = 32767;	/*32767 here means the tree2d isn't filled there yet */
+	/*step 3: generate all the codes and fill the table, short codes are replicated in all the entries that start with them */
+	table->entries = buffer;
+	table->root_bits = maxbitlen < HUFFMAN_ROOT_BITS ? maxbitlen : HUFFMAN_ROOT_BITS;
+	if (table->root_bits == 0) {
+		table->root_bits = 1;	/*empty tree, every entry is invalid */
 	}
+	sub_bits = maxbitlen > table->root_bits ? maxbitlen - table->root_bits : 0;
+	next_subtable = 1u << table->root_bits;
+	memset(buffer, 0, sizeof(unsigned) << table->root_bits);
+
+	for (n = 0; n < numcodes; n++) {
+		unsigned length = bitlen[n], code;
+		if (length == 0) {
+			continue;
+		}
 
-	for (n = 0; n < tree->numcodes; n++) {	/*the codes */
-		for (i = 0; i < bitlen[n]; i++) {	/*the bits for this code */
-			unsigned char bit = (unsigned char)((tree1d[n] >> (bitlen[n] - i - 1)) & 1);
-			/* check if oversubscribed */
-			if (treepos > tree->numcodes - 2) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
+		code = reverse_bits(nextcode[length]++, length);
+		if (length <= table->root_bits) {
+			for (i = code; i < (1u << table->root_bits); i += 1u << length) {
+				buffer[i] = HUFFMAN_ENTRY(n, length);
 			}
-
-			if (tree->tree2d[2 * treepos + bit] == 32767) {	/*not yet filled in */
-				if (i + 1 == bitlen[n]) {	/*last bit */
-					tree->tree2d[2 * treepos + bit] = n;	/*put the current code in it */
-					treepos = 0;
-				} else {	/*put address of the next step in here, first that address has to be found of course (it's just nodefilled + 1)... */
-					nodefilled++;
-					tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;	/*addresses encoded with numcodes added to it */
-					treepos = nodefilled;
-				}
-			} else {
-				treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
+		} else {
+			/*long code: the root entry of its first root_bits bits links to a subtable indexed by the remaining bits */
+			unsigned root = code & ((1u << table->root_bits) - 1);
+			unsigned offset;
+			if ((buffer[root] & HUFFMAN_LINK) == 0) {
+				buffer[root] = HUFFMAN_LINK | HUFFMAN_ENTRY(next_subtable, sub_bits);
+				memset(&buffer[next_subtable], 0, sizeof(unsigned) << sub_bits);
+				next_subtable += 1u << sub_bits;
+			}
+			offset = HUFFMAN_ENTRY_VALUE(buffer[root]);
+			for (i = code >> table->root_bits; i < (1u << sub_bits); i += 1u << (length - table->root_bits)) {
+				buffer[offset + i] = HUFFMAN_ENTRY(n, length - table->root_bits);
 			}
-		}
-	}
-
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		if (tree->tree2d[n] == 32767) {
-			tree->tree2d[n] = 0;	/*remove possible remaining 32767's */
 		}
 	}
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in, unsigned long *bp, const huffman_tree* codetree, unsigned long inlength)
+static unsigned huffman_decode_symbol(upng_t *upng, bit_reader* reader, const huffman_table* table)
 {
-	unsigned treepos = 0, ct;
-	unsigned char bit;
-	for (;;) {
-		/* error: end of input memory reached without endcode */
-		if (((*bp) & 0x07) == 0 && ((*bp) >> 3) > inlength) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return 0;
-		}
+	unsigned entry;
 
-		bit = read_bit(bp, in);
+	/*a refill guarantees 57 bits, more than the longest code plus the extra bits that follow it */
+	bit_reader_refill(reader);
 
-		ct = codetree->tree2d[(treepos << 1) | bit];
-		if (ct < codetree->numcodes) {
-			return ct;
-		}
+	entry = table->entries[reader->buffer & ((1u << table->root_bits) - 1)];
+	if (entry & HUFFMAN_LINK) {
+		bit_reader_consume(reader, table->root_bits);
+		entry = table->entries[HUFFMAN_ENTRY_VALUE(entry) + (reader->buffer & ((1u << HUFFMAN_ENTRY_BITS(entry)) - 1))];
+	}
 
-		treepos = ct - codetree->numcodes;
-		if (treepos >= codetree->numcodes) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return 0;
-		}
+	/* error: the code doesn't exist in the tree */
+	if (HUFFMAN_ENTRY_BITS(entry) == 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+	bit_reader_consume(reader, HUFFMAN_ENTRY_BITS(entry));
+
+	/* error: end of input memory reached without endcode */
+	if (bit_reader_overrun(reader)) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
 	}
+	return HUFFMAN_ENTRY_VALUE(entry);
 }
 
 /* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, huffman_tree* codelengthcodetree, const unsigned char *in, unsigned long *bp, unsigned long inlength)
+static void get_tree_inflate_dynamic(upng_t* upng, huffman_table* codetree, unsigned* codetree_buffer, huffman_table* codetreeD, unsigned* codetreeD_buffer, bit_reader* reader)
 {
+	unsigned codelengthcodetree_buffer[HUFFMAN_TABLE_SIZE(NUM_CODE_LENGTH_CODES)];
+	huffman_table codelengthcodetree;
 	unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
 	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
 	unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
 	unsigned n, hlit, hdist, hclen, i;
 
-	/*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated */
-	/*C-code note: use no "return" between ctor and dtor of an uivector! */
-	if ((*bp) >> 3 >= inlength - 2) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
-
 	/* clear bitlen arrays */
 	memset(bitlen, 0, sizeof(bitlen));
 	memset(bitlenD, 0, sizeof(bitlenD));
 
-	/*the bit pointer is or will go past the memory */
-	hlit = read_bits(bp, in, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
-	hdist = read_bits(bp, in, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
-	hclen = read_bits(bp, in, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
+	hlit = read_bits(upng, reader, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
+	hdist = read_bits(upng, reader, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
+	hclen = read_bits(upng, reader, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
 
 	for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
 		if (i < hclen) {
-			codelengthcode[CLCL[i]] = read_bits(bp, in, 3);
+			codelengthcode[CLCL[i]] = read_bits(upng, reader, 3);
 		} else {
 			codelengthcode[CLCL[i]] = 0;	/*if not, it must stay 0 */
 		}
 	}
 
-	huffman_tree_create_lengths(upng, codelengthcodetree, codelengthcode);
+	/* bail now if the bit pointer went past the memory */
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	huffman_table_create_lengths(upng, &codelengthcodetree, codelengthcodetree_buffer, codelengthcode, NUM_CODE_LENGTH_CODES);
 
 	/* bail now if we encountered an error earlier */
 	if (upng->error != UPNG_EOK) {
@@ -336,7 +363,8 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	/*now we can use this tree to read the lengths for the tree that this function will return */
 	i = 0;
 	while (i < hlit + hdist) {	/*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
-		unsigned code = huffman_decode_symbol(upng, in, bp, codelengthcodetree, inlength);
+		unsigned code = huffman_decode_symbol(upng, reader, &codelengthcodetree);
+		unsigned replength, value;
 		if (upng->error != UPNG_EOK) {
 			break;
 		}
@@ -348,142 +376,102 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 				bitlenD[i - hlit] = code;
 			}
 			i++;
-		} else if (code == 16) {	/*repeat previous */
-			unsigned replength = 3;	/*read in the 2 bits that indicate repeat length (3-6) */
-			unsigned value;	/*set value to the previous code */
-
-			if ((*bp) >> 3 >= inlength) {
+			continue;
+		} else if (code == 16) {	/*repeat previous 3-6 times */
+			/* error: there is no previous length */
+			if (i == 0) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				break;
 			}
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 2);
-
-			if ((i - 1) < hlit) {
-				value = bitlen[i - 1];
-			} else {
-				value = bitlenD[i - hlit - 1];
-			}
-
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
-
-				if (i < hlit) {
-					bitlen[i] = value;
-				} else {
-					bitlenD[i - hlit] = value;
-				}
-				i++;
-			}
+			replength = 3 + read_bits(upng, reader, 2);
+			value = (i - 1) < hlit ? bitlen[i - 1] : bitlenD[i - hlit - 1];
 		} else if (code == 17) {	/*repeat "0" 3-10 times */
-			unsigned replength = 3;	/*read in the bits that indicate repeat length */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
-
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 3);
-
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* error: i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
-
-				if (i < hlit) {
-					bitlen[i] = 0;
-				} else {
-					bitlenD[i - hlit] = 0;
-				}
-				i++;
-			}
+			replength = 3 + read_bits(upng, reader, 3);
+			value = 0;
 		} else if (code == 18) {	/*repeat "0" 11-138 times */
-			unsigned replength = 11;	/*read in the bits that indicate repeat length */
-			/* error, bit pointer jumps past memory */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
-
-			replength += read_bits(bp, in, 7);
-
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
-				if (i < hlit)
-					bitlen[i] = 0;
-				else
-					bitlenD[i - hlit] = 0;
-				i++;
-			}
+			replength = 11 + read_bits(upng, reader, 7);
+			value = 0;
 		} else {
 			/* somehow an unexisting code appeared. This can never happen. */
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			break;
 		}
+
+		/* error: i is larger than the amount of codes, or the bit pointer jumped past memory */
+		if (i + replength > hlit + hdist || upng->error != UPNG_EOK) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			break;
+		}
+
+		/*repeat this value in the next lengths */
+		for (n = 0; n < replength; n++) {
+			if (i < hlit) {
+				bitlen[i] = value;
+			} else {
+				bitlenD[i - hlit] = value;
+			}
+			i++;
+		}
 	}
 
+	/*the length of the end code 256 must be larger than 0 */
 	if (upng->error == UPNG_EOK && bitlen[256] == 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 	}
 
-	/*the length of the end code 256 must be larger than 0 */
 	/*now we've finally got hlit and hdist, so generate the code trees, and the function is done */
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetree, bitlen);
+		huffman_table_create_lengths(upng, codetree, codetree_buffer, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
 	}
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetreeD, bitlenD);
+		huffman_table_create_lengths(upng, codetreeD, codetreeD_buffer, bitlenD, NUM_DISTANCE_SYMBOLS);
+	}
+}
+
+/*the fixed trees of btype 01, built from their code lengths */
+static void get_tree_inflate_fixed(upng_t* upng, huffman_table* codetree, unsigned* codetree_buffer, huffman_table* codetreeD, unsigned* codetreeD_buffer)
+{
+	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
+	unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
+	unsigned n;
+
+	for (n = 0; n < NUM_DEFLATE_CODE_SYMBOLS; n++) {
+		bitlen[n] = n <= 143 ? 8 : n <= 255 ? 9 : n <= 279 ? 7 : 8;
 	}
+	for (n = 0; n < NUM_DISTANCE_SYMBOLS; n++) {
+		bitlenD[n] = 5;
+	}
+
+	huffman_table_create_lengths(upng, codetree, codetree_buffer, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
+	huffman_table_create_lengths(upng, codetreeD, codetreeD_buffer, bitlenD, NUM_DISTANCE_SYMBOLS);
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength, unsigned btype)
+static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outsize, bit_reader* reader, unsigned long *pos, unsigned btype)
 {
-	unsigned codetree_buffer[DEFLATE_CODE_BUFFER_SIZE];
-	unsigned codetreeD_buffer[DISTANCE_BUFFER_SIZE];
-	unsigned done = 0;
+	unsigned codetree_buffer[HUFFMAN_TABLE_SIZE(NUM_DEFLATE_CODE_SYMBOLS)];
+	unsigned codetreeD_buffer[HUFFMAN_TABLE_SIZE(NUM_DISTANCE_SYMBOLS)];
 
-	huffman_tree codetree;
-	huffman_tree codetreeD;
+	huffman_table codetree;
+	huffman_table codetreeD;
 
 	if (btype == 1) {
-		/* fixed trees */
-		huffman_tree_init(&codetree, (unsigned*)FIXED_DEFLATE_CODE_TREE, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, (unsigned*)FIXED_DISTANCE_TREE, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-	} else if (btype == 2) {
-		/* dynamic trees */
-		unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
-		huffman_tree codelengthcodetree;
+		get_tree_inflate_fixed(upng, &codetree, codetree_buffer, &codetreeD, codetreeD_buffer);
+	} else {
+		get_tree_inflate_dynamic(upng, &codetree, codetree_buffer, &codetreeD, codetreeD_buffer, reader);
+	}
 
-		huffman_tree_init(&codetree, codetree_buffer, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, codetreeD_buffer, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-		huffman_tree_init(&codelengthcodetree, codelengthcodetree_buffer, NUM_CODE_LENGTH_CODES, CODE_LENGTH_BITLEN);
-		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, in, bp, inlength);
+	if (upng->error != UPNG_EOK) {
+		return;
 	}
 
-	while (done == 0) {
-		unsigned code = huffman_decode_symbol(upng, in, bp, &codetree, inlength);
+	for (;;) {
+		unsigned code = huffman_decode_symbol(upng, reader, &codetree);
 		if (upng->error != UPNG_EOK) {
 			return;
 		}
 
-		if (code == 256) {
-			/* end code */
-			done = 1;
-		} else if (code <= 255) {
+		if (code <= 255) {
 			/* literal symbol */
 			if ((*pos) >= outsize) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
@@ -492,24 +480,20 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 
 			/* store output */
 			out[(*pos)++] = (unsigned char)(code);
-		} else if (code >= FIRST_LENGTH_CODE_INDEX && code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
-			/* part 1: get length base */
-			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
-			unsigned codeD, distance, numextrabitsD;
-			unsigned long start, forward, backward, numextrabits;
-
-			/* part 2: get extra bits and add the value of that to length */
-			numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
+		} else if (code == 256) {
+			/* end code */
+			return;
+		} else if (code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
+			unsigned long length, distance;
+			unsigned codeD;
+			unsigned char* dest;
+			const unsigned char* src;
 
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
-			length += read_bits(bp, in, numextrabits);
+			/* part 1 and 2: get length base and add the value of the extra bits to it */
+			length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX] + read_bits(upng, reader, LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX]);
 
 			/*part 3: get distance code */
-			codeD = huffman_decode_symbol(upng, in, bp, &codetreeD, inlength);
+			codeD = huffman_decode_symbol(upng, reader, &codetreeD);
 			if (upng->error != UPNG_EOK) {
 				return;
 			}
@@ -520,60 +504,58 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 				return;
 			}
 
-			distance = DISTANCE_BASE[codeD];
-
-			/*part 4: get extra bits from distance */
-			numextrabitsD = DISTANCE_EXTRA[codeD];
-
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
+			/*part 4: get distance base and add the value of the extra bits to it */
+			distance = DISTANCE_BASE[codeD] + read_bits(upng, reader, DISTANCE_EXTRA[codeD]);
+			if (upng->error != UPNG_EOK) {
 				return;
 			}
 
-			distance += read_bits(bp, in, numextrabitsD);
-
-			/*part 5: fill in all the out[n] values based on the length and dist */
-			start = (*pos);
-			backward = start - distance;
-
-			if ((*pos) + length >= outsize) {
+			/* error: the distance points before the start of the output, or the copy runs past its end */
+			if (distance > (*pos) || (*pos) + length > outsize) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				return;
 			}
 
-			for (forward = 0; forward < length; forward++) {
-				out[(*pos)++] = out[backward];
-				backward++;
-
-				if (backward >= start) {
-					backward = start - distance;
+			/*part 5: fill in all the out[n] values based on the length and dist */
+			dest = out + (*pos);
+			src = dest - distance;
+			if (distance >= length) {
+				/* source and destination don't overlap */
+				memcpy(dest, src, length);
+			} else if (distance == 1) {
+				/* run of a single byte */
+				memset(dest, *src, length);
+			} else {
+				/* overlapping copy repeats the last distance bytes, it has to go byte by byte */
+				unsigned long n;
+				for (n = 0; n < length; n++) {
+					dest[n] = src[n];
 				}
 			}
+			(*pos) += length;
+		} else {
+			/* invalid length code (286-287 are never used) */
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
 		}
 	}
 }
 
-static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength)
+static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long outsize, bit_reader* reader, unsigned long *pos)
 {
-	unsigned long p;
-	unsigned len, nlen, n;
-
-	/* go to first boundary of byte */
-	while (((*bp) & 0x7) != 0) {
-		(*bp)++;
-	}
-	p = (*bp) / 8;		/*byte position */
+	/* go to first boundary of byte, the bytes the bit buffer holds beyond it are read again from the stream */
+	unsigned long p = (reader->pos * 8 - reader->count + 7) / 8;	/*byte position */
+	unsigned len, nlen;
 
 	/* read len (2 bytes) and nlen (2 bytes) */
-	if (p >= inlength - 4) {
+	if (p + 4 > reader->size) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	len = in[p] + 256 * in[p + 1];
+	len = reader->data[p] + 256 * reader->data[p + 1];
 	p += 2;
-	nlen = in[p] + 256 * in[p + 1];
+	nlen = reader->data[p] + 256 * reader->data[p + 1];
 	p += 2;
 
 	/* check if 16-bit nlen is really the one's complement of len */
@@ -582,53 +564,50 @@ static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long
 		return;
 	}
 
-	if ((*pos) + len >= outsize) {
+	if ((*pos) + len > outsize) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
 	/* read the literal data: len bytes are now stored in the out buffer */
-	if (p + len > inlength) {
+	if (p + len > reader->size) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	for (n = 0; n < len; n++) {
-		out[(*pos)++] = in[p++];
-	}
+	memcpy(out + (*pos), reader->data + p, len);
+	(*pos) += len;
 
-	(*bp) = p * 8;
+	reader->pos = p + len;
+	reader->buffer = 0;
+	reader->count = 0;
 }
 
 /*inflate the deflated data (cfr. deflate spec); return value is the error*/
 static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long insize, unsigned long inpos)
 {
-	unsigned long bp = 0;	/*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte) */
+	bit_reader reader;
 	unsigned long pos = 0;	/*byte position in the out buffer */
 
 	unsigned done = 0;
 
+	bit_reader_init(&reader, &in[inpos], insize - inpos);
+
 	while (done == 0) {
 		unsigned btype;
 
-		/* ensure next bit doesn't point past the end of the buffer */
-		if ((bp >> 3) >= insize) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
-
 		/* read block control bits */
-		done = read_bit(&bp, &in[inpos]);
-		btype = read_bit(&bp, &in[inpos]) | (read_bit(&bp, &in[inpos]) << 1);
+		done = read_bits(upng, &reader, 1);
+		btype = read_bits(upng, &reader, 2);
 
 		/* process control type appropriateyly */
-		if (btype == 3) {
+		if (upng->error != UPNG_EOK || btype == 3) {
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			return upng->error;
 		} else if (btype == 0) {
-			inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize);	/*no compression */
+			inflate_uncompressed(upng, out, outsize, &reader, &pos);	/*no compression */
 		} else {
-			inflate_huffman(upng, out, outsize, &in[inpos], &bp, &pos, insize, btype);	/*compression, btype 01 or 10 */
+			inflate_huffman(upng, out, outsize, &reader, &pos, btype);	/*compression, btype 01 or 10 */
 		}
 
 		/* stop if an error has occured */
@@ -688,6 +667,113 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+#if defined(__SSE2__)
+/*SSE2 (and SSSE3 when available) unfilter kernels for 3 and 4 byte pixels. Sub, Average and Paeth depend on the previous pixel, so they work one
+   pixel per step with all its channels in one register; Up has no such dependency and works 16 bytes at a time. libpng uses the same scheme */
+static __m128i load_pixel(const unsigned char *p, unsigned long bytewidth)
+{
+	int value;
+	/*a 3 byte pixel is assembled without touching the byte after it, that may be past the end of the image. it is not copied through memory
+	   because a 4 byte load right after a 3 byte store to the same place can't be forwarded and stalls */
+	if (bytewidth == 4)
+		memcpy(&value, p, 4);
+	else
+		value = p[0] | (p[1] << 8) | (p[2] << 16);
+	return _mm_cvtsi32_si128(value);
+}
+
+static void store_pixel(unsigned char *p, __m128i pixel, unsigned long bytewidth)
+{
+	int value = _mm_cvtsi128_si32(pixel);
+	if (bytewidth == 4) {
+		memcpy(p, &value, 4);
+	} else {
+		p[0] = (unsigned char)value;
+		p[1] = (unsigned char)(value >> 8);
+		p[2] = (unsigned char)(value >> 16);
+	}
+}
+
+static void unfilter_sub_sse2(unsigned char *recon, const unsigned char *scanline, unsigned long bytewidth, unsigned long length)
+{
+	__m128i a = _mm_setzero_si128();
+	unsigned long i;
+	for (i = 0; i < length; i += bytewidth) {
+		a = _mm_add_epi8(a, load_pixel(&scanline[i], bytewidth));
+		store_pixel(&recon[i], a, bytewidth);
+	}
+}
+
+static void unfilter_up_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i;
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+		_mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+	}
+	for (; i < length; i++)
+		recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilter_average_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned long length)
+{
+	__m128i a = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi8(1);
+	unsigned long i;
+	for (i = 0; i < length; i += bytewidth) {
+		__m128i b = load_pixel(&precon[i], bytewidth);
+		/*_mm_avg_epu8 rounds up, the filter rounds down: subtract the lost low bit */
+		__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+		a = _mm_add_epi8(average, load_pixel(&scanline[i], bytewidth));
+		store_pixel(&recon[i], a, bytewidth);
+	}
+}
+
+static __m128i abs_epi16(__m128i x)
+{
+#if defined(__SSSE3__)
+	return _mm_abs_epi16(x);
+#else
+	__m128i negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+	return _mm_sub_epi16(_mm_xor_si128(x, negative), negative);
+#endif
+}
+
+static __m128i select_epi16(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void unfilter_paeth_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned long length)
+{
+	/*the predictor works on 16 bit channels: left (a), above (b) and upper left (c) of the current pixel. the first pixel has a = c = 0 */
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero, c = zero;
+	unsigned long i;
+	for (i = 0; i < length; i += bytewidth) {
+		__m128i b = _mm_unpacklo_epi8(load_pixel(&precon[i], bytewidth), zero);
+		__m128i pa = _mm_sub_epi16(b, c);	/*p - a where p = a + b - c */
+		__m128i pb = _mm_sub_epi16(a, c);	/*p - b */
+		__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));	/*p - c */
+		__m128i smallest, nearest;
+		pa = abs_epi16(pa);
+		pb = abs_epi16(pb);
+		smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+		/*ties go to a, then b, then c */
+		nearest = select_epi16(_mm_cmpeq_epi16(smallest, pb), b, c);
+		nearest = select_epi16(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+
+		nearest = _mm_add_epi8(_mm_packus_epi16(nearest, nearest), load_pixel(&scanline[i], bytewidth));
+		store_pixel(&recon[i], nearest, bytewidth);
+
+		a = _mm_unpacklo_epi8(nearest, zero);
+		c = b;
+	}
+}
+#endif
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
 {
 	/*
@@ -699,6 +785,26 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 	 */
 
 	unsigned long i;
+
+#if defined(__SSE2__)
+	/*vectorized kernels for 8 bit RGB and RGBA, the first scanline (no precon) is left to the scalar code */
+	if ((bytewidth == 3 || bytewidth == 4) && length % bytewidth == 0) {
+		if (filterType == 1) {
+			unfilter_sub_sse2(recon, scanline, bytewidth, length);
+			return;
+		} else if (precon && filterType == 2) {
+			unfilter_up_sse2(recon, scanline, precon, length);
+			return;
+		} else if (precon && filterType == 3) {
+			unfilter_average_sse2(recon, scanline, precon, bytewidth, length);
+			return;
+		} else if (precon && filterType == 4) {
+			unfilter_paeth_sse2(recon, scanline, precon, bytewidth, length);
+			return;
+		}
+	}
+#endif
+
 	switch (filterType) {
 	case 0:
 		for (i = 0; i < length; i++)
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "vertex_buffer.h"
+
+#define VERTEX_BUFFER_NUM_STREAMS 8
+
+///////////////////////////////////////////////////////////////////////////////
+// malloc() with a power of two alignment, the offset to the start of the
+// malloc'ed block is kept right before the returned pointer
+///////////////////////////////////////////////////////////////////////////////
+void* aligned_malloc(size_t size, size_t alignment) {
+	unsigned char* block = (unsigned char*)malloc(size + alignment + sizeof(size_t));
+	if (block == NULL) {
+		return NULL;
+	}
+	uintptr_t start = (uintptr_t)(block + sizeof(size_t));
+	unsigned char* aligned = (unsigned char*)((start + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	size_t offset = aligned - block;
+	memcpy(aligned - sizeof(size_t), &offset, sizeof(size_t));
+	return aligned;
+}
+
+void aligned_free(void* pointer) {
+	if (pointer == NULL) {
+		return;
+	}
+	size_t offset;
+	memcpy(&offset, (unsigned char*)pointer - sizeof(size_t), sizeof(size_t));
+	free((unsigned char*)pointer - offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocate zeroed streams for the given number of vertices
+///////////////////////////////////////////////////////////////////////////////
+// All the streams share one allocation. The stride is a multiple of the
+// padding, so if the first stream is aligned all the others are as well.
+///////////////////////////////////////////////////////////////////////////////
+void init_vertex_buffer(vertex_buffer_t* buffer, int num_vertices) {
+	int stride = (num_vertices + VERTEX_BUFFER_PADDING - 1) / VERTEX_BUFFER_PADDING * VERTEX_BUFFER_PADDING;
+	if (stride == 0) {
+		stride = VERTEX_BUFFER_PADDING;
+	}
+	size_t size = sizeof(float) * stride * VERTEX_BUFFER_NUM_STREAMS;
+	float* streams = (float*)aligned_malloc(size, VERTEX_BUFFER_ALIGNMENT);
+	memset(streams, 0, size);
+
+	buffer->memory = streams;
+	buffer->stride = stride;
+	buffer->num_vertices = num_vertices;
+	buffer->x = streams + stride * 0;
+	buffer->y = streams + stride * 1;
+	buffer->z = streams + stride * 2;
+	buffer->u = streams + stride * 3;
+	buffer->v = streams + stride * 4;
+	buffer->nx = streams + stride * 5;
+	buffer->ny = streams + stride * 6;
+	buffer->nz = streams + stride * 7;
+}
+
+void free_vertex_buffer(vertex_buffer_t* buffer) {
+	aligned_free(buffer->memory);
+	memset(buffer, 0, sizeof(vertex_buffer_t));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move every vertex i to position remap[i] in all the streams
+///////////////////////////////////////////////////////////////////////////////
+void remap_vertex_buffer(vertex_buffer_t* buffer, int* remap) {
+	int num_vertices = buffer->num_vertices;
+	float* sorted = (float*)malloc(sizeof(float) * (num_vertices > 0 ? num_vertices : 1));
+	float* streams[VERTEX_BUFFER_NUM_STREAMS] = {
+		buffer->x, buffer->y, buffer->z, buffer->u, buffer->v, buffer->nx, buffer->ny, buffer->nz
+	};
+	for (int s = 0; s < VERTEX_BUFFER_NUM_STREAMS; s++) {
+		for (int i = 0; i < num_vertices; i++) {
+			sorted[remap[i]] = streams[s][i];
+		}
+		memcpy(streams[s], sorted, sizeof(float) * num_vertices);
+	}
+	free(sorted);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Smooth vertex normals: the area weighted sum of the normals of the faces
+// that use each vertex
+///////////////////////////////////////////////////////////////////////////////
+void compute_vertex_normals(vertex_buffer_t* buffer, int* indices, int num_indices) {
+	memset(buffer->nx, 0, sizeof(float) * buffer->num_vertices);
+	memset(buffer->ny, 0, sizeof(float) * buffer->num_vertices);
+	memset(buffer->nz, 0, sizeof(float) * buffer->num_vertices);
+
+	for (int i = 0; i + 2 < num_indices; i += 3) {
+		int a = indices[i + 0];
+		int b = indices[i + 1];
+		int c = indices[i + 2];
+
+		// Same winding as get_triangle_normal(), the length is twice the face area
+		float abx = buffer->x[b] - buffer->x[a], aby = buffer->y[b] - buffer->y[a], abz = buffer->z[b] - buffer->z[a];
+		float acx = buffer->x[c] - buffer->x[a], acy = buffer->y[c] - buffer->y[a], acz = buffer->z[c] - buffer->z[a];
+		float nx = aby * acz - abz * acy;
+		float ny = abz * acx - abx * acz;
+		float nz = abx * acy - aby * acx;
+
+		int corners[3] = { a, b, c };
+		for (int j = 0; j < 3; j++) {
+			buffer->nx[corners[j]] += nx;
+			buffer->ny[corners[j]] += ny;
+			buffer->nz[corners[j]] += nz;
+		}
+	}
+
+	for (int i = 0; i < buffer->num_vertices; i++) {
+		float length = sqrtf(buffer->nx[i] * buffer->nx[i] + buffer->ny[i] * buffer->ny[i] + buffer->nz[i] * buffer->nz[i]);
+		if (length > 0) {
+			buffer->nx[i] /= length;
+			buffer->ny[i] /= length;
+			buffer->nz[i] /= length;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef VERTEX_BUFFER_H
+#define VERTEX_BUFFER_H
+
+#include <stddef.h>
+
+// Every stream starts on a 32 byte boundary (one AVX register)
+#define VERTEX_BUFFER_ALIGNMENT 32
+
+// Streams are padded with zeros to a multiple of 8 floats, so SIMD loops can
+// run past the last vertex without a scalar tail
+#define VERTEX_BUFFER_PADDING 8
+
+///////////////////////////////////////////////////////////////////////////////
+// Mesh vertices stored as one array per attribute (structure of arrays)
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	float* x;          // Model space position
+	float* y;
+	float* z;
+	float* u;          // Texture coordinates
+	float* v;
+	float* nx;         // Model space vertex normal
+	float* ny;
+	float* nz;
+	int num_vertices;  // Number of vertices in use
+	int stride;        // Number of floats reserved for each stream (padded)
+	void* memory;      // Aligned allocation that backs all the streams (released with aligned_free())
+} vertex_buffer_t;
+
+void* aligned_malloc(size_t size, size_t alignment);
+void aligned_free(void* pointer);
+
+void init_vertex_buffer(vertex_buffer_t* buffer, int num_vertices);
+void free_vertex_buffer(vertex_buffer_t* buffer);
+void remap_vertex_buffer(vertex_buffer_t* buffer, int* remap);
+void compute_vertex_normals(vertex_buffer_t* buffer, int* indices, int num_indices);
+
+#endif
@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "array.h"
+#include "vertex_cache.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Make room for the given number of transformed vertices
+///////////////////////////////////////////////////////////////////////////////
+static void reserve_vertex_cache(vertex_cache_t* cache, int num_vertices) {
+	if (num_vertices <= cache->capacity) {
+		return;
+	}
+	int capacity = (num_vertices + VERTEX_BUFFER_PADDING - 1) / VERTEX_BUFFER_PADDING * VERTEX_BUFFER_PADDING;
+	aligned_free(cache->memory);
+	float* arrays = (float*)aligned_malloc(sizeof(float) * capacity * 5, VERTEX_BUFFER_ALIGNMENT);
+	cache->memory = arrays;
+	cache->x = arrays;
+	cache->y = arrays + capacity;
+	cache->z = arrays + capacity * 2;
+	cache->light = arrays + capacity * 3;
+	cache->shadowed_light = arrays + capacity * 4;
+	cache->capacity = capacity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform a range of mesh vertices to camera space
+///////////////////////////////////////////////////////////////////////////////
+// The world view matrix is affine, so w stays 1 and is not stored. The cache
+// holds one range at a time: the vertices of the meshlet being processed.
+///////////////////////////////////////////////////////////////////////////////
+void transform_vertex_range(vertex_cache_t* cache, mat4_t* matrix, vertex_buffer_t* vertices, int first_vertex, int num_vertices) {
+	reserve_vertex_cache(cache, num_vertices);
+	cache->first_vertex = first_vertex;
+	mat4_transform_points_soa(
+		matrix,
+		&vertices->x[first_vertex], &vertices->y[first_vertex], &vertices->z[first_vertex],
+		cache->x, cache->y, cache->z, NULL,
+		num_vertices
+	);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Light the vertices of the range last transformed (Gouraud shading)
+///////////////////////////////////////////////////////////////////////////////
+// The light vector is the inverse light direction in model space scaled by
+// the light intensity, so the light of a vertex is the dot product with its
+// model space normal, clamped to 0.0 - 1.0. Lighting in model space saves
+// transforming the normals, it is exact for rotations and uniform scales.
+// The shadowed light starts at 0.0, the vertices get no other light yet.
+///////////////////////////////////////////////////////////////////////////////
+void light_vertex_range(vertex_cache_t* cache, vec3_t light_vector, vertex_buffer_t* vertices, int first_vertex, int num_vertices) {
+	float* nx = &vertices->nx[first_vertex];
+	float* ny = &vertices->ny[first_vertex];
+	float* nz = &vertices->nz[first_vertex];
+	int i = 0;
+
+#if defined(__SSE2__)
+	__m128 lx = _mm_set1_ps(light_vector.x);
+	__m128 ly = _mm_set1_ps(light_vector.y);
+	__m128 lz = _mm_set1_ps(light_vector.z);
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0);
+	for (; i + 4 <= num_vertices; i += 4) {
+		__m128 light = _mm_mul_ps(_mm_loadu_ps(&nx[i]), lx);
+		light = _mm_add_ps(light, _mm_mul_ps(_mm_loadu_ps(&ny[i]), ly));
+		light = _mm_add_ps(light, _mm_mul_ps(_mm_loadu_ps(&nz[i]), lz));
+		light = _mm_min_ps(_mm_max_ps(light, zero), one);
+		_mm_storeu_ps(&cache->light[i], light);
+		_mm_storeu_ps(&cache->shadowed_light[i], zero);
+	}
+#endif
+	for (; i < num_vertices; i++) {
+		float light = nx[i] * light_vector.x + ny[i] * light_vector.y + nz[i] * light_vector.z;
+		cache->light[i] = light < 0 ? 0 : (light > 1 ? 1 : light);
+		cache->shadowed_light[i] = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Light of the local lights at one camera space vertex with a unit normal
+///////////////////////////////////////////////////////////////////////////////
+static float get_local_light_at(light_list_t* lights, float px, float py, float pz, float nx, float ny, float nz) {
+	float light = 0;
+	for (int j = 0; j < lights->count; j++) {
+		float dx = lights->x[j] - px;
+		float dy = lights->y[j] - py;
+		float dz = lights->z[j] - pz;
+		float distance_squared = fmaxf(dx * dx + dy * dy + dz * dz, 1e-6);
+		float inv_distance = 1 / sqrtf(distance_squared);
+
+		float n_dot_l = fmaxf(0, (nx * dx + ny * dy + nz * dz) * inv_distance);
+		float falloff = fmaxf(0, 1 - distance_squared * lights->inv_range_squared[j]);
+		float cone = -(lights->axis_x[j] * dx + lights->axis_y[j] * dy + lights->axis_z[j] * dz) * inv_distance;
+		float spot = fminf(fmaxf((cone - lights->cos_outer[j]) * lights->inv_cone[j], 0), 1);
+		light += n_dot_l * (falloff * falloff) * (spot * lights->intensity[j]);
+	}
+	return light;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Add the light of the local (point and spot) lights to the vertices of the
+// range last transformed and lit
+///////////////////////////////////////////////////////////////////////////////
+// The lights are in camera space like the cached positions, the normals are
+// moved to camera space with the world view matrix. Every light fades out
+// smoothly towards its range, spot lights also between their cone angles.
+// Four vertices are lit at a time against each light of the list, with the
+// same single precision steps as the scalar tail so a vertex gets the same
+// light in either path. The local lights are also added to the shadowed light,
+// since only the directional light casts shadows.
+///////////////////////////////////////////////////////////////////////////////
+void light_vertex_range_local(vertex_cache_t* cache, light_list_t* lights, mat4_t* matrix, vertex_buffer_t* vertices, int first_vertex, int num_vertices) {
+	float* nx = &vertices->nx[first_vertex];
+	float* ny = &vertices->ny[first_vertex];
+	float* nz = &vertices->nz[first_vertex];
+	float (*m)[4] = matrix->m;
+	int i = 0;
+
+#if defined(__SSE2__)
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0);
+	__m128 epsilon = _mm_set1_ps(1e-6);
+	for (; i + 4 <= num_vertices; i += 4) {
+		// Camera space unit normals
+		__m128 mnx = _mm_loadu_ps(&nx[i]);
+		__m128 mny = _mm_loadu_ps(&ny[i]);
+		__m128 mnz = _mm_loadu_ps(&nz[i]);
+		__m128 cnx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mnx, _mm_set1_ps(m[0][0])), _mm_mul_ps(mny, _mm_set1_ps(m[0][1]))), _mm_mul_ps(mnz, _mm_set1_ps(m[0][2])));
+		__m128 cny = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mnx, _mm_set1_ps(m[1][0])), _mm_mul_ps(mny, _mm_set1_ps(m[1][1]))), _mm_mul_ps(mnz, _mm_set1_ps(m[1][2])));
+		__m128 cnz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mnx, _mm_set1_ps(m[2][0])), _mm_mul_ps(mny, _mm_set1_ps(m[2][1]))), _mm_mul_ps(mnz, _mm_set1_ps(m[2][2])));
+		__m128 inv_length = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cnx, cnx), _mm_mul_ps(cny, cny)), _mm_mul_ps(cnz, cnz)), epsilon)));
+		cnx = _mm_mul_ps(cnx, inv_length);
+		cny = _mm_mul_ps(cny, inv_length);
+		cnz = _mm_mul_ps(cnz, inv_length);
+
+		__m128 px = _mm_load_ps(&cache->x[i]);
+		__m128 py = _mm_load_ps(&cache->y[i]);
+		__m128 pz = _mm_load_ps(&cache->z[i]);
+		__m128 light = _mm_setzero_ps();
+		for (int j = 0; j < lights->count; j++) {
+			__m128 dx = _mm_sub_ps(_mm_set1_ps(lights->x[j]), px);
+			__m128 dy = _mm_sub_ps(_mm_set1_ps(lights->y[j]), py);
+			__m128 dz = _mm_sub_ps(_mm_set1_ps(lights->z[j]), pz);
+			__m128 distance_squared = _mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)), epsilon);
+			__m128 inv_distance = _mm_div_ps(one, _mm_sqrt_ps(distance_squared));
+
+			__m128 n_dot_l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cnx, dx), _mm_mul_ps(cny, dy)), _mm_mul_ps(cnz, dz));
+			n_dot_l = _mm_max_ps(_mm_mul_ps(n_dot_l, inv_distance), zero);
+			__m128 falloff = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(distance_squared, _mm_set1_ps(lights->inv_range_squared[j]))), zero);
+			__m128 cone = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(lights->axis_x[j]), dx), _mm_mul_ps(_mm_set1_ps(lights->axis_y[j]), dy)), _mm_mul_ps(_mm_set1_ps(lights->axis_z[j]), dz));
+			cone = _mm_sub_ps(zero, _mm_mul_ps(cone, inv_distance));
+			__m128 spot = _mm_mul_ps(_mm_sub_ps(cone, _mm_set1_ps(lights->cos_outer[j])), _mm_set1_ps(lights->inv_cone[j]));
+			spot = _mm_min_ps(_mm_max_ps(spot, zero), one);
+
+			__m128 contribution = _mm_mul_ps(_mm_mul_ps(n_dot_l, _mm_mul_ps(falloff, falloff)), _mm_mul_ps(spot, _mm_set1_ps(lights->intensity[j])));
+			light = _mm_add_ps(light, contribution);
+		}
+		_mm_store_ps(&cache->light[i], _mm_min_ps(_mm_add_ps(_mm_load_ps(&cache->light[i]), light), one));
+		_mm_store_ps(&cache->shadowed_light[i], _mm_min_ps(_mm_add_ps(_mm_load_ps(&cache->shadowed_light[i]), light), one));
+	}
+#endif
+	for (; i < num_vertices; i++) {
+		float cnx = m[0][0] * nx[i] + m[0][1] * ny[i] + m[0][2] * nz[i];
+		float cny = m[1][0] * nx[i] + m[1][1] * ny[i] + m[1][2] * nz[i];
+		float cnz = m[2][0] * nx[i] + m[2][1] * ny[i] + m[2][2] * nz[i];
+		float inv_length = 1 / sqrtf(fmaxf(cnx * cnx + cny * cny + cnz * cnz, 1e-6));
+		float light = get_local_light_at(lights, cache->x[i], cache->y[i], cache->z[i], cnx * inv_length, cny * inv_length, cnz * inv_length);
+		cache->light[i] = fminf(cache->light[i] + light, 1);
+		cache->shadowed_light[i] = fminf(cache->shadowed_light[i] + light, 1);
+	}
+}
+
+vec4_t get_cached_vertex(vertex_cache_t* cache, int index) {
+	int i = index - cache->first_vertex;
+	vec4_t vertex = { cache->x[i], cache->y[i], cache->z[i], 1.0 };
+	return vertex;
+}
+
+float get_cached_vertex_light(vertex_cache_t* cache, int index) {
+	return cache->light[index - cache->first_vertex];
+}
+
+float get_cached_vertex_shadowed_light(vertex_cache_t* cache, int index) {
+	return cache->shadowed_light[index - cache->first_vertex];
+}
+
+void free_vertex_cache(vertex_cache_t* cache) {
+	aligned_free(cache->memory);
+	memset(cache, 0, sizeof(vertex_cache_t));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Average cache miss ratio: transformed vertices per triangle for a FIFO cache
+// 3.0 is the worst case (no reuse), ~0.5-0.7 is typical for an optimized mesh
+///////////////////////////////////////////////////////////////////////////////
+float get_mesh_acmr(mesh_t* mesh) {
+	int num_faces = get_mesh_num_faces(mesh);
+	if (num_faces == 0) {
+		return 0;
+	}
+
+	int fifo[VERTEX_CACHE_SIMULATED_SIZE];
+	int fifo_head = 0;
+	int misses = 0;
+	for (int i = 0; i < VERTEX_CACHE_SIMULATED_SIZE; i++) {
+		fifo[i] = -1;
+	}
+
+	for (int i = 0; i < num_faces; i++) {
+		int* indices = &mesh->indices[i * 3];
+		for (int j = 0; j < 3; j++) {
+			bool hit = false;
+			for (int k = 0; k < VERTEX_CACHE_SIMULATED_SIZE; k++) {
+				if (fifo[k] == indices[j]) {
+					hit = true;
+					break;
+				}
+			}
+			if (!hit) {
+				fifo[fifo_head] = indices[j];
+				fifo_head = (fifo_head + 1) % VERTEX_CACHE_SIMULATED_SIZE;
+				misses++;
+			}
+		}
+	}
+	return (float)misses / num_faces;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex score from "Linear-Speed Vertex Cache Optimisation" (Tom Forsyth)
+///////////////////////////////////////////////////////////////////////////////
+// The score rewards vertices that are already in the cache (but slightly less
+// the three most recent ones, as they belong to the triangle just emitted) and
+// vertices with few remaining triangles, so that lone triangles are not left
+// behind to be picked up later without any reuse.
+///////////////////////////////////////////////////////////////////////////////
+static float forsyth_vertex_score(int cache_position, int remaining_valence) {
+	if (remaining_valence == 0) {
+		return -1.0;
+	}
+
+	float score = 0;
+	if (cache_position >= 0) {
+		if (cache_position < 3) {
+			score = 0.75;
+		} else {
+			float scaler = 1.0 / (VERTEX_CACHE_OPTIMIZE_SIZE - 3);
+			score = 1.0 - (cache_position - 3) * scaler;
+			score = powf(score, 1.5);
+		}
+	}
+
+	score += 2.0 * powf((float)remaining_valence, -0.5);
+	return score;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reorder the faces of a mesh to maximize post-transform vertex cache hits
+///////////////////////////////////////////////////////////////////////////////
+void optimize_mesh_face_order(mesh_t* mesh) {
+	int num_faces = get_mesh_num_faces(mesh);
+	int num_vertices = mesh->vertices.num_vertices;
+	if (num_faces == 0 || num_vertices == 0) {
+		return;
+	}
+
+	// Per vertex state: remaining valence, cache position, score and list of active faces
+	int* valence = (int*)calloc(num_vertices, sizeof(int));
+	int* cache_position = (int*)malloc(sizeof(int) * num_vertices);
+	float* vertex_score = (float*)malloc(sizeof(float) * num_vertices);
+	int* adjacency_start = (int*)malloc(sizeof(int) * (num_vertices + 1));
+	int* adjacency = (int*)malloc(sizeof(int) * num_faces * 3);
+
+	// Per face state: score and whether it has been emitted already
+	float* face_score = (float*)malloc(sizeof(float) * num_faces);
+	bool* face_added = (bool*)calloc(num_faces, sizeof(bool));
+	int* sorted_indices = (int*)malloc(sizeof(int) * num_faces * 3);
+
+	// Build the vertex -> face adjacency lists
+	for (int i = 0; i < num_faces * 3; i++) {
+		valence[mesh->indices[i]]++;
+	}
+	adjacency_start[0] = 0;
+	for (int v = 0; v < num_vertices; v++) {
+		adjacency_start[v + 1] = adjacency_start[v] + valence[v];
+		valence[v] = 0;
+	}
+	for (int i = 0; i < num_faces; i++) {
+		int* indices = &mesh->indices[i * 3];
+		for (int j = 0; j < 3; j++) {
+			adjacency[adjacency_start[indices[j]] + valence[indices[j]]++] = i;
+		}
+	}
+
+	// Initial scores with an empty cache
+	for (int v = 0; v < num_vertices; v++) {
+		cache_position[v] = -1;
+		vertex_score[v] = forsyth_vertex_score(-1, valence[v]);
+	}
+	for (int i = 0; i < num_faces; i++) {
+		int* indices = &mesh->indices[i * 3];
+		face_score[i] = vertex_score[indices[0]] + vertex_score[indices[1]] + vertex_score[indices[2]];
+	}
+
+	// The LRU cache has three extra slots for the vertices pushed out by the last triangle
+	int cache[VERTEX_CACHE_OPTIMIZE_SIZE + 3];
+	int cache_size = 0;
+
+	int best_face = -1;
+	float best_score = -1;
+	for (int i = 0; i < num_faces; i++) {
+		if (face_score[i] > best_score) {
+			best_score = face_score[i];
+			best_face = i;
+		}
+	}
+
+	int next_unadded = 0;
+	for (int output = 0; output < num_faces; output++) {
+		// Fall back to the first face that was not emitted when nothing in the cache scores
+		if (best_face < 0) {
+			while (face_added[next_unadded]) {
+				next_unadded++;
+			}
+			best_face = next_unadded;
+		}
+
+		int indices[3] = { mesh->indices[best_face * 3 + 0], mesh->indices[best_face * 3 + 1], mesh->indices[best_face * 3 + 2] };
+		memcpy(&sorted_indices[output * 3], indices, sizeof(indices));
+		face_added[best_face] = true;
+
+		// Remove the emitted face from the active adjacency of its vertices
+		for (int j = 0; j < 3; j++) {
+			int v = indices[j];
+			int* faces_of_v = &adjacency[adjacency_start[v]];
+			for (int k = 0; k < valence[v]; k++) {
+				if (faces_of_v[k] == best_face) {
+					faces_of_v[k] = faces_of_v[valence[v] - 1];
+					valence[v]--;
+					break;
+				}
+			}
+		}
+
+		// Move the three vertices to the front of the LRU cache
+		int new_cache[VERTEX_CACHE_OPTIMIZE_SIZE + 3];
+		int new_cache_size = 0;
+		for (int j = 0; j < 3; j++) {
+			new_cache[new_cache_size++] = indices[j];
+		}
+		for (int k = 0; k < cache_size; k++) {
+			int v = cache[k];
+			if (v != indices[0] && v != indices[1] && v != indices[2]) {
+				new_cache[new_cache_size++] = v;
+			}
+		}
+
+		// Update the scores of every vertex that is, or just was, in the cache
+		for (int k = 0; k < new_cache_size; k++) {
+			int v = new_cache[k];
+			cache_position[v] = (k < VERTEX_CACHE_OPTIMIZE_SIZE) ? k : -1;
+			vertex_score[v] = forsyth_vertex_score(cache_position[v], valence[v]);
+		}
+
+		// Rescore the faces touching the cache and pick the best one for the next step
+		best_face = -1;
+		best_score = -1;
+		for (int k = 0; k < new_cache_size; k++) {
+			int v = new_cache[k];
+			for (int f = 0; f < valence[v]; f++) {
+				int face_index = adjacency[adjacency_start[v] + f];
+				int* candidate = &mesh->indices[face_index * 3];
+				float score = vertex_score[candidate[0]] + vertex_score[candidate[1]] + vertex_score[candidate[2]];
+				face_score[face_index] = score;
+				if (score > best_score) {
+					best_score = score;
+					best_face = face_index;
+				}
+			}
+		}
+
+		// Drop the vertices that fell out of the cache
+		cache_size = new_cache_size < VERTEX_CACHE_OPTIMIZE_SIZE ? new_cache_size : VERTEX_CACHE_OPTIMIZE_SIZE;
+		memcpy(cache, new_cache, sizeof(int) * cache_size);
+	}
+
+	memcpy(mesh->indices, sorted_indices, sizeof(int) * num_faces * 3);
+
+	free(valence);
+	free(cache_position);
+	free(vertex_score);
+	free(adjacency_start);
+	free(adjacency);
+	free(face_score);
+	free(face_added);
+	free(sorted_indices);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reorder the vertices of a mesh in the order they are first used by faces,
+// so that the vertex fetches of consecutive faces stay close in memory
+///////////////////////////////////////////////////////////////////////////////
+void optimize_mesh_vertex_order(mesh_t* mesh) {
+	int num_indices = array_length(mesh->indices);
+	int num_vertices = mesh->vertices.num_vertices;
+	if (num_vertices == 0) {
+		return;
+	}
+
+	int* remap = (int*)malloc(sizeof(int) * num_vertices);
+	for (int v = 0; v < num_vertices; v++) {
+		remap[v] = -1;
+	}
+
+	int next_index = 0;
+	for (int i = 0; i < num_indices; i++) {
+		if (remap[mesh->indices[i]] < 0) {
+			remap[mesh->indices[i]] = next_index++;
+		}
+		mesh->indices[i] = remap[mesh->indices[i]];
+	}
+
+	// Vertices that are not referenced by any face are kept at the end
+	for (int v = 0; v < num_vertices; v++) {
+		if (remap[v] < 0) {
+			remap[v] = next_index++;
+		}
+	}
+	remap_vertex_buffer(&mesh->vertices, remap);
+
+	free(remap);
+}
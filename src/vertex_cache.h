@@ -0,0 +1,50 @@
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "light.h"
+
+// Size of the simulated FIFO cache used to measure the ACMR of a face order
+#define VERTEX_CACHE_SIMULATED_SIZE 16
+
+// Size of the LRU cache modelled by the face reordering scores (Forsyth)
+#define VERTEX_CACHE_OPTIMIZE_SIZE 32
+
+///////////////////////////////////////////////////////////////////////////////
+// Post-transform vertex cache: camera space positions and light intensities
+// of a range of vertices
+///////////////////////////////////////////////////////////////////////////////
+// The positions are kept as separate x, y and z arrays like the mesh vertex
+// buffer, so whole vertex ranges are transformed with the SIMD batch transform.
+// Every geometry worker has its own cache.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	float* x;               // Camera space positions of the transformed vertices
+	float* y;
+	float* z;
+	float* light;           // Light intensity of the transformed vertices, 0.0 - 1.0
+	float* shadowed_light;  // Light intensity without the directional light (where it is shadowed)
+	int first_vertex;       // Mesh index of the vertex stored at position 0
+	int capacity;           // Number of allocated entries in each array
+	void* memory;           // Aligned block that holds the five arrays
+} vertex_cache_t;
+
+void transform_vertex_range(vertex_cache_t* cache, mat4_t* matrix, vertex_buffer_t* vertices, int first_vertex, int num_vertices);
+void light_vertex_range(vertex_cache_t* cache, vec3_t light_vector, vertex_buffer_t* vertices, int first_vertex, int num_vertices);
+void light_vertex_range_local(vertex_cache_t* cache, light_list_t* lights, mat4_t* matrix, vertex_buffer_t* vertices, int first_vertex, int num_vertices);
+vec4_t get_cached_vertex(vertex_cache_t* cache, int index);
+float get_cached_vertex_light(vertex_cache_t* cache, int index);
+float get_cached_vertex_shadowed_light(vertex_cache_t* cache, int index);
+void free_vertex_cache(vertex_cache_t* cache);
+
+///////////////////////////////////////////////////////////////////////////////
+// Load-time optimization of the mesh face and vertex order
+///////////////////////////////////////////////////////////////////////////////
+float get_mesh_acmr(mesh_t* mesh);
+void optimize_mesh_face_order(mesh_t* mesh);
+void optimize_mesh_vertex_order(mesh_t* mesh);
+
+#endif